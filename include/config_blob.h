@@ -0,0 +1,120 @@
+#pragma once
+// Versioned settings blob: a fixed header (magic, layout version, body size,
+// CRC-32 of the body) followed by the body. Fields are only ever appended to
+// CfgBody, so an older blob decodes as a prefix (new fields keep their
+// defaults) and a newer one is cut to the fields this build knows.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+static const uint32_t CFG_MAGIC   = 0x31474643;  // "CFG1"
+static const uint16_t CFG_VERSION = 2;  // v2: + powerProfile
+
+struct __attribute__((packed)) CfgHeader {
+  uint32_t magic;
+  uint16_t version;  // layout that wrote the blob
+  uint16_t size;     // body bytes
+  uint32_t crc;      // CRC-32 (IEEE) of the body
+};
+
+// Layout v2. Strings are NUL-terminated; the array size bounds each setting.
+struct __attribute__((packed)) CfgBody {
+  // WiFi
+  char     wifiSsid[33];
+  char     wifiPass[65];
+  uint32_t wifiIp, wifiGateway, wifiSubnet, wifiDns;  // static IPv4, 0 = DHCP
+  uint8_t  wifiBssid[6];
+  uint8_t  wifiChannel;     // cached AP, 0 = unknown
+  // MQTT
+  uint8_t  mqttEnabled;
+  char     mqttHost[97];
+  uint16_t mqttPort;
+  char     mqttUser[65];
+  char     mqttPass[129];
+  char     mqttBase[128];
+  char     mqttStateTopic[128];
+  uint16_t mqttRate;
+  uint8_t  mqttStateFormat;
+  uint8_t  mqttTls;
+  uint8_t  mqttHa;
+  // v2
+  uint8_t  powerProfile;    // 0 performance, 1 balanced, 2 low
+};
+
+static const size_t CFG_BLOB_MAX = sizeof(CfgHeader) + sizeof(CfgBody);
+
+enum CfgStatus : uint8_t { CFG_OK, CFG_EMPTY, CFG_BAD_MAGIC, CFG_BAD_SIZE, CFG_BAD_CRC };
+
+inline const char* cfgStatusStr(CfgStatus s) {
+  switch (s) {
+    case CFG_OK:        return "ok";
+    case CFG_EMPTY:     return "empty";
+    case CFG_BAD_MAGIC: return "bad_magic";
+    case CFG_BAD_SIZE:  return "bad_size";
+    default:            return "bad_crc";
+  }
+}
+
+inline CfgBody cfgDefaults() {
+  CfgBody b;
+  memset(&b, 0, sizeof(b));
+  b.mqttPort = 1883;
+  b.mqttRate = 20;
+  b.mqttHa = 1;
+  b.powerProfile = 1;
+  return b;
+}
+
+// Bitwise CRC-32: a blob is a few hundred bytes, written and read rarely
+inline uint32_t cfgCrc32(const uint8_t* p, size_t n) {
+  uint32_t c = 0xFFFFFFFFu;
+  while (n--) {
+    c ^= *p++;
+    for (int k = 0; k < 8; k++) c = (c >> 1) ^ (0xEDB88320u & (0u - (c & 1)));
+  }
+  return ~c;
+}
+
+// False when the value does not fit (dst is left untouched)
+template <size_t N>
+inline bool cfgSetStr(char (&dst)[N], const char* s, size_t len) {
+  if (len >= N) return false;
+  memcpy(dst, s, len);
+  memset(dst + len, 0, N - len);  // no stale bytes, so equal settings encode equal
+  return true;
+}
+
+// Header + body into out (CFG_BLOB_MAX bytes); returns the blob length
+inline size_t cfgEncode(const CfgBody& b, uint8_t* out) {
+  CfgHeader h;
+  h.magic = CFG_MAGIC;
+  h.version = CFG_VERSION;
+  h.size = sizeof(CfgBody);
+  h.crc = cfgCrc32((const uint8_t*)&b, sizeof(b));
+  memcpy(out, &h, sizeof(h));
+  memcpy(out + sizeof(h), &b, sizeof(b));
+  return CFG_BLOB_MAX;
+}
+
+// body holds the defaults on entry; only a valid blob overwrites it
+inline CfgStatus cfgDecode(const uint8_t* data, size_t len, CfgBody& body) {
+  if (!len) return CFG_EMPTY;
+  CfgHeader h;
+  if (len < sizeof(h)) return CFG_BAD_SIZE;
+  memcpy(&h, data, sizeof(h));
+  if (h.magic != CFG_MAGIC) return CFG_BAD_MAGIC;
+  if (len - sizeof(h) != h.size) return CFG_BAD_SIZE;
+  if (cfgCrc32(data + sizeof(h), h.size) != h.crc) return CFG_BAD_CRC;
+
+  memcpy(&body, data + sizeof(h), h.size < sizeof(body) ? h.size : sizeof(body));
+  // Terminate every string even if a future layout reused the bytes
+  body.wifiSsid[sizeof(body.wifiSsid) - 1] = '\0';
+  body.wifiPass[sizeof(body.wifiPass) - 1] = '\0';
+  body.mqttHost[sizeof(body.mqttHost) - 1] = '\0';
+  body.mqttUser[sizeof(body.mqttUser) - 1] = '\0';
+  body.mqttPass[sizeof(body.mqttPass) - 1] = '\0';
+  body.mqttBase[sizeof(body.mqttBase) - 1] = '\0';
+  body.mqttStateTopic[sizeof(body.mqttStateTopic) - 1] = '\0';
+  return CFG_OK;
+}
@@ -0,0 +1,43 @@
+#pragma once
+// Input debounce state machine. The pin read is passed in, so the same code
+// runs against real GPIOs on target and scripted levels in the native tests.
+
+#include <stdint.h>
+
+struct DebouncedInput {
+  int last_read;
+  int stable;
+  uint32_t last_change_ms;
+};
+
+// Edge from the ISR queue: restart the quiet period on a level change
+inline void debounceEdge(DebouncedInput& in, int level, uint32_t t_ms) {
+  if (level == in.last_read) return;
+  in.last_read = level;
+  in.last_change_ms = t_ms;
+}
+
+// Returns true when the input has just settled on a new stable level.
+// Otherwise lowers waitMs to when this input needs another look (untouched
+// while idle). After the quiet period the level is confirmed with readPin()
+// in case an edge was dropped from a full queue.
+template <class ReadPin>
+bool debounceStep(DebouncedInput& in, uint32_t now, uint32_t debounceMs, ReadPin readPin, uint32_t& waitMs) {
+  if (in.stable == in.last_read) return false;
+
+  const uint32_t elapsed = now - in.last_change_ms;
+  if (elapsed > debounceMs) {
+    const int level = readPin();
+    if (level == in.last_read) {
+      in.stable = in.last_read;
+      return true;
+    }
+    in.last_read = level;
+    in.last_change_ms = now;
+    if (level == in.stable) return false;
+    if (debounceMs + 1 < waitMs) waitMs = debounceMs + 1;
+  } else {
+    if (debounceMs + 1 - elapsed < waitMs) waitMs = debounceMs + 1 - elapsed;
+  }
+  return false;
+}
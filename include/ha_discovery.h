@@ -0,0 +1,75 @@
+#pragma once
+// Home Assistant MQTT discovery configs: one switch per relay and one
+// binary_sensor per input, at <prefix>/<component>/<node id>/<object>/config.
+// Payloads use HA's abbreviated keys, with "~" standing in for the base topic.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <ArduinoJson.h>
+#include "topic_table.h"
+
+static const char   HA_PREFIX[]    = "homeassistant";
+static const size_t HA_PAYLOAD_MAX = 640;
+
+struct HaDevice {
+  const char* id;     // node id in the topic and unique_id prefix ([A-Za-z0-9_-])
+  const char* name;   // mDNS host
+  const char* url;    // configuration URL
+  const char* model;
+  const char* sw;
+};
+
+enum HaKind : uint8_t { HA_RELAY, HA_INPUT };
+
+// State source: per-channel "ON"/"OFF" topics, or bit i of "r"/"i" in the
+// <base>/state JSON aggregate
+enum HaState : uint8_t { HA_STATE_TOPICS, HA_STATE_JSON };
+
+// Topic for channel i (0-based); returns its length, 0 when it does not fit
+inline size_t haConfigTopic(const HaDevice& dev, HaKind kind, size_t i, char* out, size_t cap) {
+  const int n = snprintf(out, cap, "%s/%s/%s/%s%u/config", HA_PREFIX,
+                         kind == HA_RELAY ? "switch" : "binary_sensor", dev.id,
+                         kind == HA_RELAY ? "relay" : "input", (unsigned)i + 1);
+  return n > 0 && (size_t)n < cap ? (size_t)n : 0;
+}
+
+// Config payload for channel i; returns its length, 0 when it does not fit
+template <size_t R, size_t I>
+size_t haConfigPayload(const TopicTableOf<R, I>& t, const HaDevice& dev, HaKind kind,
+                       HaState state, size_t i, char* out, size_t cap) {
+  const bool relay = kind == HA_RELAY;
+  const unsigned n = (unsigned)i + 1;
+  // Topics relative to "~"; the table entries all start with the base
+  const char* own = relay ? t.relayState[i] : t.inputState[i];
+  char name[16], uniq[64], avty[TOPIC_MAX], stat[TOPIC_MAX], cmd[TOPIC_MAX], tpl[80];
+  snprintf(name, sizeof(name), "%s %u", relay ? "Relay" : "Input", n);
+  snprintf(uniq, sizeof(uniq), "%s_%s%u", dev.id, relay ? "relay" : "input", n);
+  snprintf(avty, sizeof(avty), "~%s", t.avail + t.baseLen);
+  snprintf(stat, sizeof(stat), "~%s", (state == HA_STATE_JSON ? t.state : own) + t.baseLen);
+
+  StaticJsonDocument<JSON_OBJECT_SIZE(9) + JSON_OBJECT_SIZE(6) + JSON_ARRAY_SIZE(1)> d;
+  d["~"] = (const char*)t.base;
+  d["name"] = (const char*)name;
+  d["uniq_id"] = (const char*)uniq;
+  d["avty_t"] = (const char*)avty;
+  d["stat_t"] = (const char*)stat;
+  if (state == HA_STATE_JSON) {
+    snprintf(tpl, sizeof(tpl), "{{'ON' if value_json.%s|int|bitwise_and(%lu) else 'OFF'}}",
+             relay ? "r" : "i", 1ul << i);
+    d["val_tpl"] = (const char*)tpl;
+  }
+  if (relay) {
+    snprintf(cmd, sizeof(cmd), "~%s", t.relaySet[i] + t.baseLen);
+    d["cmd_t"] = (const char*)cmd;
+  }
+  JsonObject dv = d.createNestedObject("dev");
+  dv.createNestedArray("ids").add(dev.id);
+  dv["name"] = dev.name;
+  dv["mdl"] = dev.model;
+  dv["mf"] = "Switch4Node";
+  dv["sw"] = dev.sw;
+  dv["cu"] = dev.url;
+
+  if (d.overflowed() || measureJson(d) >= cap) return 0;
+  return serializeJson(d, out, cap);
+}
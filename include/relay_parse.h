@@ -0,0 +1,122 @@
+#pragma once
+// Relay command parsing shared by MQTT and HTTP: single values
+// (ON/OFF/TOGGLE/PULSE:<ms>) and the batch JSON forms. Sized by the channel
+// count so the native tests can instantiate it without the firmware config.
+
+#include <stdint.h>
+#include <ArduinoJson.h>
+#include "text_span.h"
+
+// Momentary mode upper bound (1 h)
+static const uint32_t PULSE_MAX_MS = 3600000;
+
+// Works on the raw (not NUL-terminated) MQTT payload.
+// PULSE:<ms> sets pulseMs (1..PULSE_MAX_MS); it is 0 for every other command.
+inline bool parseOnOffToggle(const char* p, size_t len, bool &outOn, bool &isToggle, uint32_t &pulseMs) {
+  trimSpan(p, len);
+
+  isToggle = false;
+  pulseMs = 0;
+
+  static const char PULSE[] = "PULSE:";
+  const size_t pulseLen = sizeof(PULSE) - 1;
+  if (len > pulseLen && strncasecmp(p, PULSE, pulseLen) == 0) {
+    uint32_t ms = 0;
+    for (size_t i = pulseLen; i < len; i++) {
+      if (p[i] < '0' || p[i] > '9' || ms > PULSE_MAX_MS) return false;
+      ms = ms * 10 + (p[i] - '0');
+    }
+    if (!ms || ms > PULSE_MAX_MS) return false;
+    pulseMs = ms;
+    outOn = true;
+    return true;
+  }
+
+  if (spanIs(p, len, "TOGGLE")) { isToggle = true; return true; }
+  if (spanIs(p, len, "ON")  || spanIs(p, len, "1") || spanIs(p, len, "TRUE"))  { outOn = true;  return true; }
+  if (spanIs(p, len, "OFF") || spanIs(p, len, "0") || spanIs(p, len, "FALSE")) { outOn = false; return true; }
+  return false;
+}
+
+// Batch JSON values may be strings ("ON"/"TOGGLE"/"PULSE:500"), numbers (1/0) or booleans
+inline bool parseOnOffToggle(JsonVariantConst v, bool &outOn, bool &isToggle, uint32_t &pulseMs) {
+  isToggle = false;
+  pulseMs = 0;
+  if (v.is<bool>()) { outOn = v.as<bool>(); return true; }
+  if (v.is<int>()) {
+    const int n = v.as<int>();
+    if (n != 0 && n != 1) return false;
+    outOn = (n == 1);
+    return true;
+  }
+  const char* str = v.as<const char*>();
+  if (!str) return false;
+  return parseOnOffToggle(str, strlen(str), outOn, isToggle, pulseMs);
+}
+
+// The "1".."N" keys of the batch JSON form
+static const char* const RELAY_KEYS[32] = {
+  "1",  "2",  "3",  "4",  "5",  "6",  "7",  "8",  "9",  "10", "11", "12", "13", "14", "15", "16",
+  "17", "18", "19", "20", "21", "22", "23", "24", "25", "26", "27", "28", "29", "30", "31", "32",
+};
+
+// Parsed batch command; pulse channels carry their width in pulseMs[i]
+template <size_t N>
+struct RelayBatchOf {
+  static_assert(N >= 1 && N <= 32, "relay masks are 32 bits wide");
+  static constexpr uint32_t ALL = (N == 32) ? 0xFFFFFFFFu : ((1u << N) - 1);
+  // {"1":"TOGGLE",...}: per entry a slot plus the copied key/value strings
+  static constexpr size_t JSON_CAP = JSON_OBJECT_SIZE(N) + N * 12 + 64;
+
+  uint32_t set, clr, tgl, pulse;
+  uint32_t pulseMs[N];
+};
+
+// {"1":"ON","2":"OFF","3":"TOGGLE"...} -> set/clear/toggle masks.
+// Unknown keys and invalid values are skipped, as before. False for bad
+// JSON and for a compact-form mask that is not an unsigned integer.
+template <size_t N>
+bool parseRelayBatch(const char* json, size_t len, RelayBatchOf<N> &b) {
+  const uint32_t all = RelayBatchOf<N>::ALL;
+  StaticJsonDocument<RelayBatchOf<N>::JSON_CAP> doc;
+  if (deserializeJson(doc, json, len)) return false;
+
+  b.set = b.clr = b.tgl = b.pulse = 0;
+
+  // Compact form, mirrors <base>/state: {"r":mask} sets every relay at once,
+  // {"set":m,"clr":m,"tgl":m} touches only the given bits (any subset).
+  // A present mask must be an unsigned integer: as<>() would read "on",
+  // 1.5, null or -1 as 0, and {"r":0} switches everything off.
+  if (doc.containsKey("r") || doc.containsKey("set") || doc.containsKey("clr") || doc.containsKey("tgl")) {
+    uint32_t r = 0, set = 0, clr = 0, tgl = 0;
+    auto mask = [&doc](const char* key, uint32_t& out) {
+      if (!doc.containsKey(key)) return true;
+      JsonVariantConst v = doc[key];
+      if (!v.template is<uint32_t>()) return false;
+      out = v.template as<uint32_t>();
+      return true;
+    };
+    if (!mask("r", r) || !mask("set", set) || !mask("clr", clr) || !mask("tgl", tgl)) return false;
+    if (doc.containsKey("r")) {
+      b.set = r & all;
+      b.clr = ~r & all;
+    }
+    b.set |= set & all;
+    b.clr |= clr & all;
+    b.tgl |= tgl & all;
+    return true;
+  }
+
+  for (size_t i = 0; i < N; i++) {
+    JsonVariantConst val = doc[RELAY_KEYS[i]];
+    if (val.isNull()) continue;
+    bool on = false, isToggle = false;
+    uint32_t pulseMs;
+    if (!parseOnOffToggle(val, on, isToggle, pulseMs)) continue;
+    if (pulseMs)       { b.pulse |= (1u << i); b.pulseMs[i] = pulseMs; }
+    else if (isToggle) b.tgl |= (1u << i);
+    else if (on)       b.set |= (1u << i);
+    else               b.clr |= (1u << i);
+  }
+  return true;
+}
@@ -0,0 +1,18 @@
+#pragma once
+// Helpers for raw (not NUL-terminated) payload spans; no Arduino dependency
+// so the parsers built on them also compile for the native test env.
+
+#include <ctype.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+
+inline void trimSpan(const char*& p, size_t& len) {
+  while (len && isspace((unsigned char)*p)) { p++; len--; }
+  while (len && isspace((unsigned char)p[len - 1])) len--;
+}
+
+// Case-insensitive whole-span match
+inline bool spanIs(const char* p, size_t len, const char* word) {
+  return strlen(word) == len && strncasecmp(p, word, len) == 0;
+}
@@ -0,0 +1,108 @@
+#pragma once
+// MQTT topic table: every derived topic is built once into fixed buffers so
+// neither the publish nor the receive path touches the heap.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "text_span.h"
+
+static const size_t TOPIC_MAX = 128;
+
+constexpr size_t topicDigits(size_t n) { return n < 10 ? 1 : 1 + topicDigits(n / 10); }
+constexpr size_t topicLonger(size_t a, size_t b) { return a > b ? a : b; }
+
+// Longest base whose longest derived topic (the channel numbers widen
+// /relay/N/state and /input/N/count past 9 channels) still fits TOPIC_MAX
+template <size_t R, size_t I>
+constexpr size_t topicBaseMax() {
+  return TOPIC_MAX - 1 - topicLonger(sizeof("/relay//state") - 1 + topicDigits(R),
+                         topicLonger(sizeof("/input//count") - 1 + topicDigits(I),
+                                     sizeof("/ota/status") - 1));
+}
+
+template <size_t R, size_t I>
+struct TopicTableOf {
+  bool   valid;
+  size_t baseLen;
+  size_t relaySetAllLen;
+  char base[TOPIC_MAX];           // = mqttCfg.cmdTopic (trimmed)
+  char avail[TOPIC_MAX];          // <base>/status
+  char relaySetWild[TOPIC_MAX];   // <base>/relay/+/set
+  char relaySetAll[TOPIC_MAX];    // <base>/relay/set  (optional "all relays" JSON)
+  char relayStateAll[TOPIC_MAX];  // <base>/relay/state (aggregate {"1":"ON",...}, retained)
+  char metrics[TOPIC_MAX];        // <base>/metrics (JSON latency/heap summary, not retained)
+  char state[TOPIC_MAX];          // <base>/state (aggregate, SF_JSON / SF_BINARY only)
+  char ota[TOPIC_MAX];            // <base>/ota (pull-from-URL command)
+  char otaStatus[TOPIC_MAX];      // <base>/ota/status (retained progress/result)
+  char relaySet[R][TOPIC_MAX];    // <base>/relay/N/set
+  char relayState[R][TOPIC_MAX];  // <base>/relay/N/state
+  char inputState[I][TOPIC_MAX];  // <base>/input/N/state
+  char inputCount[I][TOPIC_MAX];  // <base>/input/N/count (counter mode)
+};
+
+// Surrounding whitespace and trailing '/' are dropped from the base.
+// Returns false (table cleared, valid=false) when the base is too long or
+// holds a wildcard; an empty base builds nothing and is not an error.
+template <size_t R, size_t I>
+bool buildTopics(TopicTableOf<R, I>& t, const char* base, size_t len) {
+  trimSpan(base, len);
+  while (len && base[len - 1] == '/') len--;
+
+  memset(&t, 0, sizeof(t));
+
+  if (len > topicBaseMax<R, I>() || memchr(base, '+', len) || memchr(base, '#', len)) return false;
+  if (!len) return true;
+
+  memcpy(t.base, base, len);
+  t.base[len] = '\0';
+  t.baseLen = len;
+
+  snprintf(t.avail,        TOPIC_MAX, "%s/status",      t.base);
+  snprintf(t.relaySetWild, TOPIC_MAX, "%s/relay/+/set", t.base);
+  t.relaySetAllLen =
+    snprintf(t.relaySetAll, TOPIC_MAX, "%s/relay/set",  t.base);
+  snprintf(t.relayStateAll, TOPIC_MAX, "%s/relay/state", t.base);
+  snprintf(t.metrics,       TOPIC_MAX, "%s/metrics",     t.base);
+  snprintf(t.state,         TOPIC_MAX, "%s/state",       t.base);
+  snprintf(t.ota,           TOPIC_MAX, "%s/ota",         t.base);
+  snprintf(t.otaStatus,     TOPIC_MAX, "%s/ota/status",  t.base);
+
+  for (size_t i = 0; i < R; i++) {
+    snprintf(t.relaySet[i],   TOPIC_MAX, "%s/relay/%u/set",   t.base, (unsigned)i + 1);
+    snprintf(t.relayState[i], TOPIC_MAX, "%s/relay/%u/state", t.base, (unsigned)i + 1);
+  }
+  for (size_t i = 0; i < I; i++) {
+    snprintf(t.inputState[i], TOPIC_MAX, "%s/input/%u/state", t.base, (unsigned)i + 1);
+    snprintf(t.inputCount[i], TOPIC_MAX, "%s/input/%u/count", t.base, (unsigned)i + 1);
+  }
+
+  t.valid = true;
+  return true;
+}
+
+// <base>/relay/<n>/set -> n (1..R), or 0 when the topic is anything else
+template <size_t R, size_t I>
+int matchRelaySetTopic(const TopicTableOf<R, I>& t, const char* topic, size_t tlen) {
+  static const char SEG_RELAY[] = "/relay/";
+  static const char SEG_SET[]   = "/set";
+  const size_t segRelayLen = sizeof(SEG_RELAY) - 1;
+  const size_t segSetLen   = sizeof(SEG_SET) - 1;
+
+  if (tlen < t.baseLen + segRelayLen + 1 + segSetLen) return 0;
+  if (memcmp(topic, t.base, t.baseLen) != 0) return 0;
+
+  const char* p = topic + t.baseLen;
+  const char* end = topic + tlen;
+  if (memcmp(p, SEG_RELAY, segRelayLen) != 0) return 0;
+  p += segRelayLen;
+
+  int n = 0;
+  const char* digits = p;
+  while (p < end && *p >= '0' && *p <= '9' && p - digits < 3) n = n * 10 + (*p++ - '0');
+  if (p == digits) return 0;
+  if ((size_t)(end - p) != segSetLen || memcmp(p, SEG_SET, segSetLen) != 0) return 0;
+
+  if (n < 1 || n > (int)R) return 0;
+  return n;
+}
@@ -9,18 +9,30 @@
  *   USER: admin
  *   PASS: switch4node
  *
- * GPIO:
+ * GPIO (defaults; channel count, pins and relay driver are build flags,
+ *       see the GPIO section below and the [env:...] entries in platformio.ini):
  *  - Relays GPIO: 16, 17, 18, 19  (ACTIVE HIGH by default)
  *  - Inputs GPIO: 25, 26, 27, 14  (INPUT_PULLUP, dry contact to GND)
+ *    Captured by CHANGE interrupts and debounced in a task pinned to core 1,
+ *    independent of WiFi/MQTT activity on the network task (core 0).
+ *
+ * Tasks:
+ *  control (core 1): input edges, debounce, relay writes, rules/deadlines
+ *  net     (core 0): MQTT client + outbox, SSE, AP DNS, NVS journal
+ *  MQTT/HTTP commands reach the control task through SPSC rings.
  *
  * MQTT (PURE per-relay topics + per-input topics):
  *  Base topic (config field: cmdTopic) example:
  *    home/switch/switch4node-A1B2C3
  *
  *  Relays:
- *    Command: <base>/relay/1/set        payload: ON|OFF|1|0|TOGGLE
+ *    Command: <base>/relay/1/set        payload: ON|OFF|1|0|TOGGLE|PULSE:<ms>
+ *             PULSE:<ms> = ON, then OFF after <ms> (esp_timer one-shot, 1..3600000)
  *    State:   <base>/relay/1/state      payload: ON|OFF  (retained)
- *    ... relay 2..4
+ *    ... relay 2..N
+ *    Batch:   <base>/relay/set          payload: {"1":"ON","2":"TOGGLE",...}
+ *             applied to all channels in one driver update (offs before ons)
+ *    State:   <base>/relay/state        payload: {"1":"ON","2":"OFF",...} (retained)
  *
  *  Inputs (binary sensor style):
  *    State:   <base>/input/1/state      payload: ON|OFF  (retained)
@@ -30,6 +42,103 @@
  *  Availability (optional but useful for HA):
  *    <base>/status payload: online/offline (retained)
  *
+ *  Opt-in aggregate (/api/mqtt stateFormat=json|binary) replaces the per-channel
+ *  state topics with one retained message:
+ *    <base>/state  {"r":<relay mask>,"i":<closed input mask>,"seq":N}
+ *                  binary: seq u32 LE, relay mask, input mask (ceil(n/8) bytes LE each)
+ *    Matching command on <base>/relay/set: {"r":mask} or {"set":m,"clr":m,"tgl":m}
+ *
+ *  TLS (/api/mqtt tls=1, usually port 8883) verifies the broker against the PEM
+ *  CA posted as "ca" and stored at /mqtt_ca.pem.
+ *
+ *  Persistent session (clean session off, client ID <mdnsHost>-<efuse MAC>),
+ *  commands subscribed at QoS 1: commands sent during a short drop are queued by
+ *  the broker, and a resumed session skips the resubscribe and republishes
+ *  only states that changed while offline.
+ *
+ *  State publishes go through an outbox drained by the net task: repeated updates
+ *  to one topic collapse into its latest value, and sending is capped at the
+ *  configured rate (/api/mqtt "rate", msgs/s, burst 2x, 0 = unlimited).
+ *
+ * Home Assistant discovery (/api/mqtt "ha", default on):
+ *  homeassistant/switch/<id>/relayN/config and .../binary_sensor/<id>/inputN/config,
+ *  retained, published only when their content or the broker changes
+ *  ("ha_resend=1" forces it). Needs the topics or json state format.
+ *
+ * Settings storage:
+ *  WiFi, MQTT and power settings are one versioned, CRC-checked NVS blob,
+ *  loaded once at boot and rewritten (debounced) only when it changed.
+ *  /api/config (STA, Basic Auth)  GET WiFi + MQTT, POST config=<json> in the same shape
+ *
+ * Power (STA, Basic Auth):
+ *  /api/power  GET applied state, POST profile=performance|balanced|low
+ *  balanced (default) = modem sleep + DFS; low adds light sleep with GPIO wake
+ *  for inputs. Input -> relay stays within debounce + 2 ms in every profile;
+ *  network commands may wait for the next DTIM beacon / net tick.
+ *
+ * Web login (STA, Basic Auth):
+ *  /api/auth  GET user, POST current=<pass>&pass=<new, 8+ chars>[&user=<name>]
+ *  Stored salted (PBKDF2-SHA256) in NVS; factory login is admin/switch4node.
+ *  After 5 wrong passwords a client gets 429 (one more try per 10 s).
+ *
+ * Rules (STA, Basic Auth):
+ *  /api/rules  GET table, POST rules=<json> | reset=1; stored in /rules.json
+ *  {"rules":[{"when":"input1:close","do":"relay1:toggle"},
+ *            {"when":"relay3:on","do":"relay3:off","after":900000}]}
+ *  "after" is in ms, at most 86400000 (24 h). Runs locally and offline.
+ *  Default: closing input N toggles relay N.
+ *
+ * Power-on state (STA, Basic Auth):
+ *  /api/poweron  GET modes, POST relay=<1..N|all>&mode=<off|on|last>
+ *  "last" channels are journaled to NVS (coalesced) and restored at boot
+ *  before WiFi starts; default mode from -DS4N_POWER_ON_DEFAULT (0 = off).
+ *
+ * Metrics (STA, Basic Auth):
+ *  /api/metrics  Prometheus text: p50/p99/max of loop, MQTT callback, relay
+ *                write, input commit, HTTP handler and UDP command times,
+ *                plus heap gauges
+ *  <base>/metrics  same summary as JSON every 60 s (not retained)
+ *
+ * Pulse counters (STA, Basic Auth):
+ *  /api/counters  GET modes, POST input=<N>&mode=counter|switch (next boot),
+ *                 filter=<APB cycles>, reset=1
+ *  Counter inputs count closures in the PCNT peripheral (64-bit totals in NVS):
+ *    <base>/input/N/count  {"total":1234,"rate":0.517}  (pulses/s over 60 s, retained)
+ *  Totals and rates also appear in /api/status "counters".
+ *  They publish no switch state and trigger no input rules.
+ *
+ * ESP-NOW groups (STA, Basic Auth):
+ *  /api/espnow  GET config + counters, POST enabled, key, groups=[{"group":5,"relays":3}]
+ *  A rule "do":"group5:toggle" (optional "mask") broadcasts to every node
+ *  listening to group 5; HMAC-authenticated, replay-checked, no broker needed.
+ *
+ * UDP control (STA, Basic Auth for config):
+ *  /api/udp  GET config + counters, POST enabled, port, key (16..64 chars)
+ *  One 52-byte datagram per command (set/clear/toggle masks, session, sender,
+ *  seq, HMAC tag), one reply with the resulting relay/input masks; see
+ *  tools/udpctl.py. Bypasses TCP, HTTP and the broker for PLC/SCADA polling.
+ *
+ * OTA updates (STA, Basic Auth):
+ *  /api/ota  POST ?target=app|fs&sha256=<hex> with the image as multipart file,
+ *            GET progress. MQTT pull: <base>/ota {"url":..,"sha256":..,"target":..}
+ *            (not retained), progress/result on <base>/ota/status (retained).
+ *  Streamed to the inactive app slot or the LittleFS partition, SHA-256 checked,
+ *  then reboot; a new app is confirmed once online or rolled back.
+ *
+ * Logging:
+ *  Runtime log lines go through a lock-free ring drained to Serial by a
+ *  low-priority task; -DS4N_LOG_LEVEL=0..4 strips levels at compile time.
+ *  /api/log (Basic Auth) returns the last lines, ?since=<seq> for a tail.
+ *
+ * Web UI live updates (STA):
+ *  /api/events (Server-Sent Events, Basic Auth): "state" events carrying
+ *  only the relays/inputs that changed; /api/status remains for polling.
+ *
+ * Boot:
+ *  Relays are driven before anything else. STA joins the last BSSID/channel
+ *  from prefs (no scan) and falls back to a full scan if that fails; an
+ *  optional static IP (AP portal) skips DHCP. -DS4N_FS_DEBUG=1 lists LittleFS.
+ *
  * Notes:
  *  - “stateTopic” in settings is unused for per-relay mode (kept for backward compatibility)
  *  - AP mode does NOT serve the full /www folder (prevents accessing STA pages from AP)
@@ -37,6 +146,8 @@
 
 #include <Arduino.h>
 #include <WiFi.h>
+#include <WiFiClientSecure.h>
+#include <HTTPClient.h>
 #include <DNSServer.h>
 #include <LittleFS.h>
 #include <Preferences.h>
@@ -45,53 +156,712 @@
 #include <PubSubClient.h>
 #include <ArduinoJson.h>
 #include <ESPmDNS.h>
+#include <Wire.h>
+#include <atomic>
+#include <memory>
+#include <new>
 #include "esp_wifi.h"
+#include "esp_now.h"
+#include "esp_timer.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_spi_flash.h"
+#include "esp_pm.h"
+#include "esp_sleep.h"
+#include "lwip/sockets.h"
+#include "driver/pcnt.h"
+#include "driver/gpio.h"
+#include "mbedtls/base64.h"
+#include "mbedtls/md.h"
+#include "mbedtls/pkcs5.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "relay_parse.h"
+#include "topic_table.h"
+#include "debounce.h"
+#include "ha_discovery.h"
+#include "config_blob.h"
 
 // -------------------- GPIO --------------------
-#define RELAY1_PIN 16
-#define RELAY2_PIN 17
-#define RELAY3_PIN 18
-#define RELAY4_PIN 19
-
-#define INPUT1_PIN 25
-#define INPUT2_PIN 26
-#define INPUT3_PIN 27
-#define INPUT4_PIN 14
-
-const int relayPins[4] = {RELAY1_PIN, RELAY2_PIN, RELAY3_PIN, RELAY4_PIN};
-const int inputPins[4] = {INPUT1_PIN, INPUT2_PIN, INPUT3_PIN, INPUT4_PIN};
-
+// Channel counts, pins and the relay output driver come from build flags so
+// 8/16-channel boards are just another [env:...] in platformio.ini.
+//   -DS4N_RELAY_COUNT=8 -DS4N_RELAY_PINS=16,17,...   (GPIO driver)
+//   -DS4N_INPUT_COUNT=8 -DS4N_INPUT_PINS=25,26,...
+#define S4N_DRIVER_GPIO    0   // one GPIO per relay
+#define S4N_DRIVER_HC595   1   // chained 74HC595 shift registers
+#define S4N_DRIVER_PCF857X 2   // PCF8574 (8 ch) / PCF8575 (16 ch) I2C expander
+
+#ifndef S4N_RELAY_COUNT
+#define S4N_RELAY_COUNT 4
+#endif
+#ifndef S4N_INPUT_COUNT
+#define S4N_INPUT_COUNT 4
+#endif
+#ifndef S4N_RELAY_DRIVER
+#define S4N_RELAY_DRIVER S4N_DRIVER_GPIO
+#endif
+#ifndef S4N_RELAY_PINS
+#define S4N_RELAY_PINS 16, 17, 18, 19
+#endif
+#ifndef S4N_INPUT_PINS
+#define S4N_INPUT_PINS 25, 26, 27, 14
+#endif
+
+// HC595: serial data / shift clock / latch (storage clock)
+#ifndef S4N_HC595_DATA_PIN
+#define S4N_HC595_DATA_PIN  23
+#endif
+#ifndef S4N_HC595_CLOCK_PIN
+#define S4N_HC595_CLOCK_PIN 18
+#endif
+#ifndef S4N_HC595_LATCH_PIN
+#define S4N_HC595_LATCH_PIN 19
+#endif
+
+// PCF857x on the default Wire bus
+#ifndef S4N_PCF857X_ADDR
+#define S4N_PCF857X_ADDR 0x20
+#endif
+#ifndef S4N_I2C_SDA_PIN
+#define S4N_I2C_SDA_PIN 21
+#endif
+#ifndef S4N_I2C_SCL_PIN
+#define S4N_I2C_SCL_PIN 22
+#endif
+
+#ifndef RELAY_ACTIVE_LOW
 #define RELAY_ACTIVE_LOW 0   // 0 = ACTIVE HIGH, 1 = ACTIVE LOW
+#endif
+
+// Default power-on mode for channels without a stored one: 0 = off, 1 = on, 2 = last
+#ifndef S4N_POWER_ON_DEFAULT
+#define S4N_POWER_ON_DEFAULT 0
+#endif
+
+// Walk LittleFS over Serial at boot (slow; off for production builds)
+#ifndef S4N_FS_DEBUG
+#define S4N_FS_DEBUG 0
+#endif
+
+// Log calls above this level compile away: 0 none, 1 error, 2 warn, 3 info, 4 debug
+#define S4N_LOG_ERROR 1
+#define S4N_LOG_WARN  2
+#define S4N_LOG_INFO  3
+#define S4N_LOG_DEBUG 4
+#ifndef S4N_LOG_LEVEL
+#define S4N_LOG_LEVEL S4N_LOG_INFO
+#endif
+
+// Keep the most recent log lines in RAM for GET /api/log
+#ifndef S4N_LOG_TAIL
+#define S4N_LOG_TAIL 1
+#endif
+
+static const size_t RELAY_COUNT = S4N_RELAY_COUNT;
+static const size_t INPUT_COUNT = S4N_INPUT_COUNT;
+
+static_assert(RELAY_COUNT >= 1 && RELAY_COUNT <= 32, "S4N_RELAY_COUNT must be 1..32 (bitmask state)");
+static_assert(INPUT_COUNT >= 1 && INPUT_COUNT <= 32, "S4N_INPUT_COUNT must be 1..32 (bitmask state)");
+static_assert(S4N_POWER_ON_DEFAULT >= 0 && S4N_POWER_ON_DEFAULT <= 2, "S4N_POWER_ON_DEFAULT must be 0 (off), 1 (on) or 2 (last)");
+
+// Sized by the list itself: a short list would zero-fill and silently use GPIO0
+const int inputPins[] = {S4N_INPUT_PINS};
+static_assert(sizeof(inputPins) / sizeof(inputPins[0]) == INPUT_COUNT,
+              "S4N_INPUT_PINS must list exactly S4N_INPUT_COUNT pins");
 
 // -------------------- FS/DNS ------------------
 static const char* FS_ROOT = "/www";
 static const byte DNS_PORT = 53;
 
+// Web assets are stored pre-gzipped (tools/build_www.py) with strong ETags
+// listed in /www/etags.txt; browsers revalidate and get 304 when unchanged.
+static const char* ASSET_ETAGS_PATH   = "/www/etags.txt";
+static const char* ASSET_CACHE_CTRL   = "private, no-cache";
+static const int   ASSET_MAX          = 16;
+
+// -------------------- WiFi ------------------
+static const uint32_t WIFI_FAST_TIMEOUT_MS = 3000;  // cached BSSID/channel attempt
+static const uint32_t WIFI_POLL_MS         = 20;
+
 // -------------------- Debounce ----------------
 static const uint32_t INPUT_DEBOUNCE_MS = 50;
 
+// Input capture: GPIO CHANGE interrupts feed timestamped edges to the
+// control task, so input handling never waits on WiFi/MQTT work.
+static const UBaseType_t INPUT_QUEUE_LEN  = 32;
+
+// -------------------- Tasks ----------------
+// Control (inputs, debounce, relays, rules, deadlines) is pinned to core 1.
+// The network side (MQTT client, outbox, SSE, AP DNS) runs on core 0 next to
+// WiFi/lwIP and AsyncTCP (CONFIG_ASYNC_TCP_RUNNING_CORE=0 in platformio.ini).
+// Commands cross over through SPSC rings; state comes back as dirty bits.
+static const uint32_t    CONTROL_TASK_STACK = 4096;
+static const UBaseType_t CONTROL_TASK_PRIO  = 5;
+static const BaseType_t  CONTROL_TASK_CORE  = 1;
+static const uint32_t    NET_TASK_STACK     = 8192;
+static const UBaseType_t NET_TASK_PRIO      = 2;
+static const BaseType_t  NET_TASK_CORE      = 0;
+static const uint32_t    NET_TICK_MS        = 10;  // MQTT keepalive/poll cadence (see Power)
+static const uint32_t    LOG_TASK_STACK     = 3072;
+static const UBaseType_t LOG_TASK_PRIO      = 1;   // below everything that matters
+static const BaseType_t  LOG_TASK_CORE      = 0;
+static const uint32_t    OTA_TASK_STACK     = 10240; // HTTPClient + TLS for https:// pulls
+static const UBaseType_t OTA_TASK_PRIO      = 1;
+static const BaseType_t  OTA_TASK_CORE      = 0;
+static const uint32_t    UDP_TASK_STACK     = 4096;
+static const UBaseType_t UDP_TASK_PRIO      = 4;   // above net: replies are latency-bound
+static const BaseType_t  UDP_TASK_CORE      = 0;
+static const size_t      CMD_RING_LEN       = 32;
+
 // -------------------- Web/MQTT ----------------
 AsyncWebServer server(80);
+AsyncEventSource events("/api/events"); // SSE push for the STA dashboard
 DNSServer dns;
 
 WiFiClient wifiClient;
-PubSubClient mqtt(wifiClient);
+WiFiClientSecure wifiClientTls;
+
+// The prebuilt Arduino core ships mbedTLS with the AES/SHA/MPI peripherals
+// enabled; a custom sdkconfig without them makes every handshake far slower
+#if !CONFIG_MBEDTLS_HARDWARE_AES || !CONFIG_MBEDTLS_HARDWARE_SHA || !CONFIG_MBEDTLS_HARDWARE_MPI
+#warning "mbedTLS hardware acceleration is disabled; MQTT TLS handshakes will be slow"
+#endif
+
+// Pass-through to the socket that also reads the CONNACK "session present"
+// flag, which PubSubClient parses but does not expose
+class MqttTransport : public Client {
+public:
+  explicit MqttTransport(Client &inner) : c_(&inner) {}
+
+  void use(Client &inner) { c_ = &inner; }  // plain or TLS, between connections
+  void armConnack() { rx_ = 0; sessionPresent_ = false; }  // before CONNECT
+  bool sessionPresent() const { return sessionPresent_; }
+
+  int connect(IPAddress ip, uint16_t port) override { return c_->connect(ip, port); }
+  int connect(const char *host, uint16_t port) override { return c_->connect(host, port); }
+  size_t write(uint8_t b) override { return c_->write(b); }
+  size_t write(const uint8_t *buf, size_t n) override { return c_->write(buf, n); }
+  int available() override { return c_->available(); }
+  int read() override {
+    const int b = c_->read();
+    if (b >= 0) sniff((uint8_t)b);
+    return b;
+  }
+  int read(uint8_t *buf, size_t n) override {
+    const int got = c_->read(buf, n);
+    for (int i = 0; i < got; i++) sniff(buf[i]);
+    return got;
+  }
+  int peek() override { return c_->peek(); }
+  void flush() override { c_->flush(); }
+  void stop() override { c_->stop(); }
+  uint8_t connected() override { return c_->connected(); }
+  operator bool() override { return (bool)*c_; }
+
+private:
+  // CONNACK: 0x20 0x02 <flags> <rc>; bit 0 of flags = session present
+  void sniff(uint8_t b) {
+    if (rx_ >= 4) return;
+    if (rx_ == 0 && b != 0x20) { rx_ = 4; return; }
+    if (rx_ == 2) sessionPresent_ = b & 0x01;
+    rx_++;
+  }
+
+  Client *c_;
+  uint8_t rx_ = 4;
+  bool sessionPresent_ = false;
+};
+
+MqttTransport mqttLink(wifiClient);
+PubSubClient mqtt(mqttLink);
 Preferences prefs;
 
+// MQTT connect state machine. RESOLVE..HANDSHAKE run in a short-lived worker
+// task that owns the client; the net task never blocks on DNS, TCP or CONNACK.
+enum MqttConnState : uint8_t {
+  MQ_IDLE,       // disabled, not configured, or WiFi down
+  MQ_BACKOFF,    // waiting for mqttNextAttemptMs
+  MQ_FAILED,     // worker gave up; the net task schedules the retry
+  MQ_RESOLVE,    // worker: DNS lookup
+  MQ_TCP,        // worker: TCP connect
+  MQ_HANDSHAKE,  // worker: CONNECT / CONNACK
+  MQ_SUBSCRIBE,  // loop: subscribe to command topics
+  MQ_SNAPSHOT,   // loop: publish retained availability + states
+  MQ_CONNECTED,
+};
+
+static const uint32_t MQTT_TCP_TIMEOUT_MS    = 3000;
+static const uint16_t MQTT_SOCKET_TIMEOUT_S  = 5;      // CONNACK wait
+static const uint16_t MQTT_KEEPALIVE_S       = 15;
+static const uint32_t MQTT_BACKOFF_BASE_MS   = 1000;
+static const uint32_t MQTT_BACKOFF_CAP_MS    = 60000;
+static const uint32_t MQTT_WORKER_STACK      = 6144;
+static const uint32_t MQTT_WORKER_STACK_TLS  = 10240;  // mbedTLS handshake
+static const uint32_t MQTT_TLS_HANDSHAKE_S   = 10;
+
+// Broker CA for TLS (PEM, uploaded through /api/mqtt "ca")
+static const char*  MQTT_CA_PATH = "/mqtt_ca.pem";
+static const size_t MQTT_CA_MAX  = 4096;
+
+static std::atomic<uint8_t> mqttConn{MQ_IDLE};
+static std::atomic<bool>    mqttReconfigure{false};
+static uint8_t  mqttFailStage = MQ_IDLE;   // stage the last attempt failed in
+static uint32_t mqttAttempts = 0;          // consecutive failures, drives backoff
+static uint32_t mqttNextAttemptMs = 0;
+
 // -------------------- BASIC AUTH (STA) --------
 static const bool  BASIC_AUTH_ON = true;
-static const char* BASIC_USER   = "admin";
-static const char* BASIC_PASS   = "switch4node";
+// Factory login until one is set through /api/auth
+static const char* BASIC_DEFAULT_USER = "admin";
+static const char* BASIC_DEFAULT_PASS = "switch4node";
+
+// -------------------- SPSC ring --------------------
+// Single-producer/single-consumer queue without locks: the producer owns
+// head_, the consumer owns tail_, and acquire/release orders the slot data.
+template <class T, size_t N>
+class SpscRing {
+  static_assert(N && (N & (N - 1)) == 0, "SpscRing size must be a power of two");
+
+ public:
+  // Producer side
+  size_t space() const { return N - (head_.load(std::memory_order_relaxed) - tail_.load(std::memory_order_acquire)); }
+  bool push(const T& v) {
+    const uint32_t h = head_.load(std::memory_order_relaxed);
+    if (h - tail_.load(std::memory_order_acquire) == N) return false;
+    buf_[h & (N - 1)] = v;
+    head_.store(h + 1, std::memory_order_release);
+    return true;
+  }
 
-// -------------------- State -------------------
-bool relayState[4] = {false, false, false, false};
+  // Consumer side
+  bool pop(T& v) {
+    const uint32_t t = tail_.load(std::memory_order_relaxed);
+    if (head_.load(std::memory_order_acquire) == t) return false;
+    v = buf_[t & (N - 1)];
+    tail_.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  std::atomic<uint32_t> head_{0};
+  std::atomic<uint32_t> tail_{0};
+  T buf_[N];
+};
+
+// -------------------- Relay / input banks -------------------
+// Relay state is changed from the control task (commands, inputs, rules) and
+// the esp_timer task (pulse ends). Memory-mapped GPIO writes fit in a
+// spinlock; the bit-banged HC595 chain and I2C expanders take tens of
+// microseconds or block, so they serialize on a real mutex instead.
+class SpinLock {
+ public:
+  void begin() {}
+  void lock()   { portENTER_CRITICAL(&mux_); }
+  void unlock() { portEXIT_CRITICAL(&mux_); }
+ private:
+  portMUX_TYPE mux_ = portMUX_INITIALIZER_UNLOCKED;
+};
+
+class MutexLock {
+ public:
+  void begin()  { mtx_ = xSemaphoreCreateMutex(); }
+  void lock()   { xSemaphoreTake(mtx_, portMAX_DELAY); }
+  void unlock() { xSemaphoreGive(mtx_); }
+ private:
+  SemaphoreHandle_t mtx_ = nullptr;
+};
+
+// -------------------- Logging --------------------
+// LOGx() formats into a slot of a lock-free multi-producer ring and returns;
+// a low-priority task drains the ring to Serial, so a full UART FIFO never
+// stalls the task that logged. A full ring drops the line (and counts it).
+// Until the drain task runs (early setup), lines go straight to Serial.
+static const size_t   LOG_LINE_MAX   = 120;
+static const size_t   LOG_RING_LEN   = 32;  // power of two
+static const size_t   LOG_TAIL_LINES = 32;
+static const uint32_t LOG_FLUSH_MS   = 200;
+
+struct LogRecord {
+  uint32_t seq;    // line number since boot (drain side)
+  uint32_t ms;
+  uint8_t  level;
+  uint8_t  len;
+  char     text[LOG_LINE_MAX];
+};
+
+// Bounded MPSC queue: producers claim a position with a CAS on head_, fill
+// the slot in place and publish it through the slot's sequence number.
+template <size_t N>
+class LogRing {
+  static_assert(N && (N & (N - 1)) == 0, "LogRing size must be a power of two");
+
+ public:
+  LogRing() {
+    for (size_t i = 0; i < N; i++) slots_[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  // Producer side: claim(), fill the record, publish()
+  LogRecord* claim(uint32_t &pos) {
+    pos = head_.load(std::memory_order_relaxed);
+    for (;;) {
+      Slot &s = slots_[pos & (N - 1)];
+      const int32_t dif = (int32_t)(s.seq.load(std::memory_order_acquire) - pos);
+      if (dif == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) return &s.rec;
+      } else if (dif < 0) {
+        return nullptr;  // full
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+  void publish(uint32_t pos) { slots_[pos & (N - 1)].seq.store(pos + 1, std::memory_order_release); }
+
+  // Consumer side (one task)
+  LogRecord* front() {
+    const uint32_t t = tail_.load(std::memory_order_relaxed);
+    Slot &s = slots_[t & (N - 1)];
+    return s.seq.load(std::memory_order_acquire) == t + 1 ? &s.rec : nullptr;
+  }
+  void pop() {
+    const uint32_t t = tail_.load(std::memory_order_relaxed);
+    slots_[t & (N - 1)].seq.store(t + N, std::memory_order_release);
+    tail_.store(t + 1, std::memory_order_release);
+  }
+
+  // Any task: nothing left to drain
+  bool empty() const { return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire); }
+
+ private:
+  struct Slot {
+    std::atomic<uint32_t> seq;
+    LogRecord rec;
+  };
+  Slot slots_[N];
+  std::atomic<uint32_t> head_{0};
+  std::atomic<uint32_t> tail_{0};
+};
+
+static LogRing<LOG_RING_LEN> logRing;
+static std::atomic<uint32_t> logDropped{0};
+static TaskHandle_t logTaskHandle = nullptr;
+
+#if S4N_LOG_TAIL
+static LogRecord logTail[LOG_TAIL_LINES];  // drain task writes, /api/log reads
+static uint32_t  logTailSeq = 0;           // lines ever drained
+static MutexLock logTailMux;
+#endif
+
+static void logWrite(uint8_t level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+static void logWrite(uint8_t level, const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  if (!logTaskHandle) {
+    char line[LOG_LINE_MAX];
+    vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    Serial.println(line);
+    return;
+  }
+
+  uint32_t pos;
+  LogRecord* rec = logRing.claim(pos);
+  if (!rec) {
+    va_end(ap);
+    logDropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  const int n = vsnprintf(rec->text, sizeof(rec->text), fmt, ap);
+  va_end(ap);
+  rec->len = (uint8_t)constrain(n, 0, (int)sizeof(rec->text) - 1);
+  rec->level = level;
+  rec->ms = millis();
+  logRing.publish(pos);
+  xTaskNotifyGive(logTaskHandle);
+}
+
+#define LOG_AT(lvl, ...) do { if (S4N_LOG_LEVEL >= (lvl)) logWrite((lvl), __VA_ARGS__); } while (0)
+#define LOGE(...) LOG_AT(S4N_LOG_ERROR, __VA_ARGS__)
+#define LOGW(...) LOG_AT(S4N_LOG_WARN,  __VA_ARGS__)
+#define LOGI(...) LOG_AT(S4N_LOG_INFO,  __VA_ARGS__)
+#define LOGD(...) LOG_AT(S4N_LOG_DEBUG, __VA_ARGS__)
+
+static void logTask(void*) {
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    while (LogRecord* rec = logRing.front()) {
+      Serial.write((const uint8_t*)rec->text, rec->len);
+      Serial.write('\n');
+#if S4N_LOG_TAIL
+      logTailMux.lock();
+      LogRecord &t = logTail[logTailSeq % LOG_TAIL_LINES];
+      t = *rec;
+      t.seq = logTailSeq++;
+      logTailMux.unlock();
+#endif
+      logRing.pop();
+    }
+
+    const uint32_t dropped = logDropped.exchange(0, std::memory_order_relaxed);
+    if (dropped) Serial.printf("[LOG] %u line(s) dropped\n", (unsigned)dropped);
+  }
+}
+
+static void startLogTask() {
+#if S4N_LOG_TAIL
+  logTailMux.begin();
+#endif
+  xTaskCreatePinnedToCore(logTask, "log", LOG_TASK_STACK, nullptr,
+                          LOG_TASK_PRIO, &logTaskHandle, LOG_TASK_CORE);
+}
+
+// Before a deliberate reboot: let the drain task empty the ring
+static void logFlush() {
+  const uint32_t start = millis();
+  while (!logRing.empty() && millis() - start < LOG_FLUSH_MS) delay(5);
+  Serial.flush();
+}
+
+// Output drivers. write() sets one channel, writeAll() the whole image
+// (bit i = channel i, already converted to the electrical level).
+template <size_t N>
+class GpioRelayDriver {
+ public:
+  using Lock = SpinLock;
+  explicit GpioRelayDriver(const int (&pins)[N]) : pins_(pins) {}
+
+  void begin(uint32_t levels) {
+    for (size_t i = 0; i < N; i++) {
+      pinMode(pins_[i], OUTPUT);
+      digitalWrite(pins_[i], (levels >> i) & 1);
+    }
+  }
+  void write(size_t i, bool level, uint32_t) { digitalWrite(pins_[i], level); }
+
+  // All channels through the W1TS/W1TC set/clear registers: at most four
+  // stores, break before make. Every channel switching off is released (both
+  // banks) before any channel switching on is driven, so interlocked or
+  // reversing pairs never see both relays energized at once.
+  void writeAll(uint32_t levels) {
+    uint32_t set0 = 0, clr0 = 0, set1 = 0, clr1 = 0;
+    for (size_t i = 0; i < N; i++) {
+      const int p = pins_[i];
+      const bool hi = (levels >> i) & 1;
+      if (p < 32) (hi ? set0 : clr0) |= (1u << p);
+      else        (hi ? set1 : clr1) |= (1u << (p - 32));
+    }
+    if (RELAY_ACTIVE_LOW) {  // high = off: release with the set registers
+      if (set0) GPIO.out_w1ts = set0;
+      if (set1) GPIO.out1_w1ts.val = set1;
+      if (clr0) GPIO.out_w1tc = clr0;
+      if (clr1) GPIO.out1_w1tc.val = clr1;
+    } else {
+      if (clr0) GPIO.out_w1tc = clr0;
+      if (clr1) GPIO.out1_w1tc.val = clr1;
+      if (set0) GPIO.out_w1ts = set0;
+      if (set1) GPIO.out1_w1ts.val = set1;
+    }
+  }
+  int pin(size_t i) const { return pins_[i]; }
+
+ private:
+  const int (&pins_)[N];
+};
+
+template <size_t N>
+class Hc595RelayDriver {
+ public:
+  using Lock = MutexLock;  // shiftOut() is too slow for a critical section
+  Hc595RelayDriver(int data, int clock, int latch) : data_(data), clock_(clock), latch_(latch) {}
+
+  void begin(uint32_t levels) {
+    pinMode(data_, OUTPUT);
+    pinMode(clock_, OUTPUT);
+    pinMode(latch_, OUTPUT);
+    writeAll(levels);
+  }
+  void write(size_t, bool, uint32_t levels) { writeAll(levels); }
+  void writeAll(uint32_t levels) {
+    // Last register in the chain first; channel 0 = Q0 of the first chip
+    digitalWrite(latch_, LOW);
+    for (int b = (int)BYTES - 1; b >= 0; b--) shiftOut(data_, clock_, MSBFIRST, (uint8_t)(levels >> (8 * b)));
+    digitalWrite(latch_, HIGH);
+  }
+  int pin(size_t) const { return -1; }
+
+ private:
+  static const size_t BYTES = (N + 7) / 8;
+  int data_, clock_, latch_;
+};
+
+template <size_t N>
+class Pcf857xRelayDriver {
+ public:
+  static_assert(N <= 16, "PCF857x has at most 16 outputs");
+  using Lock = MutexLock;
+  explicit Pcf857xRelayDriver(uint8_t addr) : addr_(addr) {}
+
+  void begin(uint32_t levels) {
+    Wire.begin(S4N_I2C_SDA_PIN, S4N_I2C_SCL_PIN);
+    writeAll(levels);
+  }
+  void write(size_t, bool, uint32_t levels) { writeAll(levels); }
+  void writeAll(uint32_t levels) {
+    // Unused quasi-bidirectional pins stay high (= input)
+    const uint32_t image = levels | (~0u << N);
+    Wire.beginTransmission(addr_);
+    Wire.write((uint8_t)image);
+    if (N > 8) Wire.write((uint8_t)(image >> 8));
+    Wire.endTransmission();
+  }
+  int pin(size_t) const { return -1; }
+
+ private:
+  uint8_t addr_;
+};
+
+// Relay channels as a bitmask (bit i = relay i ON), independent of polarity/driver
+template <size_t N, class Driver>
+class RelayBank {
+ public:
+  explicit RelayBank(Driver& drv) : drv_(drv) {}
+
+  static constexpr size_t size() { return N; }
+
+  void begin(uint32_t initial = 0) {
+    lock_.begin();
+    state_ = initial & ALL;
+    drv_.begin(levels(state_));
+  }
+
+  bool get(size_t i) const { return (state_ >> i) & 1; }
+  uint32_t mask() const { return state_; }
+  Driver& driver() { return drv_; }
+
+  // Set, then clear, then toggle, applied as one driver write.
+  // Returns the bits that changed.
+  uint32_t apply(uint32_t setMask, uint32_t clrMask, uint32_t tglMask) {
+    lock_.lock();
+    const uint32_t next = (((state_ | setMask) & ~clrMask) ^ tglMask) & ALL;
+    const uint32_t changed = next ^ state_;
+    state_ = next;
+    if (changed) drv_.writeAll(levels(next));
+    lock_.unlock();
+    return changed;
+  }
+
+  // Returns the new state of channel i
+  bool write(size_t i, bool on, bool toggle) {
+    lock_.lock();
+    if (toggle) on = !get(i);
+    const uint32_t next = on ? (state_ | (1u << i)) : (state_ & ~(1u << i));
+    state_ = next;
+    drv_.write(i, level(on), levels(next));
+    lock_.unlock();
+    return on;
+  }
 
-// Debounced input states (INPUT_PULLUP)
-struct DebouncedInput {
-  int last_read;
-  int stable;
-  uint32_t last_change_ms;
-} inputs[4];
+  static constexpr bool level(bool on) { return RELAY_ACTIVE_LOW ? !on : on; }
+
+ private:
+  static constexpr uint32_t ALL = (N == 32) ? 0xFFFFFFFFu : ((1u << N) - 1);
+  static constexpr uint32_t levels(uint32_t on) { return RELAY_ACTIVE_LOW ? (~on & ALL) : on; }
+
+  Driver& drv_;
+  typename Driver::Lock lock_;
+  volatile uint32_t state_ = 0;
+};
+
+// Dry-contact inputs on GPIOs (interrupt capable, so no expander support)
+template <size_t N>
+class InputBank {
+ public:
+  explicit InputBank(const int (&pins)[N]) : pins_(pins) {}
+
+  static constexpr size_t size() { return N; }
+
+  void begin() {
+    for (size_t i = 0; i < N; i++) {
+      pinMode(pins_[i], INPUT_PULLUP);
+      in_[i].last_read = digitalRead(pins_[i]);
+      in_[i].stable = in_[i].last_read;
+      in_[i].last_change_ms = millis();
+    }
+  }
+
+  int pin(size_t i) const { return pins_[i]; }
+  DebouncedInput& operator[](size_t i) { return in_[i]; }
+  const DebouncedInput& operator[](size_t i) const { return in_[i]; }
+
+  // LOW = contact closed
+  bool closed(size_t i) const { return in_[i].stable == LOW; }
+  uint32_t closedMask() const {
+    uint32_t m = 0;
+    for (size_t i = 0; i < N; i++) if (closed(i)) m |= (1u << i);
+    return m;
+  }
+
+ private:
+  const int (&pins_)[N];
+  DebouncedInput in_[N];
+};
+
+#if S4N_RELAY_DRIVER == S4N_DRIVER_GPIO
+const int relayPins[] = {S4N_RELAY_PINS};
+static_assert(sizeof(relayPins) / sizeof(relayPins[0]) == RELAY_COUNT,
+              "S4N_RELAY_PINS must list exactly S4N_RELAY_COUNT pins");
+using RelayDriver = GpioRelayDriver<RELAY_COUNT>;
+static RelayDriver relayDriver(relayPins);
+#elif S4N_RELAY_DRIVER == S4N_DRIVER_HC595
+using RelayDriver = Hc595RelayDriver<RELAY_COUNT>;
+static RelayDriver relayDriver(S4N_HC595_DATA_PIN, S4N_HC595_CLOCK_PIN, S4N_HC595_LATCH_PIN);
+#elif S4N_RELAY_DRIVER == S4N_DRIVER_PCF857X
+using RelayDriver = Pcf857xRelayDriver<RELAY_COUNT>;
+static RelayDriver relayDriver(S4N_PCF857X_ADDR);
+#else
+#error "Unknown S4N_RELAY_DRIVER"
+#endif
+
+// -------------------- State -------------------
+RelayBank<RELAY_COUNT, RelayDriver> relays(relayDriver);
+InputBank<INPUT_COUNT> inputs(inputPins);
+
+// One GPIO edge as seen by the ISR
+struct InputEdge {
+  uint8_t  idx;     // input index
+  uint8_t  level;   // pin level right after the edge
+  uint32_t t_ms;    // millis() at the edge
+};
+
+static QueueHandle_t inputEdgeQueue = nullptr;
+static TaskHandle_t  controlTaskHandle = nullptr;
+static TaskHandle_t  netTaskHandle = nullptr;
+static TaskHandle_t  udpTaskHandle = nullptr;
+
+// Relay command from a network producer to the control task
+enum RelayCmdOp : uint8_t { CMD_SET, CMD_TOGGLE, CMD_PULSE, CMD_BATCH, CMD_PULSE_ARM };
+
+struct RelayCmd {
+  uint8_t  op;
+  uint8_t  relay;   // CMD_SET/TOGGLE/PULSE/PULSE_ARM
+  bool     on;      // CMD_SET
+  uint32_t ms;      // CMD_PULSE/PULSE_ARM
+  uint32_t set, clr, tgl;  // CMD_BATCH
+};
+
+// One ring per producing task keeps each single-producer
+static SpscRing<RelayCmd, CMD_RING_LEN> mqttCmdRing;  // net task (mqttCallback)
+static SpscRing<RelayCmd, CMD_RING_LEN> httpCmdRing;  // async_tcp (web handlers)
+static SpscRing<RelayCmd, CMD_RING_LEN> espnowCmdRing; // WiFi task (ESP-NOW receive)
+static SpscRing<RelayCmd, CMD_RING_LEN> udpCmdRing;    // udp task
+
+// States waiting to be pushed to SSE clients by the net task; other tasks only
+// set bits here (bit i = relay/input i). MQTT has its own outbox below.
+static std::atomic<uint32_t> pendingRelayEvt{0};
+static std::atomic<uint32_t> pendingInputEvt{0};
 
 // IDs
 String deviceId;
@@ -103,6 +873,11 @@ String mdnsFqdn;
 struct WifiCfg {
   String ssid;
   String pass;
+  // Optional static IPv4 (0 = DHCP); skips the DHCP round trip on boot
+  uint32_t ip = 0, gateway = 0, subnet = 0, dns = 0;
+  // Last AP we associated with (channel 0 = unknown, do a full scan)
+  uint8_t bssid[6] = {0};
+  uint8_t channel = 0;
 } wifiCfg;
 
 // MQTT config
@@ -114,15 +889,23 @@ struct MqttCfg {
   String pass;
   String cmdTopic;   // Used as BASE TOPIC in per-relay mode
   String stateTopic; // Unused in per-relay mode (kept for compatibility)
+  uint16_t rate = 20; // outbound publishes per second, 0 = unlimited
+  uint8_t stateFormat = 0; // StateFormat
+  bool tls = false;        // verified against MQTT_CA_PATH
+  bool haDiscovery = true; // Home Assistant discovery configs under homeassistant/
 } mqttCfg;
 
-// Derived topics
-String baseTopic;         // = mqttCfg.cmdTopic
-String tAvail;            // <base>/status
-String tRelaySetWild;     // <base>/relay/+/set
-String tRelaySetAll;      // <base>/relay/set  (optional "all relays" JSON)
-String tRelayStatePrefix; // <base>/relay/
-String tInputStatePrefix; // <base>/input/
+// How state is published: one retained topic per channel (default), or a
+// single <base>/state aggregate as compact JSON or packed binary
+enum StateFormat : uint8_t { SF_TOPICS = 0, SF_JSON = 1, SF_BINARY = 2 };
+
+// Power profile (see the Power section); stored in the config blob
+enum PowerProfile : uint8_t { PWR_PERFORMANCE = 0, PWR_BALANCED = 1, PWR_LOW = 2, PWR_COUNT };
+static uint8_t powerProfile = PWR_BALANCED;
+
+// Derived topics, built once by applyTopics() (see include/topic_table.h)
+using TopicTable = TopicTableOf<RELAY_COUNT, INPUT_COUNT>;
+static TopicTable topics;
 
 // -------------------- Helpers -----------------
 static String macToDeviceId() {
@@ -141,27 +924,19 @@ static String macSuffix6() {
   return String(buf);
 }
 
-static void applyTopics() {
-  baseTopic = mqttCfg.cmdTopic;
-  baseTopic.trim();
-  while (baseTopic.endsWith("/")) baseTopic.remove(baseTopic.length() - 1);
+static void haBuild();
 
-  tAvail            = baseTopic + "/status";
-  tRelaySetWild     = baseTopic + "/relay/+/set";
-  tRelaySetAll      = baseTopic + "/relay/set";
-  tRelayStatePrefix = baseTopic + "/relay/";
-  tInputStatePrefix = baseTopic + "/input/";
+static void applyTopics() {
+  if (!buildTopics(topics, mqttCfg.cmdTopic.c_str(), mqttCfg.cmdTopic.length())) {
+    LOGE("[MQTT] Invalid base topic (max %u chars, no wildcards): %s",
+         (unsigned)topicBaseMax<RELAY_COUNT, INPUT_COUNT>(), mqttCfg.cmdTopic.c_str());
+  }
+  haBuild();
 }
 
-static inline String relaySetTopic(int relayIdx0) {
-  return tRelayStatePrefix + String(relayIdx0 + 1) + "/set";
-}
-static inline String relayStateTopic(int relayIdx0) {
-  return tRelayStatePrefix + String(relayIdx0 + 1) + "/state";
-}
-static inline String inputStateTopic(int inputIdx0) {
-  return tInputStatePrefix + String(inputIdx0 + 1) + "/state";
-}
+static inline const char* relaySetTopic(int relayIdx0)   { return topics.relaySet[relayIdx0]; }
+static inline const char* relayStateTopic(int relayIdx0) { return topics.relayState[relayIdx0]; }
+static inline const char* inputStateTopic(int inputIdx0) { return topics.inputState[inputIdx0]; }
 
 // -------------------- Debug WiFi --------------------
 static const char* wlStatusStr(wl_status_t st) {
@@ -209,343 +984,3552 @@ static const char* wifiDiscReasonStr(int reason) {
 static void onWiFiEvent(WiFiEvent_t event, WiFiEventInfo_t info) {
   switch (event) {
     case ARDUINO_EVENT_WIFI_STA_CONNECTED:
-      Serial.println("[WiFiEvent] STA_CONNECTED");
+      LOGI("[WiFiEvent] STA_CONNECTED");
       break;
     case ARDUINO_EVENT_WIFI_STA_GOT_IP:
-      Serial.printf("[WiFiEvent] GOT_IP: %s\n", WiFi.localIP().toString().c_str());
+      LOGI("[WiFiEvent] GOT_IP: %s", WiFi.localIP().toString().c_str());
       break;
     case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
-      Serial.printf("[WiFiEvent] STA_DISCONNECTED reason=%d (%s)\n",
-                    (int)info.wifi_sta_disconnected.reason,
-                    wifiDiscReasonStr((int)info.wifi_sta_disconnected.reason));
+      LOGW("[WiFiEvent] STA_DISCONNECTED reason=%d (%s)",
+           (int)info.wifi_sta_disconnected.reason,
+           wifiDiscReasonStr((int)info.wifi_sta_disconnected.reason));
       break;
     default:
       break;
   }
 }
 
-// -------------------- Basic Auth helpers (STA only) --------------------
-static inline bool authOK(AsyncWebServerRequest *r) {
-  if (!BASIC_AUTH_ON) return true;
-  return r->authenticate(BASIC_USER, BASIC_PASS);
-}
+// -------------------- Static assets --------------------
+struct WebAsset {
+  char path[40];   // e.g. "/www/index.html" (uncompressed name)
+  char etag[20];   // quoted, e.g. "\"9ea58af8ce7be299\""
+};
+static WebAsset webAssets[ASSET_MAX];
+static int webAssetCount = 0;
+
+// Read once at boot; a missing manifest just disables 304 handling
+static void loadAssetEtags() {
+  File f = LittleFS.open(ASSET_ETAGS_PATH, "r");
+  if (!f) {
+    Serial.println("[FS] No asset ETag manifest (serving without 304 support)");
+    return;
+  }
 
-static inline bool requireAuthOr401(AsyncWebServerRequest *r) {
-  if (authOK(r)) return true;
-  r->requestAuthentication();
-  return false;
+  char line[64];
+  while (f.available() && webAssetCount < ASSET_MAX) {
+    const size_t n = f.readBytesUntil('\n', line, sizeof(line) - 1);
+    line[n] = '\0';
+    char* sp = strchr(line, ' ');
+    if (!sp) continue;
+    *sp = '\0';
+
+    WebAsset &a = webAssets[webAssetCount];
+    snprintf(a.path, sizeof(a.path), "%s/%s", FS_ROOT, line);
+    snprintf(a.etag, sizeof(a.etag), "%s", sp + 1);
+    webAssetCount++;
+  }
+  f.close();
+  Serial.printf("[FS] %d asset ETags loaded\n", webAssetCount);
 }
 
-// -------------------- Relay / Input publish --------------------
-static void mqttPublishRetained(const String& topic, const char* payload) {
-  if (!mqtt.connected()) return;
-  mqtt.publish(topic.c_str(), payload, true);
+static const WebAsset* findAsset(const char* path) {
+  for (int i = 0; i < webAssetCount; i++) {
+    if (strcmp(webAssets[i].path, path) == 0) return &webAssets[i];
+  }
+  return nullptr;
 }
 
-static void publishAvailability(bool online) {
-  if (!mqtt.connected() || !tAvail.length()) return;
-  mqttPublishRetained(tAvail, online ? "online" : "offline");
-}
+// Serve path (or its .gz sibling, which AsyncFileResponse picks up with
+// Content-Encoding: gzip), answering If-None-Match with 304
+static void serveAsset(AsyncWebServerRequest *r, const char* path, const char* contentType) {
+  const WebAsset* a = findAsset(path);
 
-static void publishRelayStateOne(int relayIdx0) {
-  if (!mqtt.connected() || !baseTopic.length()) return;
-  const String t = relayStateTopic(relayIdx0);
-  mqttPublishRetained(t, relayState[relayIdx0] ? "ON" : "OFF");
-}
+  if (a && r->hasHeader("If-None-Match") && r->getHeader("If-None-Match")->value() == a->etag) {
+    AsyncWebServerResponse* res = r->beginResponse(304);
+    res->addHeader("ETag", a->etag);
+    res->addHeader("Cache-Control", ASSET_CACHE_CTRL);
+    r->send(res);
+    return;
+  }
+
+  // Listed assets are known to exist; skip the LittleFS lookups for them
+  if (!a) {
+    char gz[48];
+    snprintf(gz, sizeof(gz), "%s.gz", path);
+    if (!LittleFS.exists(path) && !LittleFS.exists(gz)) {
+      r->send(404, "text/plain", "missing");
+      return;
+    }
+  }
 
-static void publishAllRelayStates() {
-  for (int i = 0; i < 4; i++) publishRelayStateOne(i);
+  AsyncWebServerResponse* res = r->beginResponse(LittleFS, path, contentType);
+  res->addHeader("Cache-Control", ASSET_CACHE_CTRL);
+  if (a) res->addHeader("ETag", a->etag);
+  r->send(res);
 }
 
-static void publishInputStateOne(int inputIdx0) {
-  if (!mqtt.connected() || !baseTopic.length()) return;
-  // INPUT_PULLUP: LOW = CLOSED, HIGH = OPEN
-  const bool closed = (inputs[inputIdx0].stable == LOW);
-  const String t = inputStateTopic(inputIdx0);
-  mqttPublishRetained(t, closed ? "ON" : "OFF");
+// -------------------- JSON responses --------------------
+// Serializes straight into the response buffer, sized up front by
+// measureJson(): no intermediate String, one allocation per response.
+static void sendJson(AsyncWebServerRequest* r, const JsonDocument& d, int code = 200) {
+  AsyncResponseStream* res = r->beginResponseStream("application/json", measureJson(d));
+  res->setCode(code);
+  serializeJson(d, *res);
+  r->send(res);
 }
 
-static void publishAllInputStates() {
-  for (int i = 0; i < 4; i++) publishInputStateOne(i);
+// -------------------- Basic Auth helpers (STA only) --------------------
+// Credentials are stored in NVS ("auth") as PBKDF2-HMAC-SHA256(salt, pass).
+// That check is slow on purpose, so the SHA-256 of each recently accepted
+// Authorization header is cached: a page load with a dozen assets costs one
+// PBKDF2 run, then one hash per request. async_tcp task only.
+// Slow checks are rationed before they run, per client address and overall
+// (token buckets, refilled over time, charged only when a check fails): a
+// stream of wrong passwords gets 429 instead of stalling async_tcp in PBKDF2.
+// Cached logins never need a token.
+static const uint32_t AUTH_PBKDF2_ITER  = 1000;
+static const size_t   AUTH_SALT_LEN     = 16;
+static const size_t   AUTH_HASH_LEN     = 32;
+static const size_t   AUTH_USER_MAX     = 32;
+static const size_t   AUTH_PASS_MIN     = 8;
+static const size_t   AUTH_HEADER_MAX   = 256;
+static const size_t   AUTH_CACHE_SLOTS  = 4;
+static const uint32_t AUTH_CACHE_TTL_MS = 10 * 60 * 1000;
+static const size_t   AUTH_FAIL_CLIENTS = 8;
+static const uint32_t AUTH_FAIL_BURST   = 5;      // misses per client before throttling
+static const uint32_t AUTH_FAIL_REFILL_MS = 10000; // then one more try per 10 s
+static const uint32_t AUTH_GLOBAL_BURST = 10;     // slow checks across all clients
+static const uint32_t AUTH_GLOBAL_REFILL_MS = 1000;
+
+struct AuthCfg {
+  String user;
+  uint8_t salt[AUTH_SALT_LEN];
+  uint8_t hash[AUTH_HASH_LEN];
+  bool factory = true;  // still the built-in default password
+} authCfg;
+
+struct AuthCacheEntry {
+  uint8_t digest[AUTH_HASH_LEN];  // SHA-256 of the Authorization header value
+  uint32_t atMs;
+  bool valid;
+};
+static AuthCacheEntry authCache[AUTH_CACHE_SLOTS];
+static uint8_t authCacheNext = 0;
+
+// Tokens in 1/1000 try, like the outbox pacing
+struct AuthBucket {
+  uint32_t ip;
+  uint32_t tokensMilli;
+  uint32_t atMs;
+};
+static AuthBucket authClients[AUTH_FAIL_CLIENTS];
+static AuthBucket authGlobal = {0, AUTH_GLOBAL_BURST * 1000, 0};
+static std::atomic<uint32_t> authThrottled{0};
+
+static void authRefill(AuthBucket& b, uint32_t now, uint32_t burst, uint32_t refillMs) {
+  const uint32_t elapsed = min(now - b.atMs, burst * refillMs);
+  b.tokensMilli = min(burst * 1000, b.tokensMilli + elapsed * 1000 / refillMs);
+  b.atMs = now;
 }
 
-static void setRelay(int relayNum, bool on) {
-  if (relayNum < 0 || relayNum >= 4) return;
+// Bucket for a client; an unknown one takes the fullest slot (nothing
+// throttled is evicted while a fresher one exists)
+static AuthBucket& authClient(uint32_t ip, uint32_t now) {
+  AuthBucket* pick = &authClients[0];
+  for (auto &b : authClients) {
+    authRefill(b, now, AUTH_FAIL_BURST, AUTH_FAIL_REFILL_MS);
+    if (b.ip == ip) return b;
+    if (b.tokensMilli > pick->tokensMilli) pick = &b;
+  }
+  pick->ip = ip;
+  pick->tokensMilli = AUTH_FAIL_BURST * 1000;
+  return *pick;
+}
 
-  relayState[relayNum] = on;
-  const int level = RELAY_ACTIVE_LOW ? (on ? LOW : HIGH) : (on ? HIGH : LOW);
-  digitalWrite(relayPins[relayNum], level);
+// No early exit, so timing does not reveal how many bytes matched
+static bool ctEqual(const uint8_t* a, const uint8_t* b, size_t n) {
+  uint8_t diff = 0;
+  for (size_t i = 0; i < n; i++) diff |= a[i] ^ b[i];
+  return diff == 0;
+}
 
-  Serial.printf("[RELAY %d] %s (GPIO level=%d)\n", relayNum + 1, on ? "ON" : "OFF", level);
+static void sha256(const void* data, size_t len, uint8_t out[AUTH_HASH_LEN]) {
+  mbedtls_md(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), (const uint8_t*)data, len, out);
+}
 
-  // Publish per-relay state only
-  publishRelayStateOne(relayNum);
+static void authHashPassword(const uint8_t* salt, const char* pass, size_t len, uint8_t out[AUTH_HASH_LEN]) {
+  mbedtls_md_context_t ctx;
+  mbedtls_md_init(&ctx);
+  mbedtls_md_setup(&ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1);
+  mbedtls_pkcs5_pbkdf2_hmac(&ctx, (const uint8_t*)pass, len, salt, AUTH_SALT_LEN,
+                            AUTH_PBKDF2_ITER, AUTH_HASH_LEN, out);
+  mbedtls_md_free(&ctx);
 }
 
-static void toggleRelay(int relayNum) {
-  setRelay(relayNum, !relayState[relayNum]);
+static bool authCheckPassword(const char* pass, size_t len) {
+  uint8_t h[AUTH_HASH_LEN];
+  authHashPassword(authCfg.salt, pass, len, h);
+  return ctEqual(h, authCfg.hash, AUTH_HASH_LEN);
 }
 
-// -------------------- Preferences --------------------
-static void loadWifiCfg() {
-  prefs.begin("wifi", true);
-  wifiCfg.ssid = prefs.getString("ssid", "");
-  wifiCfg.pass = prefs.getString("pass", "");
-  prefs.end();
+static void authCacheClear() {
+  for (auto &e : authCache) e.valid = false;
 }
 
-static void saveWifiCfg() {
-  prefs.begin("wifi", false);
-  prefs.putString("ssid", wifiCfg.ssid);
-  prefs.putString("pass", wifiCfg.pass);
-  prefs.end();
+static void loadAuthCfg() {
+  Preferences p;
+  p.begin("auth", true);
+  authCfg.user = p.getString("user", "");
+  const bool stored = authCfg.user.length() &&
+                      p.getBytes("salt", authCfg.salt, AUTH_SALT_LEN) == AUTH_SALT_LEN &&
+                      p.getBytes("hash", authCfg.hash, AUTH_HASH_LEN) == AUTH_HASH_LEN;
+  p.end();
+
+  authCfg.factory = !stored;
+  if (authCfg.factory) {
+    authCfg.user = BASIC_DEFAULT_USER;
+    esp_fill_random(authCfg.salt, AUTH_SALT_LEN);
+    authHashPassword(authCfg.salt, BASIC_DEFAULT_PASS, strlen(BASIC_DEFAULT_PASS), authCfg.hash);
+  }
 }
 
-static void loadMqttCfg() {
-  prefs.begin("mqtt", true);
-  mqttCfg.enabled    = prefs.getBool("en", false);
-  mqttCfg.host       = prefs.getString("host", "");
-  mqttCfg.port       = prefs.getUShort("port", 1883);
-  mqttCfg.user       = prefs.getString("user", "");
-  mqttCfg.pass       = prefs.getString("pass", "");
-  mqttCfg.cmdTopic   = prefs.getString("cmd", ""); // base topic
-  mqttCfg.stateTopic = prefs.getString("st", "");  // unused
-  prefs.end();
-  applyTopics();
+// Takes effect only once NVS holds it, so a failed write cannot be undone by
+// the next reboot; false = nothing changed
+static bool saveAuthCfg(const String& user, const String& pass) {
+  uint8_t salt[AUTH_SALT_LEN], hash[AUTH_HASH_LEN];
+  esp_fill_random(salt, AUTH_SALT_LEN);
+  authHashPassword(salt, pass.c_str(), pass.length(), hash);
+
+  Preferences p;  // own handle: async_tcp, while the net task may be in NVS
+  bool ok = p.begin("auth", false);
+  ok = ok && p.putString("user", user) == user.length();
+  ok = ok && p.putBytes("salt", salt, AUTH_SALT_LEN) == AUTH_SALT_LEN;
+  ok = ok && p.putBytes("hash", hash, AUTH_HASH_LEN) == AUTH_HASH_LEN;
+  p.end();
+  if (!ok) return false;
+
+  authCfg.user = user;
+  memcpy(authCfg.salt, salt, AUTH_SALT_LEN);
+  memcpy(authCfg.hash, hash, AUTH_HASH_LEN);
+  authCfg.factory = false;
+  authCacheClear();  // every browser has to log in again
+  return true;
 }
 
-static void saveMqttCfg() {
-  prefs.begin("mqtt", false);
-  prefs.putBool("en", mqttCfg.enabled);
-  prefs.putString("host", mqttCfg.host);
-  prefs.putUShort("port", mqttCfg.port);
-  prefs.putString("user", mqttCfg.user);
-  prefs.putString("pass", mqttCfg.pass);
-  prefs.putString("cmd",  mqttCfg.cmdTopic);
-  prefs.putString("st",   mqttCfg.stateTopic);
-  prefs.end();
+// "Basic base64(user:pass)" against the stored hash (the slow path)
+static bool authCheckHeader(const String& h) {
+  if (h.length() < 6 || strncasecmp(h.c_str(), "Basic ", 6) != 0) return false;
+
+  uint8_t plain[AUTH_HEADER_MAX];
+  size_t n = 0;
+  if (mbedtls_base64_decode(plain, sizeof(plain), &n,
+                            (const uint8_t*)h.c_str() + 6, h.length() - 6) != 0) return false;
+
+  const uint8_t* colon = (const uint8_t*)memchr(plain, ':', n);
+  if (!colon) return false;
+  const size_t userLen = colon - plain;
+  const bool userOk = userLen == authCfg.user.length() &&
+                      memcmp(plain, authCfg.user.c_str(), userLen) == 0;
+  // Hash even for an unknown user, so the response time does not tell
+  const bool passOk = authCheckPassword((const char*)colon + 1, n - userLen - 1);
+  return userOk && passOk;
 }
 
-// -------------------- WiFi --------------------
-static bool connectSTA(uint32_t timeoutMs = 20000) {
-  if (!wifiCfg.ssid.length()) {
-    Serial.println("[WiFi] No SSID saved.");
+// throttled (optional) tells a rationed-out client from a wrong password
+static bool authOK(AsyncWebServerRequest *r, bool* throttled = nullptr) {
+  if (!BASIC_AUTH_ON) return true;
+  if (!r->hasHeader("Authorization")) return false;
+  const String& h = r->getHeader("Authorization")->value();
+  if (h.length() > AUTH_HEADER_MAX) return false;
+
+  uint8_t digest[AUTH_HASH_LEN];
+  sha256(h.c_str(), h.length(), digest);
+
+  const uint32_t now = millis();
+  bool hit = false;
+  for (const auto &e : authCache) {
+    hit |= e.valid && now - e.atMs < AUTH_CACHE_TTL_MS && ctEqual(e.digest, digest, AUTH_HASH_LEN);
+  }
+  if (hit) return true;
+
+  const uint32_t ip = r->client() ? r->client()->getRemoteAddress() : 0;
+  AuthBucket& client = authClient(ip, now);
+  authRefill(authGlobal, now, AUTH_GLOBAL_BURST, AUTH_GLOBAL_REFILL_MS);
+  if (client.tokensMilli < 1000 || authGlobal.tokensMilli < 1000) {
+    authThrottled++;
+    if (throttled) *throttled = true;
     return false;
   }
+  if (!authCheckHeader(h)) {
+    client.tokensMilli -= 1000;
+    authGlobal.tokensMilli -= 1000;
+    return false;
+  }
+  AuthCacheEntry &e = authCache[authCacheNext];
+  authCacheNext = (authCacheNext + 1) % AUTH_CACHE_SLOTS;
+  memcpy(e.digest, digest, AUTH_HASH_LEN);
+  e.atMs = now;
+  e.valid = true;
+  return true;
+}
 
-  Serial.println("[WiFi] connectSTA()");
-  Serial.println("[WiFi] Saved SSID = [" + wifiCfg.ssid + "]");
-  Serial.println("[WiFi] Saved PASS length = " + String(wifiCfg.pass.length()));
-
-  WiFi.mode(WIFI_STA);
-  WiFi.setHostname(mdnsHost.c_str());
-  WiFi.setAutoReconnect(true);
+static inline bool requireAuthOr401(AsyncWebServerRequest *r) {
+  bool throttled = false;
+  if (authOK(r, &throttled)) return true;
+  if (throttled) {
+    AsyncWebServerResponse* res = r->beginResponse(429, "application/json", "{\"ok\":false,\"err\":\"too_many_attempts\"}");
+    res->addHeader("Retry-After", String(AUTH_FAIL_REFILL_MS / 1000));
+    r->send(res);
+    return false;
+  }
+  r->requestAuthentication();
+  return false;
+}
 
-  WiFi.disconnect(true, true);
-  delay(200);
+// -------------------- Metrics --------------------
+// Hot-path timings, folded into fixed log-linear histograms (4 sub-buckets
+// per power of two, ~19% worst-case error) of 1/16 us ticks. On a fixed clock
+// they come from the CPU cycle counter, converted when recorded; under DFS
+// the clock moves between 80 and 240 MHz mid-scope, so they come from
+// esp_timer (1 us resolution) instead.
+// Exported on /api/metrics (Prometheus text) and <base>/metrics (JSON).
+static const uint8_t  HIST_BUCKETS        = 112; // up to 2^29 ticks (~33 s)
+static const uint32_t HIST_TICKS_PER_US   = 16;
+static const uint32_t METRICS_PUBLISH_MS  = 60000;
+static const size_t   METRICS_JSON_MAX    = 768;  // worst case ~600: 10-digit values everywhere
+
+struct LatencyHist {
+  uint32_t count;
+  uint64_t sumTicks;
+  uint32_t maxTicks;
+  uint32_t bucket[HIST_BUCKETS];
+};
+
+enum : uint8_t { MT_LOOP, MT_MQTT_CB, MT_RELAY_WRITE, MT_INPUT, MT_HTTP, MT_UDP, MT_COUNT };
+
+static const char* const METRIC_NAME[MT_COUNT] = {
+  "loop", "mqtt_cb", "relay_write", "input", "http", "udp",
+};
+static const char* const METRIC_HELP[MT_COUNT] = {
+  "Network task iteration, excluding the idle wait",
+  "MQTT command callback, receive to command queued",
+  "Relay output write (driver only)",
+  "Debounced input commit, incl. linked relay toggle",
+  "Authenticated /api handler",
+  "UDP command, receive to reply sent",
+};
+
+static LatencyHist metrics[MT_COUNT];
+static portMUX_TYPE metricsMux = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t lastMetricsPublishMs = 0;
+static std::atomic<bool> metricsWallClock{false};  // DFS active: time with esp_timer
+
+static inline uint8_t histBucket(uint32_t v) {
+  if (v < 4) return v;
+  const uint8_t msb = 31 - __builtin_clz(v);  // >= 2
+  const uint8_t b = (msb - 1) * 4 + ((v >> (msb - 2)) & 3);
+  return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
 
-  Serial.println("[WiFi] Connecting...");
-  WiFi.begin(wifiCfg.ssid.c_str(), wifiCfg.pass.c_str());
+// Largest value that lands in bucket b
+static inline uint32_t histBucketTop(uint8_t b) {
+  if (b < 4) return b;
+  const uint32_t step = 1u << (b / 4 - 1);
+  return (4u + (b & 3)) * step + step - 1;
+}
 
-  wl_status_t last = WL_IDLE_STATUS;
-  uint32_t t0 = millis();
+static void metricsRecord(uint8_t id, uint32_t ticks) {
+  LatencyHist &h = metrics[id];
+  const uint8_t b = histBucket(ticks);
+  portENTER_CRITICAL(&metricsMux);
+  h.count++;
+  h.sumTicks += ticks;
+  if (ticks > h.maxTicks) h.maxTicks = ticks;
+  h.bucket[b]++;
+  portEXIT_CRITICAL(&metricsMux);
+}
 
-  while (millis() - t0 < timeoutMs) {
-    wl_status_t st = WiFi.status();
-    if (st != last) {
-      last = st;
-      Serial.printf("[WiFi] status=%d (%s)\n", (int)st, wlStatusStr(st));
+// Times a scope. Each core has its own cycle counter, so a cycle-timed sample
+// from a task that migrated mid-scope (async_tcp is not pinned) is discarded.
+class MetricScope {
+ public:
+  explicit MetricScope(uint8_t id)
+      : id_(id), wall_(metricsWallClock), core_(xPortGetCoreID()),
+        t0_(wall_ ? (uint32_t)esp_timer_get_time() : ESP.getCycleCount()) {}
+  ~MetricScope() {
+    if (wall_) {
+      const uint32_t us = (uint32_t)esp_timer_get_time() - t0_;
+      metricsRecord(id_, min(us, (uint32_t)(UINT32_MAX / HIST_TICKS_PER_US)) * HIST_TICKS_PER_US);
+      return;
     }
-    if (st == WL_CONNECTED) {
-      Serial.printf("[WiFi] Connected! IP=%s RSSI=%d\n",
-                    WiFi.localIP().toString().c_str(),
-                    WiFi.RSSI());
-      return true;
+    const uint32_t dt = ESP.getCycleCount() - t0_;
+    if (xPortGetCoreID() == core_) {
+      metricsRecord(id_, (uint32_t)((uint64_t)dt * HIST_TICKS_PER_US / ESP.getCpuFreqMHz()));
     }
-    delay(250);
   }
-
-  Serial.printf("[WiFi] Timeout. Final status=%d (%s)\n",
-                (int)WiFi.status(), wlStatusStr(WiFi.status()));
-  return false;
+ private:
+  uint8_t  id_;
+  bool     wall_;
+  BaseType_t core_;
+  uint32_t t0_;
+};
+
+struct HistSummary {
+  uint32_t count;
+  float    sumUs, p50Us, p99Us, maxUs;
+};
+
+static HistSummary histSummarize(uint8_t id) {
+  LatencyHist snap;
+  portENTER_CRITICAL(&metricsMux);
+  snap = metrics[id];
+  portEXIT_CRITICAL(&metricsMux);
+
+  const float tpu = HIST_TICKS_PER_US;
+  HistSummary s = {snap.count, snap.sumTicks / tpu, 0, 0, snap.maxTicks / tpu};
+  if (!snap.count) return s;
+
+  const uint32_t r50 = (snap.count + 1) / 2;
+  const uint32_t r99 = snap.count - snap.count / 100;
+  uint32_t seen = 0;
+  bool have50 = false;
+  for (uint8_t b = 0; b < HIST_BUCKETS; b++) {
+    seen += snap.bucket[b];
+    const uint32_t top = min(histBucketTop(b), snap.maxTicks);
+    if (!have50 && seen >= r50) { s.p50Us = top / tpu; have50 = true; }
+    if (seen >= r99) { s.p99Us = top / tpu; break; }
+  }
+  return s;
 }
 
-static void startAPPortal() {
-  WiFi.disconnect(true, true);
-  delay(200);
-
-  const String apSsid = "Switch4Node-" + deviceId;
-  WiFi.mode(WIFI_AP);
-  WiFi.softAP(apSsid.c_str(), nullptr);
-  delay(200);
-
-  const IPAddress ip = WiFi.softAPIP();
-  dns.start(DNS_PORT, "*", ip);
+static void writeMetricsProm(Print &out) {
+  for (uint8_t id = 0; id < MT_COUNT; id++) {
+    const HistSummary s = histSummarize(id);
+    const char* n = METRIC_NAME[id];
+    out.printf("# HELP s4n_%s_us %s\n# TYPE s4n_%s_us summary\n", n, METRIC_HELP[id], n);
+    out.printf("s4n_%s_us{quantile=\"0.5\"} %.1f\n", n, s.p50Us);
+    out.printf("s4n_%s_us{quantile=\"0.99\"} %.1f\n", n, s.p99Us);
+    out.printf("s4n_%s_us_sum %.1f\ns4n_%s_us_count %u\n", n, s.sumUs, n, (unsigned)s.count);
+    out.printf("# HELP s4n_%s_us_max %s, slowest since boot\n# TYPE s4n_%s_us_max gauge\n",
+               n, METRIC_HELP[id], n);
+    out.printf("s4n_%s_us_max %.1f\n", n, s.maxUs);
+  }
 
-  Serial.println("[AP] Mode SSID: " + apSsid);
-  Serial.println("[AP] IP: " + ip.toString());
+  out.printf("# HELP s4n_heap_free_bytes Free heap\n# TYPE s4n_heap_free_bytes gauge\n"
+             "s4n_heap_free_bytes %u\n", (unsigned)ESP.getFreeHeap());
+  out.printf("# HELP s4n_heap_min_free_bytes Lowest free heap since boot\n# TYPE s4n_heap_min_free_bytes gauge\n"
+             "s4n_heap_min_free_bytes %u\n", (unsigned)ESP.getMinFreeHeap());
+  out.printf("# HELP s4n_heap_largest_block_bytes Largest allocatable heap block\n"
+             "# TYPE s4n_heap_largest_block_bytes gauge\n"
+             "s4n_heap_largest_block_bytes %u\n", (unsigned)ESP.getMaxAllocHeap());
+  out.printf("# HELP s4n_uptime_seconds Time since boot\n# TYPE s4n_uptime_seconds counter\n"
+             "s4n_uptime_seconds %u\n", (unsigned)(millis() / 1000));
+  out.printf("# HELP s4n_auth_throttled_total Requests refused with 429 before a password check\n"
+             "# TYPE s4n_auth_throttled_total counter\n"
+             "s4n_auth_throttled_total %u\n", (unsigned)authThrottled.load());
 }
 
-// -------------------- mDNS --------------------
-static void startMDNS() {
-  if (MDNS.begin(mdnsHost.c_str())) {
-    MDNS.addService("http", "tcp", 80);
-    Serial.println("[mDNS] http://" + mdnsFqdn + "/");
-  } else {
-    Serial.println("[mDNS] start failed");
+// {"loop":{"p50":12.0,"p99":250.0,"max":900.0,"n":123},...,"heap":{...},"up":123}
+// 0 if it does not fit (the caller skips the publish rather than send half)
+static size_t buildMetricsJson(char* buf, size_t cap) {
+  size_t n = snprintf(buf, cap, "{");
+  for (uint8_t id = 0; id < MT_COUNT && n < cap; id++) {
+    const HistSummary s = histSummarize(id);
+    n += snprintf(buf + n, cap - n, "\"%s\":{\"p50\":%.1f,\"p99\":%.1f,\"max\":%.1f,\"n\":%u},",
+                  METRIC_NAME[id], s.p50Us, s.p99Us, s.maxUs, (unsigned)s.count);
   }
+  if (n < cap) {
+    n += snprintf(buf + n, cap - n, "\"heap\":{\"free\":%u,\"min_free\":%u,\"largest\":%u},\"up\":%u}",
+                  (unsigned)ESP.getFreeHeap(), (unsigned)ESP.getMinFreeHeap(),
+                  (unsigned)ESP.getMaxAllocHeap(), (unsigned)(millis() / 1000));
+  }
+  return n < cap ? n : 0;
 }
 
-// -------------------- MQTT --------------------
-static bool mqttReady() {
-  if (!mqttCfg.enabled) return false;
-  if (!mqttCfg.host.length()) return false;
-  if (!baseTopic.length()) return false;
-  return true;
+// -------------------- Relay / Input publish --------------------
+// True once the worker handed over a connected client (net task only)
+static bool mqttLinkUp() {
+  return mqttConn >= MQ_SUBSCRIBE && mqtt.connected();
 }
 
-static bool parseOnOffToggle(const String& s, bool &outOn, bool &isToggle) {
-  String v = s;
-  v.trim();
-  v.toUpperCase();
+// Outbox: one slot per retained topic we own. Other tasks only set a slot's
+// dirty bit; the payload is rendered from live state when the slot is sent,
+// so any number of updates to one topic collapse into its latest value.
+enum : uint16_t {
+  OB_AVAIL     = 0,
+  OB_RELAY_ALL = 1,
+  OB_RELAY0    = 2,
+  OB_INPUT0    = OB_RELAY0 + RELAY_COUNT,
+  OB_COUNT0    = OB_INPUT0 + INPUT_COUNT,
+  OB_STATE     = OB_COUNT0 + INPUT_COUNT,
+  OB_OTA,
+  OB_METRICS,
+  OB_HA0,      // discovery configs (relays, then inputs); never part of a snapshot
+  OB_SLOTS     = OB_HA0 + RELAY_COUNT + INPUT_COUNT
+};
+
+static const size_t OB_WORDS = (OB_SLOTS + 31) / 32;
+// Largest payload: the relay/state aggregate or the metrics summary
+static const size_t OB_PAYLOAD_MAX = max(8 + RELAY_COUNT * 12, METRICS_JSON_MAX);
+// PubSubClient buffer: fixed header + topic + payload
+static const uint16_t MQTT_BUFFER_SIZE = 16 + TOPIC_MAX + max(OB_PAYLOAD_MAX, HA_PAYLOAD_MAX);
+
+static std::atomic<uint32_t> obDirty[OB_WORDS];
+static uint16_t obCursor = 0;      // round-robin start, so no slot starves
+static uint32_t obTokensMilli = 0; // token bucket, in 1/1000 message
+static uint32_t obLastRefillMs = 0;
+
+// Persistent session bookkeeping: the broker keeps our subscriptions and the
+// retained states across a reconnect, so only what changed needs resending.
+// QoS 0 publishes sent just before the link died may not have arrived; those
+// within OB_UNSURE_MS of the loss are resent too.
+static const uint32_t OB_UNSURE_MS = 2 * MQTT_KEEPALIVE_S * 1000;
+static uint32_t obSentMs[OB_SLOTS];  // millis() of each slot's last publish
+static bool     obSynced = false;    // broker holds everything we published
+static uint32_t mqttLostMs = 0;
+
+static inline void outboxMark(uint16_t slot) {
+  obDirty[slot >> 5].fetch_or(1u << (slot & 31));
+}
 
-  isToggle = false;
+static uint32_t counterMask = 0;  // inputs in counter mode (fixed at boot)
+
+static bool haSlotActive(uint16_t idx);
+static const char* haRender(uint16_t idx, const char*& data, size_t& len);
+static void haSent(bool ok);
+
+// Per-channel topics and the aggregate are alternatives (mqttCfg.stateFormat);
+// an input in counter mode has a count instead of a state topic
+static inline bool outboxSlotActive(uint16_t slot) {
+  if (slot >= OB_HA0) return haSlotActive(slot - OB_HA0);
+  if (slot == OB_AVAIL || slot == OB_OTA || slot == OB_METRICS) return true;
+  if (slot >= OB_COUNT0 && slot < OB_STATE) return counterMask & (1u << (slot - OB_COUNT0));
+  if (slot >= OB_INPUT0 && slot < OB_COUNT0 && (counterMask & (1u << (slot - OB_INPUT0)))) return false;
+  const bool aggregate = mqttCfg.stateFormat != SF_TOPICS;
+  return (slot == OB_STATE) == aggregate;
+}
 
-  if (v == "TOGGLE") { isToggle = true; return true; }
-  if (v == "ON" || v == "1" || v == "TRUE")  { outOn = true;  return true; }
-  if (v == "OFF"|| v == "0" || v == "FALSE") { outOn = false; return true; }
-  return false;
+static void outboxMarkAll() {
+  for (uint16_t s = 0; s < OB_METRICS; s++) if (outboxSlotActive(s)) outboxMark(s);
 }
 
-// handle <base>/relay/<n>/set
-static bool handleRelaySetTopic(const String& topic, const String& payload) {
-  // Expect: baseTopic + "/relay/" + n + "/set"
-  const String prefix = baseTopic + "/relay/";
-  if (!topic.startsWith(prefix)) return false;
+static inline bool outboxTake(uint16_t slot) {
+  const uint32_t bit = 1u << (slot & 31);
+  return obDirty[slot >> 5].fetch_and(~bit) & bit;
+}
 
-  String rest = topic.substring(prefix.length()); // "<n>/set" maybe
-  int slash = rest.indexOf('/');
-  if (slash < 0) return false;
+// {"1":"ON","2":"OFF",...}: same shape as the <base>/relay/set batch command
+static void renderRelayStateAll(char* buf, size_t cap) {
+  size_t n = snprintf(buf, cap, "{");
+  for (size_t i = 0; i < RELAY_COUNT; i++) {
+    n += snprintf(buf + n, cap - n, "%s\"%u\":\"%s\"", i ? "," : "",
+                  (unsigned)i + 1, relays.get(i) ? "ON" : "OFF");
+  }
+  snprintf(buf + n, cap - n, "}");
+}
 
-  String nStr = rest.substring(0, slash);
-  String tail = rest.substring(slash + 1); // "set" or something
-  if (tail != "set") return false;
+static uint32_t stateSeq = 0;  // bumps with every <base>/state publish; restarts at boot
 
-  int n = nStr.toInt();
-  if (n < 1 || n > 4) return false;
+// SF_JSON:   {"r":10,"i":1,"seq":N}  (bit i = relay/input i+1; input bit = CLOSED)
+// SF_BINARY: seq (u32 LE), relay mask, input mask; each mask ceil(count/8) bytes LE
+static size_t renderStateAggregate(char* buf, size_t cap) {
+  const uint32_t r = relays.mask();
+  const uint32_t in = inputs.closedMask() & ~counterMask;  // counter inputs read 0
+  const uint32_t seq = ++stateSeq;
 
-  bool on = false, isToggle = false;
-  if (!parseOnOffToggle(payload, on, isToggle)) {
-    Serial.printf("[MQTT] invalid payload for relay: %s\n", payload.c_str());
-    return true; // topic matched, but payload invalid
+  if (mqttCfg.stateFormat == SF_JSON) {
+    return snprintf(buf, cap, "{\"r\":%u,\"i\":%u,\"seq\":%u}", (unsigned)r, (unsigned)in, (unsigned)seq);
   }
 
-  if (isToggle) toggleRelay(n - 1);
-  else setRelay(n - 1, on);
-
-  return true;
+  size_t n = 0;
+  for (size_t b = 0; b < 4; b++)                     buf[n++] = (char)(seq >> (8 * b));
+  for (size_t b = 0; b < (RELAY_COUNT + 7) / 8; b++) buf[n++] = (char)(r >> (8 * b));
+  for (size_t b = 0; b < (INPUT_COUNT + 7) / 8; b++) buf[n++] = (char)(in >> (8 * b));
+  return n;
 }
 
-// optional: <base>/relay/set  with JSON {"1":"ON","2":"OFF"...}
-static bool handleRelaySetAllTopic(const String& topic, const String& payload) {
-  if (topic != tRelaySetAll) return false;
-
-  StaticJsonDocument<256> doc;
-  DeserializationError err = deserializeJson(doc, payload);
-  if (err) {
-    Serial.println("[MQTT] relay/set invalid JSON");
-    return true;
+static void counterRead(size_t i, uint64_t& total, float& rate);
+static size_t otaStatusJson(char* buf, size_t cap);
+
+// Topic + payload (+ length, binary-safe) for a slot; everything but metrics is retained
+static const char* outboxRender(uint16_t slot, char* payload, size_t cap, size_t &len, bool &retain) {
+  retain = true;
+  if (slot >= OB_COUNT0 && slot < OB_STATE) {
+    const size_t i = slot - OB_COUNT0;
+    uint64_t total;
+    float rate;
+    counterRead(i, total, rate);
+    len = snprintf(payload, cap, "{\"total\":%llu,\"rate\":%.3f}", (unsigned long long)total, rate);
+    return topics.inputCount[i];
   }
-  for (int i = 1; i <= 4; i++) {
-    char key[2]; sprintf(key, "%d", i);
-    if (!doc.containsKey(key)) continue;
-    String val = doc[key].as<String>();
-    bool on = false, isToggle = false;
-    if (!parseOnOffToggle(val, on, isToggle)) continue;
-    if (isToggle) toggleRelay(i - 1);
-    else setRelay(i - 1, on);
+  if (slot == OB_STATE) {
+    len = renderStateAggregate(payload, cap);
+    return topics.state;
   }
-  return true;
+  if (slot == OB_OTA) {
+    len = otaStatusJson(payload, cap);
+    return topics.otaStatus;
+  }
+  if (slot == OB_METRICS) {
+    retain = false;
+    len = buildMetricsJson(payload, cap);
+    return topics.metrics;
+  }
+  if (slot == OB_AVAIL) {
+    len = snprintf(payload, cap, "online");
+    return topics.avail;
+  }
+  if (slot == OB_RELAY_ALL) {
+    renderRelayStateAll(payload, cap);
+    len = strlen(payload);
+    return topics.relayStateAll;
+  }
+  if (slot < OB_INPUT0) {
+    const int i = slot - OB_RELAY0;
+    len = snprintf(payload, cap, "%s", relays.get(i) ? "ON" : "OFF");
+    return relayStateTopic(i);
+  }
+  // INPUT_PULLUP: LOW = CLOSED, HIGH = OPEN
+  const int i = slot - OB_INPUT0;
+  len = snprintf(payload, cap, "%s", inputs.closed(i) ? "ON" : "OFF");
+  return inputStateTopic(i);
 }
 
-static void mqttCallback(char* topic, byte* payload, unsigned int len) {
-  String msg;
-  msg.reserve(len);
-  for (unsigned int i = 0; i < len; i++) msg += (char)payload[i];
-  msg.trim();
-
-  String t = String(topic);
-  Serial.printf("[MQTT] RX topic=%s payload=%s\n", t.c_str(), msg.c_str());
-
-  // Priority: specific handlers
-  if (handleRelaySetTopic(t, msg)) return;
-  if (handleRelaySetAllTopic(t, msg)) return;
-
-  Serial.println("[MQTT] Unhandled topic");
+static void outboxRefill(uint32_t now) {
+  const uint32_t rate = mqttCfg.rate;
+  const uint32_t burst = 2 * rate * 1000;
+  const uint32_t elapsed = now - obLastRefillMs;
+  obLastRefillMs = now;
+  obTokensMilli = min(burst, obTokensMilli + min(elapsed, (uint32_t)2000) * rate);
 }
 
-static void mqttEnsureConnected() {
-  if (WiFi.status() != WL_CONNECTED) return;
+// New connection: availability first, then every state from the top. With the
+// old session resumed, states changed while offline are still marked, so only
+// the publishes that may have been lost in flight are added.
+static void outboxReset(bool resumed) {
+  obCursor = 0;
+  obTokensMilli = 2 * mqttCfg.rate * 1000;
+  obLastRefillMs = millis();
 
-  if (!mqttCfg.enabled) {
-    if (mqtt.connected()) {
-      Serial.println("[MQTT] Disabled -> disconnect");
-      mqtt.disconnect();
-    }
+  if (!resumed) {
+    outboxMarkAll();
     return;
   }
-
-  if (!mqttReady()) return;
-  if (mqtt.connected()) return;
-
-  mqtt.setServer(mqttCfg.host.c_str(), mqttCfg.port);
-  mqtt.setCallback(mqttCallback);
-
-  const String clientId = mdnsHost + "-" + String((uint32_t)ESP.getEfuseMac(), HEX);
-
-  Serial.printf("[MQTT] Connecting to %s:%u user=%s base=%s\n",
-                mqttCfg.host.c_str(),
-                mqttCfg.port,
-                mqttCfg.user.length() ? mqttCfg.user.c_str() : "(none)",
-                baseTopic.c_str());
-
-  bool ok;
-  if (mqttCfg.user.length())
-    ok = mqtt.connect(clientId.c_str(),
-                      mqttCfg.user.c_str(),
-                      mqttCfg.pass.c_str(),
-                      tAvail.c_str(),  // LWT topic
-                      1,               // qos
-                      true,            // retained
-                      "offline");      // LWT payload
-  else
-    ok = mqtt.connect(clientId.c_str(),
-                      tAvail.c_str(), 1, true, "offline");
-
-  if (ok) {
-    Serial.println("[MQTT] Connected.");
-
-    // Online retained
-    publishAvailability(true);
-
-    // Subscribe to per-relay set topics (wildcard) and optional batch JSON
-    mqtt.subscribe(tRelaySetWild.c_str());
-    mqtt.subscribe(tRelaySetAll.c_str());
-
-    Serial.printf("[MQTT] Subscribed: %s\n", tRelaySetWild.c_str());
-    Serial.printf("[MQTT] Subscribed: %s\n", tRelaySetAll.c_str());
-
-    // Publish current states (retained)
-    publishAllRelayStates();
-    publishAllInputStates();
-  } else {
-    Serial.printf("[MQTT] Connect failed, rc=%d\n", mqtt.state());
+  outboxMark(OB_AVAIL);  // the LWT replaced it with "offline"
+  for (uint16_t s = OB_AVAIL + 1; s < OB_METRICS; s++) {
+    if (outboxSlotActive(s) && mqttLostMs - obSentMs[s] < OB_UNSURE_MS) outboxMark(s);
   }
 }
 
-// -------------------- Web routes (AP mode) --------------------
-static void setupRoutes_AP() {
-  // Captive portal probe endpoints
+// Send dirty slots while the budget lasts (net task only). Dirty bits
+// survive while the link is down and are sent after the reconnect.
+static void outboxDrain(uint32_t now) {
+  if (!mqttLinkUp() || !topics.valid) return;
+
+  const bool limited = mqttCfg.rate > 0;
+  if (limited) outboxRefill(now);
+
+  char payload[OB_PAYLOAD_MAX];
+  for (uint16_t n = 0; n < OB_SLOTS; n++) {
+    if (limited && obTokensMilli < 1000) return;
+
+    const uint16_t slot = obCursor;
+    obCursor = (obCursor + 1) % OB_SLOTS;
+    if (!outboxTake(slot) || !outboxSlotActive(slot)) continue;
+
+    bool retain = true;
+    size_t len;
+    const char* data = payload;
+    const char* topic = slot >= OB_HA0 ? haRender(slot - OB_HA0, data, len)
+                                       : outboxRender(slot, payload, sizeof(payload), len, retain);
+    if (slot == OB_METRICS && !len) {
+      LOGW("[MQTT] Metrics over %u bytes, not published", (unsigned)sizeof(payload));
+      continue;
+    }
+    const bool ok = mqtt.publish(topic, (const uint8_t*)data, len, retain);
+    if (!ok) {
+      if (!mqtt.connected()) {
+        outboxMark(slot);  // resent after the reconnect snapshot
+        return;
+      }
+      LOGW("[MQTT] Publish dropped: %s", topic);
+      obSynced = false;    // broker is stale; next connect does a full snapshot
+    } else {
+      obSentMs[slot] = now;
+    }
+    if (slot >= OB_HA0) haSent(ok);
+    if (limited) obTokensMilli -= 1000;
+  }
+}
+
+static inline void markRelaysChanged(uint32_t mask) {
+  if (mqttCfg.stateFormat != SF_TOPICS) {
+    if (mask) outboxMark(OB_STATE);
+  } else {
+    for (size_t i = 0; i < RELAY_COUNT; i++) {
+      if (mask & (1u << i)) outboxMark(OB_RELAY0 + i);
+    }
+    if (mask) outboxMark(OB_RELAY_ALL);
+  }
+  pendingRelayEvt.fetch_or(mask);
+  if (netTaskHandle) xTaskNotifyGive(netTaskHandle);  // publish now, not next tick
+}
+
+static inline void markRelayChanged(int i) {
+  markRelaysChanged(1u << i);
+}
+
+static inline void markInputChanged(int i) {
+  if (counterMask & (1u << i)) return;  // published as a count instead
+  outboxMark(mqttCfg.stateFormat != SF_TOPICS ? OB_STATE : OB_INPUT0 + i);
+  pendingInputEvt.fetch_or(1u << i);
+  if (netTaskHandle) xTaskNotifyGive(netTaskHandle);
+}
+
+// -------------------- Home Assistant discovery --------------------
+// Every config is rendered once per applyTopics() into one heap block and
+// hashed together with the broker address. They go out (retained, paced by
+// the outbox) only when that hash differs from the one stored after the last
+// complete publish; reconnects never resend them, so a fleet coming back
+// after a broker outage does not flood it with large retained payloads.
+// With discovery off (or the binary state format, which HA cannot template)
+// the configs are empty, which removes entities published earlier.
+static const size_t HA_ENTITIES = RELAY_COUNT + INPUT_COUNT;
+static_assert(HA_ENTITIES * (TOPIC_MAX + HA_PAYLOAD_MAX) <= UINT16_MAX, "HaEntry offsets");
+
+struct HaEntry {
+  uint16_t topicOff;
+  uint16_t payloadOff;
+  uint16_t payloadLen;  // 0 = remove
+};
+
+// Net task only (applyTopics() also runs once from setup, before it starts)
+static std::unique_ptr<char[]> haCache;
+static HaEntry  haEntries[HA_ENTITIES];
+static uint16_t haCount = 0;    // entries in haCache
+static uint16_t haUnsent = 0;   // configs of this cache still to publish
+static uint32_t haHash = 0;
+static bool     haFailed = false;
+static std::atomic<bool> haResend{false};  // /api/mqtt ha_resend=1
+
+static uint32_t fnv1a(uint32_t h, const void* data, size_t len) {
+  const uint8_t* p = (const uint8_t*)data;
+  while (len--) h = (h ^ *p++) * 16777619u;
+  return h;
+}
+
+static void haMarkAll() {
+  for (uint16_t i = 0; i < haCount; i++) outboxMark(OB_HA0 + i);
+  haUnsent = haCount;
+  haFailed = false;
+}
+
+// Renders every config twice: once to size the block, once into it
+static bool haRenderAll(bool on, char* block, size_t& used) {
+  const String url = "http://" + mdnsFqdn + "/";
+  const HaDevice dev = { deviceId.c_str(), mdnsHost.c_str(), url.c_str(), "Switch-4-Node",
+                         esp_ota_get_app_description()->version };
+  const HaState st = mqttCfg.stateFormat == SF_JSON ? HA_STATE_JSON : HA_STATE_TOPICS;
+
+  char topic[TOPIC_MAX];
+  char payload[HA_PAYLOAD_MAX];
+  used = 0;
+  for (size_t e = 0; e < HA_ENTITIES; e++) {
+    const HaKind kind = e < RELAY_COUNT ? HA_RELAY : HA_INPUT;
+    const size_t i = kind == HA_RELAY ? e : e - RELAY_COUNT;
+    const size_t tl = haConfigTopic(dev, kind, i, topic, sizeof(topic));
+    const size_t pl = on ? haConfigPayload(topics, dev, kind, st, i, payload, sizeof(payload)) : 0;
+    if (!tl || (on && !pl)) {
+      LOGE("[HA] %s %u config too large", kind == HA_RELAY ? "Relay" : "Input", (unsigned)i + 1);
+      return false;
+    }
+    if (block) {
+      HaEntry &h = haEntries[e];
+      h.topicOff = used;
+      h.payloadOff = used + tl + 1;
+      h.payloadLen = pl;
+      memcpy(block + h.topicOff, topic, tl + 1);
+      memcpy(block + h.payloadOff, payload, pl);
+    }
+    used += tl + 1 + pl;
+  }
+  return true;
+}
+
+static void haBuild() {
+  for (uint16_t i = 0; i < haCount; i++) outboxTake(OB_HA0 + i);  // drop a half-sent old set
+  haCount = 0;
+  haUnsent = 0;
+  haCache.reset();
+  if (!topics.valid) return;
+
+  const bool on = mqttCfg.haDiscovery && mqttCfg.stateFormat != SF_BINARY;
+  if (mqttCfg.haDiscovery && !on) LOGW("[HA] Discovery needs the topics or json state format");
+
+  size_t size;
+  if (!haRenderAll(on, nullptr, size)) return;
+  haCache.reset(new (std::nothrow) char[size]);
+  if (!haCache) {
+    LOGE("[HA] No memory for %u bytes of discovery configs", (unsigned)size);
+    return;
+  }
+  haRenderAll(on, haCache.get(), size);
+  haCount = HA_ENTITIES;
+
+  uint32_t h = fnv1a(2166136261u, mqttCfg.host.c_str(), mqttCfg.host.length());
+  h = fnv1a(h, &mqttCfg.port, sizeof(mqttCfg.port));
+  haHash = fnv1a(h, haCache.get(), size) | 1;  // 0 = nothing published yet
+
+  Preferences p;  // own handle: net task
+  p.begin("ha", true);
+  const uint32_t stored = p.getUInt("hash", 0);
+  p.end();
+  // Broker already has exactly these, or there is nothing to remove
+  if (haHash == stored || (!on && !stored)) return;
+
+  LOGI("[HA] Discovery changed, %u configs (%u bytes) to publish", (unsigned)haCount, (unsigned)size);
+  haMarkAll();
+}
+
+static bool haSlotActive(uint16_t idx) {
+  return idx < haCount;
+}
+
+static const char* haRender(uint16_t idx, const char*& data, size_t& len) {
+  const HaEntry &e = haEntries[idx];
+  data = haCache.get() + e.payloadOff;
+  len = e.payloadLen;
+  return haCache.get() + e.topicOff;
+}
+
+// Stores the hash once the whole set is out; a dropped config leaves the old
+// hash, so the next boot publishes again
+static void haSent(bool ok) {
+  if (!ok) haFailed = true;
+  if (!haUnsent || --haUnsent) return;
+  if (haFailed) {
+    LOGW("[HA] Discovery incomplete, retrying after the next restart");
+    return;
+  }
+  Preferences p;
+  p.begin("ha", false);
+  p.putUInt("hash", haHash);
+  p.end();
+  LOGI("[HA] Discovery published");
+}
+
+// -------------------- SSE push (STA) --------------------
+// Worst case: every channel as ,"NN":false plus the wrapper keys
+static const size_t STATE_EVENT_MAX = 64 + 12 * (RELAY_COUNT + INPUT_COUNT);
+static const uint32_t ALL_RELAYS = (RELAY_COUNT == 32) ? 0xFFFFFFFFu : ((1u << RELAY_COUNT) - 1);
+static const uint32_t ALL_INPUTS = (INPUT_COUNT == 32) ? 0xFFFFFFFFu : ((1u << INPUT_COUNT) - 1);
+
+static uint32_t eventSeq = 0;
+static int8_t   eventMqttUp = -1;  // last MQTT state pushed, -1 = never
+
+// {"relays":{"1":true},"inputs_closed":{"3":false},"mqtt_connected":true}
+// Only channels in the masks are included, so a delta stays a few bytes.
+static size_t buildStateEvent(char* buf, size_t cap, uint32_t relayMask, uint32_t inputMask) {
+  size_t n = snprintf(buf, cap, "{");
+  const char* sep = "";
+
+  if (relayMask) {
+    n += snprintf(buf + n, cap - n, "\"relays\":{");
+    for (size_t i = 0; i < RELAY_COUNT; i++) {
+      if (!(relayMask & (1u << i))) continue;
+      n += snprintf(buf + n, cap - n, "%s\"%u\":%s", (relayMask & ((1u << i) - 1)) ? "," : "",
+                    (unsigned)i + 1, relays.get(i) ? "true" : "false");
+    }
+    n += snprintf(buf + n, cap - n, "}");
+    sep = ",";
+  }
+  if (inputMask) {
+    n += snprintf(buf + n, cap - n, "%s\"inputs_closed\":{", sep);
+    for (size_t i = 0; i < INPUT_COUNT; i++) {
+      if (!(inputMask & (1u << i))) continue;
+      n += snprintf(buf + n, cap - n, "%s\"%u\":%s", (inputMask & ((1u << i) - 1)) ? "," : "",
+                    (unsigned)i + 1, inputs.closed(i) ? "true" : "false");
+    }
+    n += snprintf(buf + n, cap - n, "}");
+    sep = ",";
+  }
+  n += snprintf(buf + n, cap - n, "%s\"mqtt_connected\":%s}", sep,
+                mqttConn == MQ_CONNECTED ? "true" : "false");
+  return n;
+}
+
+// Push changed channels to dashboards (net task only)
+static void pushPendingEvents() {
+  const uint32_t relayBits = pendingRelayEvt.exchange(0);
+  const uint32_t inputBits = pendingInputEvt.exchange(0);
+  const int8_t mqttUp      = (mqttConn == MQ_CONNECTED) ? 1 : 0;
+
+  if (!relayBits && !inputBits && mqttUp == eventMqttUp) return;
+  eventMqttUp = mqttUp;
+  if (!events.count()) return;
+
+  char buf[STATE_EVENT_MAX];
+  buildStateEvent(buf, sizeof(buf), relayBits, inputBits);
+  events.send(buf, "state", ++eventSeq);
+}
+
+static void rulesOnRelayChange(uint32_t changed);  // rules engine, below
+
+// Momentary mode: PULSE:<ms> switches a relay ON and an esp_timer one-shot
+// switches it OFF again, independent of the net task and MQTT timing
+static esp_timer_handle_t pulseTimer[RELAY_COUNT];
+
+// Any explicit command supersedes a pulse still running on that channel
+static inline void cancelPulse(int relayNum) {
+  if (pulseTimer[relayNum]) esp_timer_stop(pulseTimer[relayNum]);
+}
+
+// Safe to call from any task; the MQTT publish is deferred to the net task
+static void writeRelay(int relayNum, bool on, bool toggle) {
+  if (relayNum < 0 || relayNum >= (int)RELAY_COUNT) return;
+
+  const bool was = relays.get(relayNum);
+  {
+    MetricScope m(MT_RELAY_WRITE);
+    on = relays.write(relayNum, on, toggle);
+  }
+  const int level = relays.level(on) ? HIGH : LOW;
+
+  LOGI("[RELAY %d] %s (GPIO level=%d)", relayNum + 1, on ? "ON" : "OFF", level);
+
+  // Publish per-relay state only
+  markRelayChanged(relayNum);
+  if (on != was) rulesOnRelayChange(1u << relayNum);
+}
+
+static void setRelay(int relayNum, bool on) {
+  if (relayNum < 0 || relayNum >= (int)RELAY_COUNT) return;
+  cancelPulse(relayNum);
+  writeRelay(relayNum, on, false);
+}
+
+// Batch path: all channels switch together in one output write, then the
+// state goes out once per changed topic
+static void applyRelayMasks(uint32_t setMask, uint32_t clrMask, uint32_t tglMask) {
+  for (size_t i = 0; i < RELAY_COUNT; i++) {
+    if ((setMask | clrMask | tglMask) & (1u << i)) cancelPulse(i);
+  }
+
+  uint32_t changed;
+  {
+    MetricScope m(MT_RELAY_WRITE);
+    changed = relays.apply(setMask, clrMask, tglMask);
+  }
+
+  LOGI("[RELAY] batch set=0x%X clr=0x%X tgl=0x%X -> state=0x%X",
+       (unsigned)setMask, (unsigned)clrMask, (unsigned)tglMask, (unsigned)relays.mask());
+
+  if (changed) {
+    markRelaysChanged(changed);
+    rulesOnRelayChange(changed);
+  }
+}
+
+static void toggleRelay(int relayNum) {
+  if (relayNum < 0 || relayNum >= (int)RELAY_COUNT) return;
+  cancelPulse(relayNum);
+  writeRelay(relayNum, false, true);
+}
+
+// esp_timer task: end of pulse
+static void onPulseEnd(void* arg) {
+  writeRelay((int)(uintptr_t)arg, false, false);
+}
+
+// The timer is armed right after the output write, before any logging, so
+// the width is set by esp_timer (tens of us), not by Serial or the network.
+// Pulsing a channel that is already pulsing restarts its width.
+static void pulseRelay(int relayNum, uint32_t ms) {
+  if (relayNum < 0 || relayNum >= (int)RELAY_COUNT || !ms || ms > PULSE_MAX_MS) return;
+
+  cancelPulse(relayNum);
+  const bool was = relays.get(relayNum);
+  {
+    MetricScope m(MT_RELAY_WRITE);
+    relays.write(relayNum, true, false);
+  }
+  esp_timer_start_once(pulseTimer[relayNum], (uint64_t)ms * 1000);
+
+  LOGI("[RELAY %d] PULSE %u ms", relayNum + 1, (unsigned)ms);
+  markRelayChanged(relayNum);
+  if (!was) rulesOnRelayChange(1u << relayNum);
+}
+
+static void startPulseTimers() {
+  for (size_t i = 0; i < RELAY_COUNT; i++) {
+    esp_timer_create_args_t args = {};
+    args.callback = onPulseEnd;
+    args.arg = (void*)(uintptr_t)i;
+    args.dispatch_method = ESP_TIMER_TASK;
+    args.name = "pulse";
+    esp_timer_create(&args, &pulseTimer[i]);
+  }
+}
+
+// -------------------- Rules engine --------------------
+// Local automations, e.g.
+//   {"rules":[{"when":"input1:close","do":"relay1:toggle"},
+//             {"when":"relay3:on","do":"relay3:off","after":900000}]}
+// when: input<N>:close|open|change  or  relay<N>:on|off
+// do:   relay<N>:on|off|toggle       after: delay in ms (optional, <= 24 h)
+//       group<G>:on|off|toggle       ESP-NOW to other nodes; "mask" picks
+//                                    their relays (default: all members)
+//
+// /rules.json is compiled at load into a flat table: every trigger event has
+// a contiguous run of rule ids (CSR), so dispatch is one index lookup.
+// Undelayed input reactions run inline in the control task; everything else
+// goes through a min-heap of deadlines served by the same task.
+// Each rule has at most one pending deadline: re-triggering re-arms it, and a
+// relay leaving the triggering state cancels it ("off 15 min after on").
+static const char*    RULES_PATH       = "/rules.json";
+static const size_t   RULES_MAX        = 32;
+static const size_t   RULES_JSON_MAX   = 4096;
+static const char*    RULES_TMP_PATH   = "/rules.json.tmp";
+// Deadlines compare as signed 32-bit ms differences, so they must stay far below 2^31
+static const uint32_t RULES_AFTER_MAX_MS = 24UL * 60 * 60 * 1000;
+
+// Event ids: input i close/open = 2i/2i+1, relay i on/off = EV_RELAY0 + 2i/2i+1
+static const uint16_t EV_RELAY0 = 2 * INPUT_COUNT;
+static const uint16_t EV_COUNT  = EV_RELAY0 + 2 * RELAY_COUNT;
+
+enum RuleOp : uint8_t { RA_ON, RA_OFF, RA_TOGGLE };
+
+struct Rule {
+  uint8_t  op;
+  uint8_t  relay;     // 0-based target
+  uint8_t  group;     // ESP-NOW group, 0 = local relay
+  uint32_t mask;      // group only: remote relays to act on
+  uint32_t afterMs;
+};
+
+struct RuleTable {
+  uint8_t count;
+  Rule    rule[RULES_MAX];
+  uint8_t evStart[EV_COUNT + 1];   // rules for event e: evRule[evStart[e] .. evStart[e+1])
+  uint8_t evRule[2 * RULES_MAX];   // "change" lists a rule under both edges
+};
+
+static RuleTable ruleTable;        // live table, guarded by rulesMux
+static portMUX_TYPE rulesMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Pending deadlines: binary min-heap of rule ids ordered by due time
+static uint8_t  timerHeap[RULES_MAX];
+static uint8_t  timerCount = 0;
+static int8_t   timerPos[RULES_MAX];   // heap index per rule, -1 = idle
+static uint32_t timerDue[RULES_MAX];
+
+static inline bool dueBefore(uint8_t a, uint8_t b) {
+  return (int32_t)(timerDue[a] - timerDue[b]) < 0;
+}
+
+static void heapSwap(uint8_t i, uint8_t j) {
+  const uint8_t t = timerHeap[i];
+  timerHeap[i] = timerHeap[j];
+  timerHeap[j] = t;
+  timerPos[timerHeap[i]] = i;
+  timerPos[timerHeap[j]] = j;
+}
+
+static void heapFix(uint8_t i) {
+  while (i > 0 && dueBefore(timerHeap[i], timerHeap[(i - 1) / 2])) {
+    heapSwap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+  for (;;) {
+    const uint8_t l = 2 * i + 1, r = l + 1;
+    uint8_t m = i;
+    if (l < timerCount && dueBefore(timerHeap[l], timerHeap[m])) m = l;
+    if (r < timerCount && dueBefore(timerHeap[r], timerHeap[m])) m = r;
+    if (m == i) return;
+    heapSwap(i, m);
+    i = m;
+  }
+}
+
+// Callers hold rulesMux
+static void timerArm(uint8_t rule, uint32_t due) {
+  timerDue[rule] = due;
+  if (timerPos[rule] < 0) {
+    timerHeap[timerCount] = rule;
+    timerPos[rule] = timerCount++;
+  }
+  heapFix(timerPos[rule]);
+}
+
+static void timerCancel(uint8_t rule) {
+  const int8_t i = timerPos[rule];
+  if (i < 0) return;
+  timerPos[rule] = -1;
+  if (i != --timerCount) {
+    timerHeap[i] = timerHeap[timerCount];
+    timerPos[timerHeap[i]] = i;
+    heapFix(i);
+  }
+}
+
+static void espnowSendGroup(uint8_t group, uint8_t op, uint32_t mask);
+
+static void runRule(const Rule& r) {
+  if (r.group) espnowSendGroup(r.group, r.op, r.mask);
+  else if (r.op == RA_TOGGLE) toggleRelay(r.relay);
+  else setRelay(r.relay, r.op == RA_ON);
+}
+
+// inline: caller may execute undelayed rules itself (control task, input
+// events only, so a relay rule can never recurse through writeRelay())
+static void rulesFire(uint16_t ev, bool inlineOk) {
+  Rule now[RULES_MAX];
+  uint8_t nNow = 0;
+  bool armed = false;
+  const uint32_t t = millis();
+
+  portENTER_CRITICAL(&rulesMux);
+  if (ev >= EV_RELAY0) {
+    const uint16_t other = ev ^ 1;
+    for (uint8_t k = ruleTable.evStart[other]; k < ruleTable.evStart[other + 1]; k++) {
+      timerCancel(ruleTable.evRule[k]);
+    }
+  }
+  for (uint8_t k = ruleTable.evStart[ev]; k < ruleTable.evStart[ev + 1]; k++) {
+    const uint8_t id = ruleTable.evRule[k];
+    const Rule& r = ruleTable.rule[id];
+    if (!r.afterMs && inlineOk) {
+      now[nNow++] = r;
+    } else {
+      timerArm(id, t + r.afterMs);
+      armed = true;
+    }
+  }
+  portEXIT_CRITICAL(&rulesMux);
+
+  for (uint8_t k = 0; k < nNow; k++) runRule(now[k]);
+  if (armed && controlTaskHandle) xTaskNotifyGive(controlTaskHandle);
+}
+
+static void rulesOnInput(int i, bool closed) {
+  if (counterMask & (1u << i)) return;  // pulses, not switch events
+  rulesFire(2 * i + (closed ? 0 : 1), true);
+}
+
+static void rulesOnRelayChange(uint32_t changed) {
+  for (size_t i = 0; i < RELAY_COUNT; i++) {
+    if (changed & (1u << i)) rulesFire(EV_RELAY0 + 2 * i + (relays.get(i) ? 0 : 1), false);
+  }
+}
+
+// Runs every deadline that has passed; returns ms until the next one
+static uint32_t rulesRunDue(uint32_t now) {
+  for (;;) {
+    portENTER_CRITICAL(&rulesMux);
+    if (!timerCount) {
+      portEXIT_CRITICAL(&rulesMux);
+      return UINT32_MAX;
+    }
+    const uint8_t id = timerHeap[0];
+    const int32_t wait = (int32_t)(timerDue[id] - now);
+    if (wait > 0) {
+      portEXIT_CRITICAL(&rulesMux);
+      return (uint32_t)wait;
+    }
+    timerCancel(id);
+    const Rule r = ruleTable.rule[id];
+    portEXIT_CRITICAL(&rulesMux);
+
+    runRule(r);
+  }
+}
+
+// "input3" / "relay12" -> 0-based index, or -1
+static int parseChannel(const char*& p, const char* prefix, size_t count) {
+  const size_t n = strlen(prefix);
+  if (strncmp(p, prefix, n)) return -1;
+  char* end;
+  const unsigned long v = strtoul(p + n, &end, 10);
+  if (end == p + n || *end != ':' || v < 1 || v > count) return -1;
+  p = end + 1;
+  return (int)v - 1;
+}
+
+// Builds the table into out; on error returns false with err set
+static bool compileRules(JsonArrayConst arr, RuleTable& out, const char*& err) {
+  struct { uint16_t ev[2]; uint8_t nev; } trig[RULES_MAX];
+
+  memset(&out, 0, sizeof(out));
+  if (arr.size() > RULES_MAX) { err = "too_many_rules"; return false; }
+
+  for (JsonObjectConst o : arr) {
+    const char* when = o["when"] | "";
+    const char* act  = o["do"] | "";
+    JsonVariantConst afterVal = o["after"];
+    if (!afterVal.isNull() && (!afterVal.is<uint32_t>() || afterVal.as<uint32_t>() > RULES_AFTER_MAX_MS)) {
+      err = "invalid_after";
+      return false;
+    }
+    const uint32_t after = afterVal | 0u;
+    auto &t = trig[out.count];
+    Rule &r = out.rule[out.count];
+
+    int ch;
+    if ((ch = parseChannel(when, "input", INPUT_COUNT)) >= 0) {
+      if (!strcmp(when, "close"))       { t.ev[0] = 2 * ch;     t.nev = 1; }
+      else if (!strcmp(when, "open"))   { t.ev[0] = 2 * ch + 1; t.nev = 1; }
+      else if (!strcmp(when, "change")) { t.ev[0] = 2 * ch; t.ev[1] = 2 * ch + 1; t.nev = 2; }
+      else { err = "invalid_when"; return false; }
+    } else if ((ch = parseChannel(when, "relay", RELAY_COUNT)) >= 0) {
+      if (!strcmp(when, "on"))          { t.ev[0] = EV_RELAY0 + 2 * ch;     t.nev = 1; }
+      else if (!strcmp(when, "off"))    { t.ev[0] = EV_RELAY0 + 2 * ch + 1; t.nev = 1; }
+      else { err = "invalid_when"; return false; }
+    } else {
+      err = "invalid_when";
+      return false;
+    }
+
+    if ((ch = parseChannel(act, "relay", RELAY_COUNT)) >= 0) {
+      r.relay = ch;
+    } else if ((ch = parseChannel(act, "group", 255)) >= 0) {
+      r.group = ch + 1;
+      r.mask = o["mask"] | 0xFFFFFFFFu;
+    } else {
+      err = "invalid_do";
+      return false;
+    }
+    if (!strcmp(act, "on"))          r.op = RA_ON;
+    else if (!strcmp(act, "off"))    r.op = RA_OFF;
+    else if (!strcmp(act, "toggle")) r.op = RA_TOGGLE;
+    else { err = "invalid_do"; return false; }
+    r.afterMs = after;
+    out.count++;
+  }
+
+  // Counting sort of (event, rule) pairs into the CSR arrays
+  uint8_t fill[EV_COUNT + 1] = {0};
+  for (uint8_t i = 0; i < out.count; i++) {
+    for (uint8_t k = 0; k < trig[i].nev; k++) out.evStart[trig[i].ev[k] + 1]++;
+  }
+  for (uint16_t e = 0; e < EV_COUNT; e++) out.evStart[e + 1] += out.evStart[e];
+  memcpy(fill, out.evStart, sizeof(fill));
+  for (uint8_t i = 0; i < out.count; i++) {
+    for (uint8_t k = 0; k < trig[i].nev; k++) out.evRule[fill[trig[i].ev[k]]++] = i;
+  }
+  return true;
+}
+
+// Without /rules.json: closing input N toggles relay N (the original mapping)
+static void defaultRulesJson(String& out) {
+  out = "{\"rules\":[";
+  for (size_t i = 0; i < min(INPUT_COUNT, RELAY_COUNT); i++) {
+    if (i) out += ",";
+    out += "{\"when\":\"input" + String(i + 1) + ":close\",\"do\":\"relay" + String(i + 1) + ":toggle\"}";
+  }
+  out += "]}";
+}
+
+// Parses + compiles into out; the live table is untouched
+static bool parseRules(const char* json, size_t len, RuleTable& out, const char*& err) {
+  DynamicJsonDocument doc(RULES_JSON_MAX);
+  if (deserializeJson(doc, json, len)) { err = "invalid_json"; return false; }
+  return compileRules(doc["rules"].as<JsonArrayConst>(), out, err);
+}
+
+// Swaps a compiled table in, dropping pending deadlines
+static void installRules(const RuleTable& next) {
+  portENTER_CRITICAL(&rulesMux);
+  ruleTable = next;
+  timerCount = 0;
+  memset(timerPos, -1, sizeof(timerPos));
+  portEXIT_CRITICAL(&rulesMux);
+
+  LOGI("[RULES] %u rule(s) loaded", (unsigned)next.count);
+}
+
+static bool loadRules(const char* json, size_t len, const char*& err) {
+  static RuleTable next;  // callers: setup() and async_tcp, never concurrently
+  if (!parseRules(json, len, next, err)) return false;
+  installRules(next);
+  return true;
+}
+
+static void startRules() {
+  memset(timerPos, -1, sizeof(timerPos));
+
+  String json;
+  File f = LittleFS.open(RULES_PATH, "r");
+  if (f) {
+    json = f.readString();
+    f.close();
+  } else {
+    defaultRulesJson(json);
+  }
+
+  const char* err = nullptr;
+  if (!loadRules(json.c_str(), json.length(), err)) {
+    LOGW("[RULES] %s: %s, using defaults", RULES_PATH, err);
+    defaultRulesJson(json);
+    loadRules(json.c_str(), json.length(), err);
+  }
+
+  // Relays restored at power-on count as switched on now (arms auto-off rules)
+  rulesOnRelayChange(relays.mask());
+}
+
+// -------------------- Input capture --------------------
+// Light sleep only wakes on level interrupts. While the low power profile has
+// input wake armed (powerArmInputWake), each pin waits for the level opposite
+// to its current one and the ISR flips it on every edge, which behaves like
+// CHANGE and also wakes the chip.
+static portMUX_TYPE  inputIrqMux = portMUX_INITIALIZER_UNLOCKED;
+static volatile bool inputLevelIrq = false;
+
+static inline uint32_t IRAM_ATTR pinLevel(uint32_t pin) {
+  return (pin < 32) ? ((GPIO.in >> pin) & 1) : ((GPIO.in1.data >> (pin - 32)) & 1);
+}
+
+// ISR arg packs (idx << 8) | pin so the handler never touches flash-resident tables
+static void IRAM_ATTR onInputEdge(void* arg) {
+  const uint32_t packed = (uint32_t)(uintptr_t)arg;
+  const uint32_t pin = packed & 0xFF;
+
+  InputEdge ev;
+  ev.idx   = (uint8_t)(packed >> 8);
+  ev.level = pinLevel(pin);
+  ev.t_ms  = millis();
+
+  portENTER_CRITICAL_ISR(&inputIrqMux);
+  if (inputLevelIrq) GPIO.pin[pin].int_type = ev.level ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL;
+  portEXIT_CRITICAL_ISR(&inputIrqMux);
+
+  BaseType_t woken = pdFALSE;
+  xQueueSendFromISR(inputEdgeQueue, &ev, &woken); // queue full: settle re-read catches up
+  vTaskNotifyGiveFromISR(controlTaskHandle, &woken);
+  if (woken) portYIELD_FROM_ISR();
+}
+
+// Debounced input became stable at a new level
+static void onInputStable(int i) {
+  MetricScope m(MT_INPUT);
+  const bool closed = inputs.closed(i); // LOW = contact closed
+  LOGI("[DIN %d] stable -> %s", i + 1, closed ? "CLOSED(LOW)" : "OPEN(HIGH)");
+
+  // Publish input state (per-input topic, retained)
+  markInputChanged(i);
+
+  // Input -> relay reactions come from the rule table (default: close toggles relay i)
+  rulesOnInput(i, closed);
+}
+
+// Commit settled inputs; returns how long the task may block before the next check
+static TickType_t inputDebounceStep(uint32_t now) {
+  uint32_t waitMs = UINT32_MAX;
+
+  for (size_t i = 0; i < INPUT_COUNT; i++) {
+    if (counterMask & (1u << i)) continue;  // PCNT owns the pin
+    if (debounceStep(inputs[i], now, INPUT_DEBOUNCE_MS,
+                     [i] { return digitalRead(inputs.pin(i)); }, waitMs)) {
+      onInputStable(i);
+    }
+  }
+
+  return (waitMs == UINT32_MAX) ? portMAX_DELAY : pdMS_TO_TICKS(waitMs) + 1;
+}
+
+static void runRelayCmd(const RelayCmd& c) {
+  switch (c.op) {
+    case CMD_SET:       setRelay(c.relay, c.on); break;
+    case CMD_TOGGLE:    toggleRelay(c.relay); break;
+    case CMD_PULSE:     pulseRelay(c.relay, c.ms); break;
+    case CMD_BATCH:     applyRelayMasks(c.set, c.clr, c.tgl); break;
+    case CMD_PULSE_ARM: esp_timer_start_once(pulseTimer[c.relay], (uint64_t)c.ms * 1000); break;
+  }
+}
+
+// -------------------- Control task --------------------
+// Sleeps until an input edge, a queued command or the next debounce/rule
+// deadline; every wake-up is a task notification.
+static void controlTask(void*) {
+  InputEdge ev;
+  RelayCmd cmd;
+
+  for (;;) {
+    while (xQueueReceive(inputEdgeQueue, &ev, 0) == pdTRUE) {
+      debounceEdge(inputs[ev.idx], ev.level, ev.t_ms);
+    }
+    while (mqttCmdRing.pop(cmd)) runRelayCmd(cmd);
+    while (httpCmdRing.pop(cmd)) runRelayCmd(cmd);
+    while (espnowCmdRing.pop(cmd)) runRelayCmd(cmd);
+    bool udpDone = false;
+    while (udpCmdRing.pop(cmd)) { runRelayCmd(cmd); udpDone = true; }
+    if (udpDone) xTaskNotifyGive(udpTaskHandle);  // reply carries the applied state
+
+    const uint32_t now = millis();
+    TickType_t wait = inputDebounceStep(now);
+    const uint32_t ruleMs = rulesRunDue(now);
+    if (ruleMs != UINT32_MAX) wait = min(wait, pdMS_TO_TICKS(ruleMs) + 1);
+
+    ulTaskNotifyTake(pdTRUE, wait);
+  }
+}
+
+// Queue a command for the control task; false when the ring is full
+static bool postRelayCmd(SpscRing<RelayCmd, CMD_RING_LEN>& ring, const RelayCmd& c) {
+  if (!ring.push(c)) return false;
+  xTaskNotifyGive(controlTaskHandle);
+  return true;
+}
+
+static bool postRelaySet(SpscRing<RelayCmd, CMD_RING_LEN>& ring, int relayNum,
+                         bool on, bool toggle, uint32_t pulseMs) {
+  RelayCmd c = {};
+  c.op = pulseMs ? CMD_PULSE : (toggle ? CMD_TOGGLE : CMD_SET);
+  c.relay = relayNum;
+  c.on = on;
+  c.ms = pulseMs;
+  return postRelayCmd(ring, c);
+}
+
+// The edge queue is the task's inbox, so it exists before either side runs
+static void startControlTask() {
+  inputEdgeQueue = xQueueCreate(INPUT_QUEUE_LEN, sizeof(InputEdge));
+  xTaskCreatePinnedToCore(controlTask, "control", CONTROL_TASK_STACK, nullptr,
+                          CONTROL_TASK_PRIO, &controlTaskHandle, CONTROL_TASK_CORE);
+}
+
+// -------------------- ESP-NOW groups (STA) --------------------
+// Node-to-node switching without the broker or the AP's forwarding: a rule
+// action "group<G>:toggle" broadcasts one frame, and every node listening to
+// group G applies it to its member relays. Frames ride the STA home channel,
+// so all nodes must sit on the same AP channel. Authenticated with a
+// truncated HMAC-SHA256 over a shared key. Replays: the frame carries the
+// sender's STA MAC inside the tag (the radio source address is not trusted)
+// and seq = boot epoch (NVS) << 16 | counter; receivers keep the last seq
+// per sender. NVS holds a high-water mark ESPNOW_SEEN_AHEAD past it, written
+// only when a sender passes the stored one, and a reboot resumes from that
+// mark, so a recorded frame stays stale without a write per frame. After a
+// crash up to that many frames per sender are rejected (fewer once it boots
+// into a new epoch); a planned restart stores the exact seqs instead. The table
+// never evicts: senders past ESPNOW_SENDERS_MAX are rejected until the key
+// changes, which clears it.
+static const size_t   ESPNOW_GROUPS_MAX  = 8;
+static const size_t   ESPNOW_SENDERS_MAX = 16;
+static const size_t   ESPNOW_KEY_MIN     = 8;
+static const size_t   ESPNOW_KEY_MAX     = 64;
+static const size_t   ESPNOW_TAG_LEN     = 8;
+static const uint8_t  ESPNOW_MAGIC       = 0x53;  // 'S'
+static const uint8_t  ESPNOW_VERSION     = 2;     // 2: + src
+static const uint32_t ESPNOW_EPOCH_RESERVE = 0x8000;  // counter value that reserves the next epoch
+static const uint32_t ESPNOW_SEEN_AHEAD    = 256;     // frames per sender between table writes
+static const uint8_t  ESPNOW_BROADCAST[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+struct __attribute__((packed)) EspNowFrame {
+  uint8_t  magic;
+  uint8_t  version;
+  uint8_t  group;
+  uint8_t  op;      // RuleOp
+  uint8_t  src[6];  // sender STA MAC (replay window key)
+  uint32_t mask;    // relays on the receiving side (ANDed with membership)
+  uint32_t seq;
+  uint8_t  tag[ESPNOW_TAG_LEN];
+};
+static_assert(sizeof(EspNowFrame) == 26, "EspNowFrame layout");
+
+struct __attribute__((packed)) EspNowGroup {
+  uint8_t  group;   // 1..255
+  uint32_t relays;  // local members
+};
+
+struct EspNowCfg {
+  bool enabled = false;
+  String key;
+  uint8_t nGroups = 0;
+  EspNowGroup groups[ESPNOW_GROUPS_MAX];
+} espnowCfg;
+
+struct __attribute__((packed)) EspNowSender {
+  uint8_t  mac[6];
+  uint32_t lastSeq;
+  uint8_t  used;
+};
+
+// espnowLock guards espnowCfg and the sender table: the receive callback
+// (WiFi task), rule sends (control task), the net task reloading them and
+// the HTTP handlers all touch them.
+static MutexLock    espnowLock;
+static EspNowSender espnowSenders[ESPNOW_SENDERS_MAX];
+static uint32_t     espnowSeenMark[ESPNOW_SENDERS_MAX];  // per slot: the seq floor NVS holds
+static uint8_t      espnowSelf[6];
+static std::atomic<bool> espnowActive{false};
+static std::atomic<bool> espnowReconfigure{false};
+static std::atomic<bool> espnowSeenDirty{false};     // a sender passed its mark, net task persists
+static std::atomic<bool> espnowReserveDue{false};    // control task asks the net task for an epoch
+// Control task advances espnowSeq; the net task sets it (while inactive) and
+// owns every NVS write, reserving the next epoch before the counter runs out
+static std::atomic<uint32_t> espnowSeq{0};
+static std::atomic<uint32_t> espnowEpochReserved{0};
+static std::atomic<uint32_t> espnowRx{0}, espnowTx{0}, espnowRejected{0};
+
+// Net task; the sender table only resets when the key changes
+static void loadEspNowCfg() {
+  EspNowCfg c;
+  Preferences p;
+  p.begin("espnow", true);
+  c.enabled = p.getBool("en", false);
+  c.key     = p.getString("key", "");
+  const size_t n = p.getBytes("grp", c.groups, sizeof(c.groups));
+  c.nGroups = n / sizeof(EspNowGroup);
+  p.end();
+
+  espnowLock.lock();
+  if (c.key != espnowCfg.key) {
+    memset(espnowSenders, 0, sizeof(espnowSenders));
+    memset(espnowSeenMark, 0, sizeof(espnowSeenMark));
+    espnowSeenDirty = true;
+  }
+  espnowCfg = c;
+  espnowLock.unlock();
+}
+
+static void saveEspNowCfg(const EspNowCfg& c) {
+  Preferences p;  // own handle: async_tcp
+  p.begin("espnow", false);
+  p.putBool("en", c.enabled);
+  p.putString("key", c.key);
+  p.putBytes("grp", c.groups, c.nGroups * sizeof(EspNowGroup));
+  p.end();
+}
+
+static EspNowCfg espnowCfgSnapshot() {
+  espnowLock.lock();
+  EspNowCfg c = espnowCfg;
+  espnowLock.unlock();
+  return c;
+}
+
+// Net task: persist epoch e before any frame uses it
+static bool espnowReserveEpoch(uint32_t e) {
+  Preferences p;
+  p.begin("espnow", false);
+  const bool ok = p.putUInt("epoch", e) == sizeof(uint32_t);
+  p.end();
+  if (ok) espnowEpochReserved = e;
+  else LOGE("[ESPNOW] epoch write failed");
+  return ok;
+}
+
+// Net task: the marks (exact = the last seqs, before a planned restart)
+static void espnowSaveSeen(bool exact) {
+  EspNowSender copy[ESPNOW_SENDERS_MAX];
+  espnowLock.lock();
+  memcpy(copy, espnowSenders, sizeof(copy));
+  if (!exact) for (size_t k = 0; k < ESPNOW_SENDERS_MAX; k++) copy[k].lastSeq = espnowSeenMark[k];
+  espnowLock.unlock();
+  Preferences p;
+  p.begin("espnow", false);
+  p.putBytes("seen", copy, sizeof(copy));
+  p.end();
+}
+
+static void espnowTag(const EspNowFrame& f, const String& key, uint8_t out[ESPNOW_TAG_LEN]) {
+  uint8_t mac[AUTH_HASH_LEN];
+  mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                  (const uint8_t*)key.c_str(), key.length(),
+                  (const uint8_t*)&f, offsetof(EspNowFrame, tag), mac);
+  memcpy(out, mac, ESPNOW_TAG_LEN);
+}
+
+// Accepted seq reached the stored mark: move it ahead; caller holds espnowLock
+static void espnowSeen(size_t k, uint32_t seq) {
+  espnowSenders[k].lastSeq = seq;
+  if ((int32_t)(seq - espnowSeenMark[k]) < 0) return;
+  espnowSeenMark[k] = seq + ESPNOW_SEEN_AHEAD;
+  espnowSeenDirty = true;
+}
+
+// Strictly increasing seq per authenticated sender; caller holds espnowLock
+static bool espnowFresh(const uint8_t* src, uint32_t seq) {
+  int freeSlot = -1;
+  for (size_t k = 0; k < ESPNOW_SENDERS_MAX; k++) {
+    EspNowSender &s = espnowSenders[k];
+    if (!s.used) {
+      if (freeSlot < 0) freeSlot = (int)k;
+      continue;
+    }
+    if (memcmp(s.mac, src, 6)) continue;
+    if ((int32_t)(seq - s.lastSeq) <= 0) return false;
+    espnowSeen(k, seq);
+    return true;
+  }
+  if (freeSlot < 0) return false;  // table full: evicting would reopen that sender's replays
+  EspNowSender &s = espnowSenders[freeSlot];
+  memcpy(s.mac, src, 6);
+  s.used = 1;
+  espnowSeenMark[freeSlot] = seq;  // a new sender always writes
+  espnowSeen(freeSlot, seq);
+  return true;
+}
+
+// WiFi task context: validate, then hand a batch to the control task
+static void onEspNowRecv(const uint8_t* mac, const uint8_t* data, int len) {
+  if (len != (int)sizeof(EspNowFrame)) return;
+  EspNowFrame f;
+  memcpy(&f, data, sizeof(f));
+  if (f.magic != ESPNOW_MAGIC || f.version != ESPNOW_VERSION) return;
+
+  espnowLock.lock();
+  uint32_t members = 0;
+  for (uint8_t i = 0; i < espnowCfg.nGroups; i++) {
+    if (espnowCfg.groups[i].group == f.group) members |= espnowCfg.groups[i].relays;
+  }
+  const uint32_t mask = f.mask & members & ALL_RELAYS;
+  bool ok = false;
+  if (mask) {  // else not for us
+    uint8_t tag[ESPNOW_TAG_LEN];
+    espnowTag(f, espnowCfg.key, tag);
+    ok = ctEqual(tag, f.tag, ESPNOW_TAG_LEN) && espnowFresh(f.src, f.seq);
+    if (!ok) espnowRejected++;
+  }
+  espnowLock.unlock();
+  if (!ok) return;
+
+  RelayCmd c = {};
+  c.op = CMD_BATCH;
+  if (f.op == RA_ON)          c.set = mask;
+  else if (f.op == RA_OFF)    c.clr = mask;
+  else if (f.op == RA_TOGGLE) c.tgl = mask;
+  else return;
+  espnowRx++;
+  postRelayCmd(espnowCmdRing, c);
+}
+
+// Control task (rules)
+static void espnowSendGroup(uint8_t group, uint8_t op, uint32_t mask) {
+  if (!espnowActive) return;
+  uint32_t seq = espnowSeq.load() + 1;
+  if ((seq & 0xFFFF) == 0) {
+    // Counter exhausted: move to the epoch the net task reserved
+    const uint32_t e = seq >> 16;
+    if (espnowEpochReserved.load() < e) {
+      LOGW("[ESPNOW] next epoch not stored yet, group %u dropped", (unsigned)group);
+      return;
+    }
+    seq = (e << 16) | 1;
+  }
+  espnowSeq = seq;
+  if ((seq & 0xFFFF) == ESPNOW_EPOCH_RESERVE) {
+    espnowReserveDue = true;
+    xTaskNotifyGive(netTaskHandle);
+  }
+
+  EspNowFrame f = {};
+  f.magic = ESPNOW_MAGIC;
+  f.version = ESPNOW_VERSION;
+  f.group = group;
+  f.op = op;
+  memcpy(f.src, espnowSelf, sizeof(f.src));
+  f.mask = mask;
+  f.seq = seq;
+  espnowLock.lock();
+  espnowTag(f, espnowCfg.key, f.tag);
+  espnowLock.unlock();
+
+  if (esp_now_send(ESPNOW_BROADCAST, (const uint8_t*)&f, sizeof(f)) == ESP_OK) espnowTx++;
+  else LOGW("[ESPNOW] send failed, group %u", (unsigned)group);
+}
+
+static void powerWifiSleep();
+
+static void espnowStop() {
+  if (!espnowActive) return;
+  espnowActive = false;
+  esp_now_unregister_recv_cb();
+  esp_now_deinit();
+  powerWifiSleep();  // back to the profile's modem sleep
+}
+
+static void espnowStart() {
+  if (esp_now_init() != ESP_OK) {
+    LOGE("[ESPNOW] init failed");
+    return;
+  }
+  esp_now_peer_info_t peer = {};
+  memcpy(peer.peer_addr, ESPNOW_BROADCAST, 6);
+  peer.channel = 0;  // follow the STA home channel
+  peer.ifidx = WIFI_IF_STA;
+  esp_now_add_peer(&peer);
+
+  // A fresh epoch per start: counters reset, seq still grows across reboots
+  Preferences p;
+  p.begin("espnow", true);
+  const uint32_t epoch = p.getUInt("epoch", 0) + 1;
+  p.end();
+  if (!espnowReserveEpoch(epoch)) {
+    esp_now_deinit();
+    return;
+  }
+  espnowSeq = epoch << 16;
+  WiFi.macAddress(espnowSelf);
+  esp_now_register_recv_cb(onEspNowRecv);
+  // Modem sleep would miss broadcasts between DTIM beacons
+  esp_wifi_set_ps(WIFI_PS_NONE);
+  espnowActive = true;
+  LOGI("[ESPNOW] Listening on ch %d, %u group(s)", (int)WiFi.channel(), (unsigned)espnowCfg.nGroups);
+}
+
+// Net task: (re)start once STA is up, apply /api/espnow changes, own the NVS writes
+static void espnowService() {
+  if (espnowReconfigure.exchange(false)) {
+    espnowStop();
+    loadEspNowCfg();
+  }
+  if (!espnowActive && espnowCfg.enabled && espnowCfg.key.length() >= ESPNOW_KEY_MIN &&
+      WiFi.status() == WL_CONNECTED) {
+    espnowStart();
+  }
+  if (espnowReserveDue.exchange(false)) espnowReserveEpoch((espnowSeq.load() >> 16) + 1);
+  if (espnowSeenDirty.exchange(false)) espnowSaveSeen(false);
+}
+
+// Net task, before a planned restart: stop receiving, then store the exact
+// seqs so no sender loses frames to the mark
+static void espnowFlushSeen() {
+  espnowStop();
+  espnowSaveSeen(true);
+}
+
+// Setup: config plus the sender table, so replays stay stale across reboots
+static void startEspNow() {
+  espnowLock.begin();
+  loadEspNowCfg();
+  Preferences p;
+  p.begin("espnow", true);
+  if (p.getBytes("seen", espnowSenders, sizeof(espnowSenders)) != sizeof(espnowSenders)) {
+    memset(espnowSenders, 0, sizeof(espnowSenders));
+  }
+  p.end();
+  // Resume from the stored floor: anything at or below it may have been seen
+  for (size_t k = 0; k < ESPNOW_SENDERS_MAX; k++) espnowSeenMark[k] = espnowSenders[k].lastSeq;
+  espnowSeenDirty = false;  // the load above only matched what NVS already holds
+}
+
+// -------------------- UDP control (STA) --------------------
+// One datagram per command for PLC/SCADA masters that cannot afford a TCP
+// handshake or a broker hop per write. A request carries set/clear/toggle
+// masks that take the same CMD_BATCH path as MQTT and HTTP batches; the reply
+// leaves once the control task has applied them and carries the resulting
+// relay and input masks. All-zero masks just read the state.
+// Both directions are tagged with a truncated HMAC-SHA256 over a pre-shared
+// key. Replays are stopped by a random session id, drawn each time the
+// listener starts, plus a seq that must strictly increase per sender within
+// the session. The sender is the id inside the tagged frame, never the source
+// address, so a captured datagram resent from anywhere is still stale. When a
+// new sender finds the table full the session is redrawn instead of evicting
+// one, so an evicted sender's old frames cannot come back. A tagged request
+// with the wrong session gets UDP_F_SESSION and the current id back, and is
+// not applied; anything untagged gets no reply.
+static const uint16_t UDP_PORT_DEFAULT  = 5005;
+static const size_t   UDP_KEY_MIN       = 16;
+static const size_t   UDP_KEY_MAX       = 64;
+static const size_t   UDP_TAG_LEN       = 16;
+static const size_t   UDP_SENDERS_MAX   = 16;
+static const uint32_t UDP_APPLY_WAIT_MS = 20;    // control task normally answers in well under 1 ms
+static const uint32_t UDP_RX_TIMEOUT_MS = 500;   // bounds how long a reconfigure waits
+static const uint32_t UDP_RETRY_MS      = 5000;  // after a failed bind
+static const uint8_t  UDP_MAGIC         = 0x55;  // 'U'
+static const uint8_t  UDP_VERSION       = 2;     // 2: + sender
+
+enum : uint8_t { UDP_REQUEST = 1, UDP_REPLY = 2 };
+
+enum : uint8_t {
+  UDP_F_APPLIED = 0x01,  // masks applied; relays/inputs show the result
+  UDP_F_BUSY    = 0x02,  // command ring full, nothing applied
+  UDP_F_SESSION = 0x04,  // wrong session; retry with the one in this reply
+  UDP_F_STALE   = 0x08,  // seq not above the last accepted one, which the reply's seq carries
+  UDP_F_TIMEOUT = 0x10,  // queued but not confirmed within UDP_APPLY_WAIT_MS
+};
+
+// Little-endian on the wire; replies echo seq and zero the command masks
+struct __attribute__((packed)) UdpFrame {
+  uint8_t  magic;
+  uint8_t  version;
+  uint8_t  type;     // UDP_REQUEST / UDP_REPLY
+  uint8_t  flags;    // reply only
+  uint32_t session;
+  uint32_t sender;   // client-chosen id, stable across restarts (replay window key)
+  uint32_t seq;
+  uint32_t set, clr, tgl;
+  uint32_t relays;   // reply: relay outputs after the command
+  uint32_t inputs;   // reply: closed inputs
+  uint8_t  tag[UDP_TAG_LEN];
+};
+static_assert(sizeof(UdpFrame) == 52, "UdpFrame layout");
+
+struct UdpCfg {
+  bool     enabled = false;
+  uint16_t port = UDP_PORT_DEFAULT;
+  String   key;
+};
+
+struct UdpSender {
+  uint32_t id;
+  uint32_t lastSeq;
+  bool     used;
+};
+
+// Owned by the udp task; handlers read the config back from NVS
+static UdpCfg    udpCfg;
+static UdpSender udpSenders[UDP_SENDERS_MAX];
+static uint32_t  udpSession = 0;
+static std::atomic<bool> udpActive{false};
+static std::atomic<bool> udpReconfigure{false};
+static std::atomic<uint32_t> udpRx{0}, udpRejected{0}, udpStale{0}, udpBusy{0};
+
+// Own Preferences handle: called from the udp task and async_tcp
+static void loadUdpCfg(UdpCfg& c) {
+  Preferences p;
+  p.begin("udp", true);
+  c.enabled = p.getBool("en", false);
+  c.port    = p.getUShort("port", UDP_PORT_DEFAULT);
+  c.key     = p.getString("key", "");
+  p.end();
+}
+
+static void saveUdpCfg(const UdpCfg& c) {
+  Preferences p;
+  p.begin("udp", false);
+  p.putBool("en", c.enabled);
+  p.putUShort("port", c.port);
+  p.putString("key", c.key);
+  p.end();
+}
+
+static void udpTag(const UdpFrame& f, uint8_t out[UDP_TAG_LEN]) {
+  uint8_t mac[AUTH_HASH_LEN];
+  mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                  (const uint8_t*)udpCfg.key.c_str(), udpCfg.key.length(),
+                  (const uint8_t*)&f, offsetof(UdpFrame, tag), mac);
+  memcpy(out, mac, UDP_TAG_LEN);
+}
+
+static void udpNewSession() {
+  const uint32_t old = udpSession;
+  do udpSession = esp_random(); while (!udpSession || udpSession == old);
+  memset(udpSenders, 0, sizeof(udpSenders));
+}
+
+enum UdpFreshness : uint8_t { UDP_FRESH, UDP_STALE, UDP_RESESSION };
+
+// Strictly increasing seq per authenticated sender id; on a replay *last gets
+// the sender's last accepted seq so the client can resync. A sender that does
+// not fit starts a new session (UDP_RESESSION, nothing applied).
+static UdpFreshness udpFresh(uint32_t id, uint32_t seq, uint32_t* last) {
+  UdpSender* freeSlot = nullptr;
+  for (auto &s : udpSenders) {
+    if (!s.used) {
+      if (!freeSlot) freeSlot = &s;
+      continue;
+    }
+    if (s.id != id) continue;
+    if ((int32_t)(seq - s.lastSeq) <= 0) {
+      *last = s.lastSeq;
+      return UDP_STALE;
+    }
+    s.lastSeq = seq;
+    return UDP_FRESH;
+  }
+  if (!freeSlot) {
+    udpNewSession();
+    LOGW("[UDP] More than %u senders, new session", (unsigned)UDP_SENDERS_MAX);
+    return UDP_RESESSION;
+  }
+  freeSlot->id = id;
+  freeSlot->lastSeq = seq;
+  freeSlot->used = true;
+  return UDP_FRESH;
+}
+
+// Turns a request into its reply in place; false = drop without answering
+static bool udpHandle(UdpFrame& f) {
+  if (f.magic != UDP_MAGIC || f.version != UDP_VERSION || f.type != UDP_REQUEST) return false;
+  uint8_t tag[UDP_TAG_LEN];
+  udpTag(f, tag);
+  if (!ctEqual(tag, f.tag, UDP_TAG_LEN)) return false;
+  udpRx++;
+
+  uint8_t flags = 0;
+  uint32_t last = 0;
+  const uint32_t set = f.set & ALL_RELAYS, clr = f.clr & ALL_RELAYS, tgl = f.tgl & ALL_RELAYS;
+  const UdpFreshness fresh = f.session == udpSession ? udpFresh(f.sender, f.seq, &last) : UDP_RESESSION;
+  if (fresh == UDP_RESESSION) {
+    flags = UDP_F_SESSION;
+  } else if (fresh == UDP_STALE) {
+    flags = UDP_F_STALE;
+    f.seq = last;
+    udpStale++;
+  } else if (set | clr | tgl) {
+    RelayCmd c = {};
+    c.op = CMD_BATCH;
+    c.set = set;
+    c.clr = clr;
+    c.tgl = tgl;
+    ulTaskNotifyTake(pdTRUE, 0);  // drop a late ack for an earlier timed-out command
+    if (!postRelayCmd(udpCmdRing, c)) {
+      flags = UDP_F_BUSY;
+      udpBusy++;
+    } else {
+      flags = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(UDP_APPLY_WAIT_MS)) ? UDP_F_APPLIED : UDP_F_TIMEOUT;
+    }
+  }
+
+  f.type = UDP_REPLY;
+  f.flags = flags;
+  f.session = udpSession;
+  f.set = f.clr = f.tgl = 0;
+  f.relays = relays.mask();
+  f.inputs = inputs.closedMask();
+  udpTag(f, f.tag);
+  return true;
+}
+
+static int udpOpen(uint16_t port) {
+  const int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (fd < 0) return -1;
+  timeval tv = {};
+  tv.tv_usec = UDP_RX_TIMEOUT_MS * 1000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(fd, (const sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void udpTask(void*) {
+  int fd = -1;
+  // One spare byte tells an oversized datagram from an exact fit
+  uint8_t buf[sizeof(UdpFrame) + 1];
+  UdpFrame f;
+
+  for (;;) {
+    if (udpReconfigure.exchange(false)) {
+      if (fd >= 0) {
+        close(fd);
+        fd = -1;
+        udpActive = false;
+        LOGI("[UDP] Stopped");
+      }
+      loadUdpCfg(udpCfg);
+    }
+    if (fd < 0) {
+      if (!udpCfg.enabled || udpCfg.key.length() < UDP_KEY_MIN || WiFi.status() != WL_CONNECTED) {
+        vTaskDelay(pdMS_TO_TICKS(UDP_RX_TIMEOUT_MS));
+        continue;
+      }
+      fd = udpOpen(udpCfg.port);
+      if (fd < 0) {
+        LOGE("[UDP] bind to port %u failed", (unsigned)udpCfg.port);
+        vTaskDelay(pdMS_TO_TICKS(UDP_RETRY_MS));
+        continue;
+      }
+      udpNewSession();
+      udpActive = true;
+      LOGI("[UDP] Listening on port %u", (unsigned)udpCfg.port);
+    }
+
+    sockaddr_in from = {};
+    socklen_t fromLen = sizeof(from);
+    const int n = recvfrom(fd, buf, sizeof(buf), 0, (sockaddr*)&from, &fromLen);
+    if (n < 0) continue;  // receive timeout
+    if (n != (int)sizeof(UdpFrame)) {
+      udpRejected++;
+      continue;
+    }
+
+    MetricScope m(MT_UDP);
+    memcpy(&f, buf, sizeof(f));
+    if (!udpHandle(f)) {
+      udpRejected++;
+      continue;
+    }
+    sendto(fd, &f, sizeof(f), 0, (const sockaddr*)&from, fromLen);
+  }
+}
+
+// STA only; the task idles until /api/udp enables it
+static void startUdp() {
+  loadUdpCfg(udpCfg);
+  xTaskCreatePinnedToCore(udpTask, "udp", UDP_TASK_STACK, nullptr,
+                          UDP_TASK_PRIO, &udpTaskHandle, UDP_TASK_CORE);
+}
+
+// -------------------- Pulse counters (PCNT) --------------------
+// An input in counter mode is wired to a PCNT unit instead of the edge ISR:
+// falling edges (contact closing) count in hardware behind the glitch filter,
+// so kHz-rate S0/flow/tacho signals cost no CPU. The net task folds the
+// 16-bit hardware counter into a 64-bit total every PCNT_POLL_MS and keeps
+// 5 s buckets for a 60 s sliding rate. Totals go to NVS at most every 10 min;
+// a reset is written (and published) on the next net task pass, so a reboot
+// right after it cannot bring the old total back.
+// Mode changes apply at boot; the ESP32 has 8 units.
+static const size_t   PCNT_UNITS       = PCNT_UNIT_MAX;
+static const int16_t  PCNT_WRAP        = 32767;   // hardware resets to 0 at h_lim
+static const uint16_t PCNT_FILTER_MAX  = 1023;    // APB cycles, ~12.8 us at 80 MHz
+static const uint32_t PCNT_POLL_MS     = 100;     // < 32767 pulses per poll: ~300 kHz max
+static const uint32_t PCNT_BUCKET_MS   = 5000;
+static const size_t   PCNT_BUCKETS     = 12;      // 60 s rate window
+static const uint32_t PCNT_PUBLISH_MS  = 10000;
+static const uint32_t PCNT_PERSIST_MS  = 600000;
+
+struct PulseCounter {
+  int8_t   unit = -1;
+  int16_t  lastRaw = 0;
+  uint64_t total = 0;
+  uint64_t published = 0;
+  uint64_t persisted = 0;
+  uint32_t bucket[PCNT_BUCKETS] = {0};
+  uint8_t  head = 0;        // bucket being filled
+  uint8_t  full = 0;        // completed buckets before head
+};
+
+static PulseCounter counters[INPUT_COUNT];
+static uint16_t counterFilter = PCNT_FILTER_MAX;
+static uint32_t counterBucketMs = 0;    // start of the head buckets
+static uint32_t counterPollMs = 0, counterPublishMs = 0, counterPersistMs = 0;
+static SpinLock counterLock;            // net task writes, async_tcp/outbox read
+static std::atomic<uint32_t> counterResetDue{0};  // totals zeroed since the last write
+
+// Pulses per second over the completed buckets plus the running one
+static void counterRead(size_t i, uint64_t& total, float& rate) {
+  const PulseCounter &c = counters[i];
+  const uint32_t now = millis();
+  counterLock.lock();
+  total = c.total;
+  uint32_t sum = 0;
+  for (uint8_t k = 0; k <= c.full; k++) sum += c.bucket[(c.head + PCNT_BUCKETS - k) % PCNT_BUCKETS];
+  const uint32_t spanMs = c.full * PCNT_BUCKET_MS + (now - counterBucketMs);
+  counterLock.unlock();
+  rate = spanMs ? sum * 1000.0f / spanMs : 0.0f;
+}
+
+// async_tcp: the net task persists the zero (NVS stays off the HTTP path)
+static void counterReset(size_t i) {
+  if (!(counterMask & (1u << i))) return;
+  counterLock.lock();
+  counters[i].total = 0;
+  counterLock.unlock();
+  counterResetDue.fetch_or(1u << i);
+  if (netTaskHandle) xTaskNotifyGive(netTaskHandle);
+}
+
+static void loadCounterCfg() {
+  Preferences p;
+  p.begin("pcnt", true);
+  counterMask   = p.getUInt("mask", 0) & ALL_INPUTS;
+  counterFilter = min(p.getUShort("filt", PCNT_FILTER_MAX), PCNT_FILTER_MAX);
+  for (size_t i = 0; i < INPUT_COUNT; i++) {
+    if (!(counterMask & (1u << i))) continue;
+    char key[8];
+    snprintf(key, sizeof(key), "t%u", (unsigned)i);
+    counters[i].total = counters[i].persisted = counters[i].published = p.getULong64(key, 0);
+  }
+  p.end();
+}
+
+static void saveCounterCfg(uint32_t mask, uint16_t filter) {
+  Preferences p;  // own handle: async_tcp, while the net task persists totals
+  p.begin("pcnt", false);
+  p.putUInt("mask", mask);
+  p.putUShort("filt", filter);
+  p.end();
+}
+
+// Before startInputCapture(): counter inputs get a PCNT unit, not the ISR
+static void startCounters() {
+  loadCounterCfg();
+  size_t unit = 0;
+  for (size_t i = 0; i < INPUT_COUNT; i++) {
+    if (!(counterMask & (1u << i))) continue;
+    if (unit == PCNT_UNITS) {
+      Serial.printf("[PCNT] Input %u: no unit left, kept as a switch\n", (unsigned)i + 1);
+      counterMask &= ~(1u << i);
+      continue;
+    }
+    const pcnt_unit_t u = (pcnt_unit_t)unit++;
+    pcnt_config_t cfg = {};
+    cfg.pulse_gpio_num = inputs.pin(i);
+    cfg.ctrl_gpio_num = PCNT_PIN_NOT_USED;
+    cfg.channel = PCNT_CHANNEL_0;
+    cfg.unit = u;
+    cfg.pos_mode = PCNT_COUNT_DIS;   // contact opening
+    cfg.neg_mode = PCNT_COUNT_INC;   // contact closing (INPUT_PULLUP)
+    cfg.lctrl_mode = PCNT_MODE_KEEP;
+    cfg.hctrl_mode = PCNT_MODE_KEEP;
+    cfg.counter_h_lim = PCNT_WRAP;
+    cfg.counter_l_lim = 0;
+    pcnt_unit_config(&cfg);
+    pcnt_set_filter_value(u, counterFilter);
+    pcnt_filter_enable(u);
+    pcnt_counter_pause(u);
+    pcnt_counter_clear(u);
+    pcnt_counter_resume(u);
+    counters[i].unit = u;
+    Serial.printf("[PCNT] Input %u -> unit %u, total=%llu\n",
+                  (unsigned)i + 1, (unsigned)u, (unsigned long long)counters[i].total);
+  }
+  counterBucketMs = millis();
+}
+
+// Net task: fold hardware counts in, roll buckets, publish and persist
+static void counterService(uint32_t now) {
+  const uint32_t resetDue = counterResetDue.exchange(0);
+  if (!counterMask || (!resetDue && now - counterPollMs < PCNT_POLL_MS)) return;
+  counterPollMs = now;
+
+  const bool roll = now - counterBucketMs >= PCNT_BUCKET_MS;
+  counterLock.lock();
+  for (size_t i = 0; i < INPUT_COUNT; i++) {
+    PulseCounter &c = counters[i];
+    if (c.unit < 0) continue;
+    int16_t raw = 0;
+    pcnt_get_counter_value((pcnt_unit_t)c.unit, &raw);
+    int32_t d = raw - c.lastRaw;
+    if (d < 0) d += PCNT_WRAP;
+    c.lastRaw = raw;
+    c.total += d;
+    c.bucket[c.head] += d;
+    if (roll) {
+      c.head = (c.head + 1) % PCNT_BUCKETS;
+      c.bucket[c.head] = 0;
+      if (c.full < PCNT_BUCKETS - 1) c.full++;
+    }
+  }
+  counterLock.unlock();
+  if (roll) counterBucketMs = now;
+
+  const bool publish = now - counterPublishMs >= PCNT_PUBLISH_MS;
+  const bool persist = now - counterPersistMs >= PCNT_PERSIST_MS;
+  if (publish) counterPublishMs = now;
+  if (persist) counterPersistMs = now;
+  if (!publish && !persist && !resetDue) return;
+
+  Preferences p;  // own handle: net task
+  bool opened = false;
+  for (size_t i = 0; i < INPUT_COUNT; i++) {
+    PulseCounter &c = counters[i];
+    if (c.unit < 0) continue;
+    counterLock.lock();
+    const uint64_t total = c.total;
+    counterLock.unlock();
+    const bool reset = resetDue & (1u << i);
+
+    if ((publish || reset) && total != c.published) {
+      c.published = total;
+      outboxMark(OB_COUNT0 + i);
+    }
+    if ((persist || reset) && total != c.persisted) {
+      if (!opened) opened = p.begin("pcnt", false);
+      char key[8];
+      snprintf(key, sizeof(key), "t%u", (unsigned)i);
+      if (opened && p.putULong64(key, total)) c.persisted = total;  // else retried next pass
+    }
+  }
+  if (opened) p.end();
+}
+
+static void startInputCapture() {
+  for (size_t i = 0; i < INPUT_COUNT; i++) {
+    if (counterMask & (1u << i)) continue;  // PCNT owns the pin
+    void* arg = (void*)(uintptr_t)((i << 8) | inputs.pin(i));
+    attachInterruptArg(inputs.pin(i), onInputEdge, arg, CHANGE);
+  }
+}
+
+// -------------------- Power --------------------
+// Profiles trade command latency for idle current. Relay control never polls
+// in any of them: the control task blocks on its notification until an input
+// edge, a command or the next debounce/rule deadline, so a local input ->
+// relay reaction costs INPUT_DEBOUNCE_MS plus the wake-up (POWER_WAKE_MS
+// bound) whatever the profile. What changes is how fast the network side
+// hears a command:
+//   performance  fixed 240 MHz, WiFi always awake
+//   balanced     DFS 80..240 MHz, WiFi modem sleep (wakes for every DTIM
+//                beacon, the WiFi behaviour of earlier builds; default)
+//   low          DFS 40..160 MHz, automatic light sleep, WiFi max modem sleep
+//                (listen interval), net task tick POWER_LOW_TICK_MS; inputs
+//                wake the chip through GPIO wake
+// DFS and light sleep need an IDF built with CONFIG_PM_ENABLE, light sleep
+// also CONFIG_FREERTOS_USE_TICKLESS_IDLE. Without them the CPU is set to a
+// fixed clock per profile and only modem sleep and the net tick save power.
+// ESP-NOW keeps WiFi awake (it would miss broadcasts), and pulse counters
+// keep the chip out of light sleep and APB at 80 MHz (PCNT stops in light
+// sleep and its glitch filter counts APB cycles).
+static const uint32_t POWER_LOW_TICK_MS = 100;
+static const uint32_t POWER_WAKE_MS     = 2;  // GPIO wake + clock ramp, rounded up
+
+#if CONFIG_FREERTOS_USE_TICKLESS_IDLE
+static const bool POWER_TICKLESS = true;
+#else
+static const bool POWER_TICKLESS = false;
+#endif
+
+struct PowerProfileDef {
+  const char*    name;
+  uint16_t       maxMhz, minMhz;  // DFS range
+  uint16_t       fixedMhz;        // without CONFIG_PM_ENABLE
+  bool           lightSleep;
+  wifi_ps_type_t ps;
+  uint32_t       tickMs;          // net task idle wait
+};
+
+static const PowerProfileDef POWER_PROFILES[PWR_COUNT] = {
+  {"performance", 240, 240, 240, false, WIFI_PS_NONE,      NET_TICK_MS},
+  {"balanced",    240,  80, 240, false, WIFI_PS_MIN_MODEM, NET_TICK_MS},
+  {"low",         160,  40,  80, true,  WIFI_PS_MAX_MODEM, POWER_LOW_TICK_MS},
+};
+
+static std::atomic<bool>     powerReconfigure{true};  // first STA pass applies the stored profile
+static std::atomic<uint32_t> netTickMs{NET_TICK_MS};
+static std::atomic<bool>     powerDfs{false}, powerLightSleep{false};  // as applied
+static bool powerInputWake = false;
+
+static int powerParse(const String& s) {
+  for (int i = 0; i < PWR_COUNT; i++) {
+    if (s == POWER_PROFILES[i].name) return i;
+  }
+  return -1;
+}
+
+static wifi_ps_type_t powerWifiPs() {
+  return espnowActive ? WIFI_PS_NONE : POWER_PROFILES[powerProfile].ps;
+}
+
+static void powerWifiSleep() {
+  esp_wifi_set_ps(powerWifiPs());
+}
+
+// Switch the switch-mode input interrupts between CHANGE and the flipping
+// level interrupts that can wake the chip from light sleep
+static void powerArmInputWake(bool on) {
+  if (on == powerInputWake) return;
+  portENTER_CRITICAL(&inputIrqMux);
+  inputLevelIrq = on;
+  for (size_t i = 0; i < INPUT_COUNT; i++) {
+    if (counterMask & (1u << i)) continue;  // PCNT owns the pin
+    const uint32_t pin = inputs.pin(i);
+    GPIO.pin[pin].int_type = !on ? GPIO_INTR_ANYEDGE
+                           : pinLevel(pin) ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL;
+    GPIO.pin[pin].wakeup_enable = on;
+  }
+  portEXIT_CRITICAL(&inputIrqMux);
+  if (on) esp_sleep_enable_gpio_wakeup();
+  powerInputWake = on;
+}
+
+// Net task (STA): apply powerProfile
+static void powerApply() {
+  const PowerProfileDef& p = POWER_PROFILES[powerProfile];
+  const bool counters = counterMask != 0;
+
+  esp_pm_config_esp32_t pm = {};
+  pm.max_freq_mhz = p.maxMhz;
+  pm.min_freq_mhz = counters && p.minMhz < 80 ? 80 : p.minMhz;
+  pm.light_sleep_enable = p.lightSleep && POWER_TICKLESS && !counters;
+  const esp_err_t err = esp_pm_configure(&pm);
+  powerDfs = err == ESP_OK;
+  metricsWallClock = powerDfs.load();
+  powerLightSleep = err == ESP_OK && pm.light_sleep_enable;
+  if (!powerDfs && getCpuFrequencyMhz() != p.fixedMhz) setCpuFrequencyMhz(p.fixedMhz);
+
+  powerArmInputWake(powerLightSleep);
+  powerWifiSleep();
+  netTickMs = p.tickMs;
+
+  LOGI("[PWR] %s: %s, light sleep %s, WiFi ps %d, tick %u ms", p.name,
+       powerDfs ? "DFS" : "fixed clock", powerLightSleep ? "on" : "off",
+       (int)powerWifiPs(), (unsigned)p.tickMs);
+  if (!powerDfs) LOGW("[PWR] DFS unavailable (%d), CPU fixed at %u MHz", (int)err, (unsigned)getCpuFrequencyMhz());
+  else if (p.lightSleep && !powerLightSleep) {
+    LOGW("[PWR] Light sleep off: %s", counters ? "pulse counters in use" : "no tickless idle in this build");
+  }
+}
+
+static void powerService() {
+  if (powerReconfigure.exchange(false)) powerApply();
+}
+
+// -------------------- Preferences --------------------
+// WiFi and MQTT settings are one CRC-checked blob (include/config_blob.h) at
+// NVS "cfg"/"v": read once at boot, and written as a whole by the net task
+// once saves have been quiet for CFG_SAVE_SETTLE_MS (at most CFG_SAVE_MAX_MS
+// after the first), and only if the bytes differ from what NVS holds. A form
+// post, a roam and a burst of API calls each cost at most one write, and a
+// reader never sees half an update. Nodes from before the blob migrate from
+// the old "wifi"/"mqtt" namespaces once; those are left for older images.
+static const uint32_t CFG_SAVE_SETTLE_MS = 1000;
+static const uint32_t CFG_SAVE_MAX_MS    = 10000;
+
+static MutexLock cfgLock;                    // async_tcp, WiFi events, net task
+static uint8_t   cfgPending[CFG_BLOB_MAX];   // latest encoded settings
+static uint8_t   cfgStored[CFG_BLOB_MAX];    // what NVS holds
+static size_t    cfgStoredLen = 0;
+static uint32_t  cfgFirstDirtyMs = 0, cfgLastDirtyMs = 0;
+static std::atomic<bool>     cfgDirty{false};
+static std::atomic<uint32_t> cfgWrites{0};   // since boot
+
+// False when a string does not fit its field
+static bool cfgFromRam(const WifiCfg& w, const MqttCfg& m, CfgBody& b) {
+  b = cfgDefaults();
+  bool ok = cfgSetStr(b.wifiSsid, w.ssid.c_str(), w.ssid.length());
+  ok &= cfgSetStr(b.wifiPass, w.pass.c_str(), w.pass.length());
+  b.wifiIp      = w.ip;
+  b.wifiGateway = w.gateway;
+  b.wifiSubnet  = w.subnet;
+  b.wifiDns     = w.dns;
+  memcpy(b.wifiBssid, w.bssid, sizeof(b.wifiBssid));
+  b.wifiChannel = w.channel;
+
+  b.mqttEnabled = m.enabled;
+  ok &= cfgSetStr(b.mqttHost, m.host.c_str(), m.host.length());
+  b.mqttPort = m.port;
+  ok &= cfgSetStr(b.mqttUser, m.user.c_str(), m.user.length());
+  ok &= cfgSetStr(b.mqttPass, m.pass.c_str(), m.pass.length());
+  ok &= cfgSetStr(b.mqttBase, m.cmdTopic.c_str(), m.cmdTopic.length());
+  ok &= cfgSetStr(b.mqttStateTopic, m.stateTopic.c_str(), m.stateTopic.length());
+  b.mqttRate = m.rate;
+  b.mqttStateFormat = m.stateFormat;
+  b.mqttTls = m.tls;
+  b.mqttHa = m.haDiscovery;
+  b.powerProfile = powerProfile;
+  return ok;
+}
+
+static void cfgToRam(const CfgBody& b) {
+  wifiCfg.ssid    = b.wifiSsid;
+  wifiCfg.pass    = b.wifiPass;
+  wifiCfg.ip      = b.wifiIp;
+  wifiCfg.gateway = b.wifiGateway;
+  wifiCfg.subnet  = b.wifiSubnet;
+  wifiCfg.dns     = b.wifiDns;
+  memcpy(wifiCfg.bssid, b.wifiBssid, sizeof(wifiCfg.bssid));
+  wifiCfg.channel = b.wifiChannel;
+
+  mqttCfg.enabled     = b.mqttEnabled;
+  mqttCfg.host        = b.mqttHost;
+  mqttCfg.port        = b.mqttPort;
+  mqttCfg.user        = b.mqttUser;
+  mqttCfg.pass        = b.mqttPass;
+  mqttCfg.cmdTopic    = b.mqttBase;
+  mqttCfg.stateTopic  = b.mqttStateTopic;
+  mqttCfg.rate        = b.mqttRate;
+  mqttCfg.stateFormat = b.mqttStateFormat;
+  mqttCfg.tls         = b.mqttTls;
+  mqttCfg.haDiscovery = b.mqttHa;
+
+  powerProfile = b.powerProfile < PWR_COUNT ? b.powerProfile : (uint8_t)PWR_BALANCED;
+}
+
+// Any task: snapshot wifiCfg/mqttCfg/powerProfile for the next write. Callers
+// validate with cfgFromRam() first, so nothing is cut here.
+static void cfgSave() {
+  CfgBody b;
+  cfgFromRam(wifiCfg, mqttCfg, b);
+  const uint32_t now = millis();
+  cfgLock.lock();
+  cfgEncode(b, cfgPending);
+  if (!cfgDirty) cfgFirstDirtyMs = now;
+  cfgLastDirtyMs = now;
+  cfgDirty = true;
+  cfgLock.unlock();
+}
+
+// Writes a pending snapshot now if it is due (or forced) and differs from NVS
+static void cfgFlush(bool force) {
+  if (!cfgDirty) return;
+  cfgLock.lock();
+  const uint32_t now = millis();
+  const bool due = force || now - cfgLastDirtyMs >= CFG_SAVE_SETTLE_MS ||
+                   now - cfgFirstDirtyMs >= CFG_SAVE_MAX_MS;
+  if (cfgDirty && due) {
+    cfgDirty = false;
+    if (cfgStoredLen != CFG_BLOB_MAX || memcmp(cfgPending, cfgStored, CFG_BLOB_MAX)) {
+      Preferences p;  // own handle: any task may flush before a restart
+      p.begin("cfg", false);
+      const bool ok = p.putBytes("v", cfgPending, CFG_BLOB_MAX) == CFG_BLOB_MAX;
+      p.end();
+      if (ok) {
+        memcpy(cfgStored, cfgPending, CFG_BLOB_MAX);
+        cfgStoredLen = CFG_BLOB_MAX;
+        cfgWrites++;
+        LOGI("[CFG] Saved (%u bytes)", (unsigned)CFG_BLOB_MAX);
+      } else {
+        LOGE("[CFG] NVS write failed");
+      }
+    }
+  }
+  cfgLock.unlock();
+}
+
+// Pre-blob layout, read once for the migration
+static void loadLegacyCfg() {
+  prefs.begin("wifi", true);
+  wifiCfg.ssid    = prefs.getString("ssid", "");
+  wifiCfg.pass    = prefs.getString("pass", "");
+  wifiCfg.ip      = prefs.getUInt("ip", 0);
+  wifiCfg.gateway = prefs.getUInt("gw", 0);
+  wifiCfg.subnet  = prefs.getUInt("mask", 0);
+  wifiCfg.dns     = prefs.getUInt("dns", 0);
+  wifiCfg.channel = prefs.getUChar("ch", 0);
+  if (prefs.getBytes("bssid", wifiCfg.bssid, sizeof(wifiCfg.bssid)) != sizeof(wifiCfg.bssid)) {
+    wifiCfg.channel = 0;
+  }
+  prefs.end();
+
+  prefs.begin("mqtt", true);
+  mqttCfg.enabled    = prefs.getBool("en", false);
+  mqttCfg.host       = prefs.getString("host", "");
+  mqttCfg.port       = prefs.getUShort("port", 1883);
+  mqttCfg.user       = prefs.getString("user", "");
+  mqttCfg.pass       = prefs.getString("pass", "");
+  mqttCfg.cmdTopic   = prefs.getString("cmd", ""); // base topic
+  mqttCfg.stateTopic = prefs.getString("st", "");  // unused
+  mqttCfg.rate       = prefs.getUShort("rate", 20);
+  mqttCfg.stateFormat = prefs.getUChar("sfmt", SF_TOPICS);
+  mqttCfg.tls        = prefs.getBool("tls", false);
+  mqttCfg.haDiscovery = prefs.getBool("ha", true);
+  prefs.end();
+}
+
+static void loadConfig() {
+  cfgLock.begin();
+
+  Preferences p;
+  p.begin("cfg", true);
+  const size_t len = p.getBytesLength("v");
+  std::unique_ptr<uint8_t[]> raw(len ? new (std::nothrow) uint8_t[len] : nullptr);
+  const size_t got = raw ? p.getBytes("v", raw.get(), len) : 0;
+  p.end();
+
+  CfgBody b = cfgDefaults();
+  const CfgStatus st = cfgDecode(raw.get(), got, b);
+  if (st == CFG_OK) {
+    cfgToRam(b);
+    // A blob from another layout never matches, so the next save rewrites it
+    if (got == CFG_BLOB_MAX) {
+      memcpy(cfgStored, raw.get(), CFG_BLOB_MAX);
+      cfgStoredLen = CFG_BLOB_MAX;
+    }
+  } else {
+    if (st != CFG_EMPTY) LOGE("[CFG] Stored config rejected (%s), using the old namespaces", cfgStatusStr(st));
+    loadLegacyCfg();
+    CfgBody check;
+    if (!cfgFromRam(wifiCfg, mqttCfg, check)) LOGW("[CFG] Over-long setting dropped in migration");
+    cfgToRam(check);
+    cfgSave();
+    cfgFlush(true);
+  }
+  applyTopics();
+}
+
+// New credentials invalidate the cached AP
+static void saveWifiCfg() {
+  memset(wifiCfg.bssid, 0, sizeof(wifiCfg.bssid));
+  wifiCfg.channel = 0;
+  cfgSave();
+}
+
+// Only schedules a write when the AP actually changed (roaming, new channel)
+static void saveWifiAp(const uint8_t* bssid, uint8_t channel) {
+  if (channel == wifiCfg.channel && !memcmp(bssid, wifiCfg.bssid, 6)) return;
+
+  memcpy(wifiCfg.bssid, bssid, 6);
+  wifiCfg.channel = channel;
+  cfgSave();
+  Serial.printf("[WiFi] Cached AP %02X:%02X:%02X:%02X:%02X:%02X ch=%u\n",
+                bssid[0], bssid[1], bssid[2], bssid[3], bssid[4], bssid[5], channel);
+}
+
+static void forgetWifiAp() {
+  if (!wifiCfg.channel) return;
+  wifiCfg.channel = 0;
+  cfgSave();
+}
+
+static void saveMqttCfg() {
+  cfgSave();
+}
+
+// -------------------- Relay power-on state --------------------
+// Per-channel power-on mode, plus a journal of the last relay mask for the
+// "last" channels. NVS is already log-structured and wear-levelled; on top
+// of that writes wait for the state to settle and are spaced out, so a burst
+// of toggles costs one entry.
+enum PowerOnMode : uint8_t { PO_OFF = 0, PO_ON = 1, PO_LAST = 2 };
+
+static const uint32_t RELAY_SAVE_SETTLE_MS  = 2000;
+static const uint32_t RELAY_SAVE_MIN_GAP_MS = 30000;
+
+static uint8_t  powerOnMode[RELAY_COUNT];
+static uint32_t savedRelayMask   = 0;  // what NVS holds
+static uint32_t seenRelayMask    = 0;  // last mask observed by relayJournalService()
+static uint32_t relayChangedMs   = 0;
+static uint32_t relaySavedMs     = 0;
+static bool     relaySavedOnce   = false;
+static std::atomic<bool> relayJournalDue{false};  // next pass writes without waiting
+
+static const char* powerOnModeStr(uint8_t m) {
+  switch (m) {
+    case PO_ON:   return "on";
+    case PO_LAST: return "last";
+    default:      return "off";
+  }
+}
+
+static bool parsePowerOnMode(const String& s, uint8_t &out) {
+  if (s.equalsIgnoreCase("off"))  { out = PO_OFF;  return true; }
+  if (s.equalsIgnoreCase("on"))   { out = PO_ON;   return true; }
+  if (s.equalsIgnoreCase("last")) { out = PO_LAST; return true; }
+  return false;
+}
+
+// Channels whose state is worth journaling
+static uint32_t powerOnLastMask() {
+  uint32_t m = 0;
+  for (size_t i = 0; i < RELAY_COUNT; i++) if (powerOnMode[i] == PO_LAST) m |= (1u << i);
+  return m;
+}
+
+// Reads policy + journal; returns the mask to drive at boot
+static uint32_t loadRelayPowerOn() {
+  memset(powerOnMode, S4N_POWER_ON_DEFAULT, sizeof(powerOnMode));
+
+  prefs.begin("relays", true);
+  prefs.getBytes("po", powerOnMode, sizeof(powerOnMode));  // shorter blob (fewer channels) keeps defaults
+  savedRelayMask = prefs.getUInt("mask", 0);
+  prefs.end();
+
+  uint32_t boot = 0;
+  for (size_t i = 0; i < RELAY_COUNT; i++) {
+    const bool on = (powerOnMode[i] == PO_ON) ||
+                    (powerOnMode[i] == PO_LAST && ((savedRelayMask >> i) & 1));
+    if (on) boot |= (1u << i);
+  }
+  seenRelayMask = boot;
+  return boot;
+}
+
+static void saveRelayPowerOn() {
+  Preferences p;  // own handle: async_tcp, while the net task journals
+  p.begin("relays", false);
+  p.putBytes("po", powerOnMode, sizeof(powerOnMode));
+  p.end();
+}
+
+static void relayJournalWrite(uint32_t mask, uint32_t now) {
+  Preferences p;  // own handle: net task
+  p.begin("relays", false);
+  p.putUInt("mask", mask);
+  p.end();
+  savedRelayMask = mask;
+  relaySavedMs = now;
+  relaySavedOnce = true;
+  LOGD("[RELAY] Journaled state=0x%X", (unsigned)mask);
+}
+
+// Coalesced journal write (net task only); relayJournalDue skips the windows
+static void relayJournalService(uint32_t now) {
+  const uint32_t mask = relays.mask();
+  if (mask != seenRelayMask) {
+    seenRelayMask = mask;
+    relayChangedMs = now;
+  }
+
+  const bool due = relayJournalDue.exchange(false);
+  const uint32_t track = powerOnLastMask();
+  if (((mask ^ savedRelayMask) & track) == 0) return;
+  if (!due && now - relayChangedMs < RELAY_SAVE_SETTLE_MS) return;
+  if (!due && relaySavedOnce && now - relaySavedMs < RELAY_SAVE_MIN_GAP_MS) return;
+
+  relayJournalWrite(mask, now);
+}
+
+// Net task, before a planned restart, so nothing waits out the coalescing window
+static void relayJournalFlush() {
+  relayJournalDue = true;
+  relayJournalService(millis());
+}
+
+// -------------------- WiFi --------------------
+// Poll until associated + IP. With failFast, a definite "AP not there" ends
+// the wait early so the caller can fall back to a full scan.
+static bool waitForSTA(uint32_t timeoutMs, bool failFast) {
+  wl_status_t last = WL_IDLE_STATUS;
+  const uint32_t t0 = millis();
+
+  while (millis() - t0 < timeoutMs) {
+    wl_status_t st = WiFi.status();
+    if (st != last) {
+      last = st;
+      Serial.printf("[WiFi] status=%d (%s)\n", (int)st, wlStatusStr(st));
+    }
+    if (st == WL_CONNECTED) return true;
+    if (failFast && (st == WL_NO_SSID_AVAIL || st == WL_CONNECT_FAILED)) return false;
+    delay(WIFI_POLL_MS);
+  }
+  return false;
+}
+
+static bool connectSTA(uint32_t timeoutMs = 20000) {
+  if (!wifiCfg.ssid.length()) {
+    Serial.println("[WiFi] No SSID saved.");
+    return false;
+  }
+
+  Serial.println("[WiFi] connectSTA()");
+  Serial.println("[WiFi] Saved SSID = [" + wifiCfg.ssid + "]");
+  Serial.println("[WiFi] Saved PASS length = " + String(wifiCfg.pass.length()));
+
+  // Credentials live in our own prefs; keep the SDK from rewriting its copy
+  // in flash on every begin()
+  WiFi.persistent(false);
+  WiFi.mode(WIFI_STA);
+  WiFi.setHostname(mdnsHost.c_str());
+  WiFi.setAutoReconnect(true);
+
+  if (wifiCfg.ip) {
+    WiFi.config(IPAddress(wifiCfg.ip), IPAddress(wifiCfg.gateway),
+                IPAddress(wifiCfg.subnet), IPAddress(wifiCfg.dns));
+    Serial.println("[WiFi] Static IP " + IPAddress(wifiCfg.ip).toString());
+  }
+
+  const uint32_t t0 = millis();
+  bool ok = false;
+
+  // Warm boot: join the cached BSSID on its channel, no scan
+  if (wifiCfg.channel) {
+    Serial.printf("[WiFi] Fast reconnect ch=%u\n", wifiCfg.channel);
+    WiFi.begin(wifiCfg.ssid.c_str(), wifiCfg.pass.c_str(), wifiCfg.channel, wifiCfg.bssid, true);
+    ok = waitForSTA(WIFI_FAST_TIMEOUT_MS, true);
+    if (!ok) {
+      Serial.println("[WiFi] Fast reconnect failed, falling back to scan");
+      forgetWifiAp();
+      WiFi.disconnect();
+    }
+  }
+
+  if (!ok) {
+    Serial.println("[WiFi] Connecting...");
+    WiFi.begin(wifiCfg.ssid.c_str(), wifiCfg.pass.c_str());
+    const uint32_t spent = millis() - t0;
+    ok = waitForSTA(timeoutMs > spent ? timeoutMs - spent : 0, false);
+  }
+
+  if (!ok) {
+    Serial.printf("[WiFi] Timeout. Final status=%d (%s)\n",
+                  (int)WiFi.status(), wlStatusStr(WiFi.status()));
+    return false;
+  }
+
+  Serial.printf("[WiFi] Connected in %u ms! IP=%s RSSI=%d\n",
+                (unsigned)(millis() - t0),
+                WiFi.localIP().toString().c_str(),
+                WiFi.RSSI());
+  saveWifiAp(WiFi.BSSID(), (uint8_t)WiFi.channel());
+  return true;
+}
+
+static void startAPPortal() {
+  WiFi.disconnect(true, true);
+  delay(200);
+
+  const String apSsid = "Switch4Node-" + deviceId;
+  // STA side stays up so scans do not have to switch modes under the AP
+  WiFi.mode(WIFI_AP_STA);
+  WiFi.softAP(apSsid.c_str(), nullptr);
+  delay(200);
+
+  const IPAddress ip = WiFi.softAPIP();
+  dns.start(DNS_PORT, "*", ip);
+
+  Serial.println("[AP] Mode SSID: " + apSsid);
+  Serial.println("[AP] IP: " + ip.toString());
+}
+
+// -------------------- WiFi scan (AP) --------------------
+// The portal never scans inside a request: scans run async, the net task
+// collects results into a small cache, and /api/scan answers from it at
+// once (202 while the very first scan is still running). Hidden networks
+// (empty SSID) are listed per BSSID with "hidden":true, so the user can
+// type the name and still see the channel and signal.
+static const size_t   SCAN_MAX        = 24;
+static const uint32_t SCAN_MAX_AGE_MS = 30000;  // older results trigger a refresh
+
+struct ScanEntry {
+  char    ssid[33];    // "" = hidden
+  uint8_t bssid[6];
+  uint8_t channel;
+  int8_t  rssi;
+  bool    open;
+};
+
+static ScanEntry scanCache[SCAN_MAX];
+static uint8_t   scanCount = 0;
+static uint32_t  scanDoneMs = 0;
+static bool      scanHave = false;
+static std::atomic<bool> scanRunning{false};
+static portMUX_TYPE scanMux = portMUX_INITIALIZER_UNLOCKED;
+
+static void startWifiScan() {
+  if (scanRunning.exchange(true)) return;
+  if (WiFi.scanNetworks(true) == WIFI_SCAN_FAILED) {
+    scanRunning = false;
+    LOGW("[AP] WiFi scan failed to start");
+    return;
+  }
+  LOGI("[AP] WiFi scan started");
+}
+
+// Net task: pick up finished scans. Strongest first, one entry per SSID
+// (hidden networks: per BSSID).
+static void scanService() {
+  if (!scanRunning) return;
+  const int16_t n = WiFi.scanComplete();
+  if (n == WIFI_SCAN_RUNNING) return;
+  if (n < 0) {
+    scanRunning = false;
+    return;
+  }
+
+  ScanEntry found[SCAN_MAX];
+  uint8_t count = 0;
+  for (int16_t i = 0; i < n; i++) {
+    const String ssid = WiFi.SSID(i);
+    const uint8_t* bssid = WiFi.BSSID(i);
+    const int8_t rssi = WiFi.RSSI(i);
+    const bool hidden = !ssid.length();
+
+    int dup = -1;
+    for (uint8_t k = 0; k < count; k++) {
+      if (hidden ? (!found[k].ssid[0] && bssid && !memcmp(bssid, found[k].bssid, 6))
+                 : ssid == found[k].ssid) { dup = k; break; }
+    }
+    if (dup >= 0) {
+      if (rssi <= found[dup].rssi) continue;
+      for (uint8_t k = dup; k + 1 < count; k++) found[k] = found[k + 1];
+      count--;
+    }
+
+    uint8_t at = count;
+    while (at > 0 && found[at - 1].rssi < rssi) at--;
+    if (at >= SCAN_MAX) continue;
+    if (count < SCAN_MAX) count++;
+    for (uint8_t k = count - 1; k > at; k--) found[k] = found[k - 1];
+
+    ScanEntry &e = found[at];
+    strlcpy(e.ssid, ssid.c_str(), sizeof(e.ssid));
+    if (bssid) memcpy(e.bssid, bssid, sizeof(e.bssid));
+    else memset(e.bssid, 0, sizeof(e.bssid));
+    e.channel = WiFi.channel(i);
+    e.rssi = rssi;
+    e.open = WiFi.encryptionType(i) == WIFI_AUTH_OPEN;
+  }
+  WiFi.scanDelete();
+
+  portENTER_CRITICAL(&scanMux);
+  memcpy(scanCache, found, count * sizeof(ScanEntry));
+  scanCount = count;
+  scanDoneMs = millis();
+  scanHave = true;
+  portEXIT_CRITICAL(&scanMux);
+  scanRunning = false;
+
+  LOGI("[AP] WiFi scan done: %u networks", (unsigned)count);
+}
+
+// JSON string body with quotes/backslashes/control characters escaped
+static size_t jsonEscape(char* out, size_t cap, const char* in) {
+  size_t n = 0;
+  for (; *in && n + 7 < cap; in++) {
+    const unsigned char c = *in;
+    if (c == '"' || c == '\\') { out[n++] = '\\'; out[n++] = c; }
+    else if (c < 0x20) n += snprintf(out + n, cap - n, "\\u%04x", c);
+    else out[n++] = c;
+  }
+  out[n] = 0;
+  return n;
+}
+
+// Snapshot of the cache, streamed out one network per chunk piece
+struct ScanStream {
+  ScanEntry e[SCAN_MAX];
+  uint8_t   n;
+  int16_t   next;      // -1 = header, n = trailer, n + 1 = done
+  uint32_t  ageMs;
+  char      piece[320];
+  size_t    len, off;
+};
+
+static bool scanStreamPiece(ScanStream& s) {
+  s.off = 0;
+  if (s.next < 0) {
+    s.len = snprintf(s.piece, sizeof(s.piece), "{\"ok\":true,\"age_ms\":%u,\"scanning\":%s,\"networks\":[",
+                     (unsigned)s.ageMs, scanRunning ? "true" : "false");
+  } else if (s.next < s.n) {
+    const ScanEntry &e = s.e[s.next];
+    char ssid[6 * 32 + 1];
+    jsonEscape(ssid, sizeof(ssid), e.ssid);
+    const uint8_t* b = e.bssid;
+    s.len = snprintf(s.piece, sizeof(s.piece),
+                     "%s{\"ssid\":\"%s\",\"rssi\":%d,\"encryption\":\"%s\",\"channel\":%u,"
+                     "\"bssid\":\"%02x:%02x:%02x:%02x:%02x:%02x\"%s}",
+                     s.next ? "," : "", ssid, e.rssi, e.open ? "OPEN" : "SECURE", (unsigned)e.channel,
+                     b[0], b[1], b[2], b[3], b[4], b[5], e.ssid[0] ? "" : ",\"hidden\":true");
+  } else if (s.next == s.n) {
+    s.len = snprintf(s.piece, sizeof(s.piece), "]}");
+  } else {
+    return false;
+  }
+  s.next++;
+  return true;
+}
+
+static void sendScanResults(AsyncWebServerRequest* r) {
+  auto st = std::make_shared<ScanStream>();
+  portENTER_CRITICAL(&scanMux);
+  memcpy(st->e, scanCache, scanCount * sizeof(ScanEntry));
+  st->n = scanCount;
+  st->ageMs = millis() - scanDoneMs;
+  portEXIT_CRITICAL(&scanMux);
+  st->next = -1;
+  st->len = st->off = 0;
+
+  AsyncWebServerResponse* res = r->beginChunkedResponse("application/json",
+    [st](uint8_t* buf, size_t maxLen, size_t) -> size_t {
+      size_t out = 0;
+      while (out < maxLen) {
+        if (st->off == st->len && !scanStreamPiece(*st)) break;
+        const size_t n = min(maxLen - out, st->len - st->off);
+        memcpy(buf + out, st->piece + st->off, n);
+        st->off += n;
+        out += n;
+      }
+      return out;
+    });
+  res->addHeader("Cache-Control", "no-store");
+  r->send(res);
+}
+
+// -------------------- OTA --------------------
+// Firmware (into the inactive app slot) and LittleFS images are written to
+// flash chunk by chunk as they arrive; nothing beyond one chunk is buffered.
+// Every image must come with its SHA-256, checked before it is activated.
+// The control task keeps switching relays throughout; flash writes only
+// stall it for the few ms the cache is off.
+//
+// A new app boots as ESP_OTA_IMG_PENDING_VERIFY and is confirmed once WiFi
+// (and MQTT, if enabled) stayed up for OTA_CONFIRM_MS. If it never gets
+// there within OTA_CONFIRM_TIMEOUT_MS, or resets first, the bootloader goes
+// back to the previous slot.
+static const uint32_t OTA_STALL_MS           = 30000;   // no data for this long -> abort
+static const uint32_t OTA_CONFIRM_MS         = 30000;
+static const uint32_t OTA_CONFIRM_TIMEOUT_MS = 300000;
+static const uint32_t OTA_REBOOT_DELAY_MS    = 1500;    // HTTP reply and MQTT status go out first
+static const uint32_t OTA_PROGRESS_BYTES     = 65536;   // <base>/ota/status cadence while writing
+static const size_t   OTA_URL_MAX            = 256;
+
+enum OtaTarget : uint8_t { OTA_APP = 0, OTA_FS = 1 };
+enum OtaPhase  : uint8_t { OTA_IDLE = 0, OTA_WRITING, OTA_DONE, OTA_FAILED };
+
+struct OtaJob {
+  uint8_t  target;
+  const esp_partition_t* part;
+  esp_ota_handle_t handle;    // OTA_APP
+  size_t   written;
+  size_t   erased;            // OTA_FS: sectors are erased just ahead of the data
+  uint32_t lastDataMs;
+  uint8_t  want[32];
+  mbedtls_md_context_t sha;
+  const void* owner;          // upload request or pull task holding the job
+};
+
+static OtaJob otaJob;
+static MutexLock otaLock;     // async_tcp (upload), pull task, net task (stall check)
+static volatile uint8_t otaPhase = OTA_IDLE;
+static const char* otaErr = "";                // static strings only
+static std::atomic<uint32_t> otaRebootAtMs{0};  // planned restart (also the AP save); 0 = none
+static bool otaPendingVerify = false;          // this boot runs an unconfirmed image
+
+// Keep the Arduino core from confirming the image at boot; otaConfirmService() does
+extern "C" bool verifyRollbackLater() { return true; }
+
+static const char* otaTargetName(uint8_t t) { return t == OTA_FS ? "fs" : "app"; }
+
+static bool parseHex(const char* hex, uint8_t* out, size_t n) {
+  if (!hex || strlen(hex) != 2 * n) return false;
+  for (size_t i = 0; i < 2 * n; i++) {
+    const char c = hex[i];
+    const int v = (c >= '0' && c <= '9') ? c - '0' :
+                  (c >= 'a' && c <= 'f') ? c - 'a' + 10 :
+                  (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+    if (v < 0) return false;
+    out[i / 2] = (i & 1) ? (out[i / 2] | v) : (v << 4);
+  }
+  return true;
+}
+
+static bool parseOtaTarget(const char* s, uint8_t &t) {
+  if (!s || !*s || !strcmp(s, "app")) { t = OTA_APP; return true; }
+  if (!strcmp(s, "fs")) { t = OTA_FS; return true; }
+  return false;
+}
+
+// Caller holds otaLock
+static void otaFailLocked(const char* err) {
+  if (otaJob.target == OTA_APP) esp_ota_abort(otaJob.handle);
+  mbedtls_md_free(&otaJob.sha);
+  otaErr = err;
+  otaPhase = OTA_FAILED;
+  LOGW("[OTA] %s update failed after %u bytes: %s", otaTargetName(otaJob.target), (unsigned)otaJob.written, err);
+  if (otaJob.target == OTA_FS) LOGW("[OTA] LittleFS stays unmounted; resend a valid image");
+  outboxMark(OB_OTA);
+}
+
+// nullptr on success, else the error for the reply
+static const char* otaBegin(uint8_t target, size_t size, const uint8_t want[32], const void* owner) {
+  otaLock.lock();
+  if (otaPhase == OTA_WRITING) { otaLock.unlock(); return "busy"; }
+
+  const esp_partition_t* part = (target == OTA_APP)
+    ? esp_ota_get_next_update_partition(nullptr)
+    : esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, nullptr);
+  const char* err = nullptr;
+  if (!part) err = "no_partition";
+  else if (size > part->size) err = "too_large";
+  else if (target == OTA_APP && esp_ota_begin(part, OTA_WITH_SEQUENTIAL_WRITES, &otaJob.handle) != ESP_OK) err = "begin_failed";
+  if (err) { otaLock.unlock(); return err; }
+
+  if (target == OTA_FS) LittleFS.end();  // the image replaces the mounted file system
+
+  otaJob.target = target;
+  otaJob.part = part;
+  otaJob.written = otaJob.erased = 0;
+  otaJob.lastDataMs = millis();
+  memcpy(otaJob.want, want, sizeof(otaJob.want));
+  mbedtls_md_init(&otaJob.sha);
+  mbedtls_md_setup(&otaJob.sha, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0);
+  mbedtls_md_starts(&otaJob.sha);
+  otaJob.owner = owner;
+  otaErr = "";
+  otaPhase = OTA_WRITING;
+  otaLock.unlock();
+
+  LOGI("[OTA] %s update started -> %s (%u bytes free)", otaTargetName(target), part->label, (unsigned)part->size);
+  outboxMark(OB_OTA);
+  return nullptr;
+}
+
+static bool otaWrite(const void* owner, const uint8_t* data, size_t len) {
+  otaLock.lock();
+  if (otaPhase != OTA_WRITING || otaJob.owner != owner) { otaLock.unlock(); return false; }
+
+  OtaJob &j = otaJob;
+  const char* err = nullptr;
+  if (j.written + len > j.part->size) {
+    err = "too_large";
+  } else if (j.target == OTA_APP) {
+    if (esp_ota_write(j.handle, data, len) != ESP_OK) err = "write_failed";
+  } else {
+    while (!err && j.erased < j.written + len) {
+      if (esp_partition_erase_range(j.part, j.erased, SPI_FLASH_SEC_SIZE) != ESP_OK) err = "erase_failed";
+      j.erased += SPI_FLASH_SEC_SIZE;
+    }
+    if (!err && esp_partition_write(j.part, j.written, data, len) != ESP_OK) err = "write_failed";
+  }
+  if (err) {
+    otaFailLocked(err);
+    otaLock.unlock();
+    return false;
+  }
+
+  mbedtls_md_update(&j.sha, data, len);
+  const bool progress = (j.written / OTA_PROGRESS_BYTES) != ((j.written + len) / OTA_PROGRESS_BYTES);
+  j.written += len;
+  j.lastDataMs = millis();
+  otaLock.unlock();
+
+  if (progress) outboxMark(OB_OTA);
+  return true;
+}
+
+static bool otaFinish(const void* owner) {
+  otaLock.lock();
+  if (otaPhase != OTA_WRITING || otaJob.owner != owner) { otaLock.unlock(); return false; }
+
+  OtaJob &j = otaJob;
+  uint8_t got[32];
+  mbedtls_md_finish(&j.sha, got);
+  const char* err = nullptr;
+  if (!ctEqual(got, j.want, sizeof(got))) err = "sha256_mismatch";
+  if (!err && j.target == OTA_APP) {
+    // esp_ota_end() also checks the image header, checksum and appended hash
+    if (esp_ota_end(j.handle) != ESP_OK) err = "image_invalid";
+    else if (esp_ota_set_boot_partition(j.part) != ESP_OK) err = "set_boot_failed";
+    j.handle = 0;  // ended either way; nothing for otaFailLocked() to abort
+  }
+  if (err) {
+    otaFailLocked(err);
+    otaLock.unlock();
+    return false;
+  }
+
+  mbedtls_md_free(&j.sha);
+  otaPhase = OTA_DONE;
+  otaRebootAtMs = (millis() + OTA_REBOOT_DELAY_MS) | 1;
+  otaLock.unlock();
+
+  LOGI("[OTA] %s image verified (%u bytes), rebooting", otaTargetName(j.target), (unsigned)j.written);
+  outboxMark(OB_OTA);
+  return true;
+}
+
+static void otaAbort(const void* owner, const char* err) {
+  otaLock.lock();
+  if (otaPhase == OTA_WRITING && otaJob.owner == owner) otaFailLocked(err);
+  otaLock.unlock();
+}
+
+// <base>/ota/status (retained): {"phase":"writing","target":"app","bytes":N,"err":"",
+//  "running":"app0","pending_verify":false}
+static size_t otaStatusJson(char* buf, size_t cap) {
+  static const char* const PHASE[] = {"idle", "writing", "done", "failed"};
+  otaLock.lock();
+  const uint8_t phase = otaPhase;
+  const uint8_t target = otaJob.target;
+  const size_t bytes = otaJob.written;
+  const char* err = otaErr;
+  otaLock.unlock();
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  return snprintf(buf, cap, "{\"phase\":\"%s\",\"target\":\"%s\",\"bytes\":%u,\"err\":\"%s\","
+                  "\"running\":\"%s\",\"pending_verify\":%s}",
+                  PHASE[phase], otaTargetName(target), (unsigned)bytes, err,
+                  running ? running->label : "", otaPendingVerify ? "true" : "false");
+}
+
+// ---- Pull from URL (MQTT) ----
+// <base>/ota  {"url":"http://host/firmware.bin","sha256":"<64 hex>","target":"app|fs"}
+// Publish it without retain: a retained command would come back on every
+// connect. A request for the image this node last applied is ignored as well.
+struct OtaPullReq {
+  char    url[OTA_URL_MAX];
+  uint8_t target;
+  uint8_t want[32];
+};
+static OtaPullReq otaPull;                  // owned by the pull task while otaPullBusy
+static std::atomic<bool> otaPullBusy{false};
+
+// HTTPClient::writeToStream() handles chunked replies and feeds us in pieces
+class OtaSink : public Stream {
+ public:
+  size_t write(uint8_t b) override { return write(&b, 1); }
+  size_t write(const uint8_t* d, size_t n) override { return otaWrite(&otaPull, d, n) ? n : 0; }
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+};
+
+static void otaPullTask(void*) {
+  const bool https = strncmp(otaPull.url, "https://", 8) == 0;
+  WiFiClient plain;
+  WiFiClientSecure tls;
+  // Integrity comes from the mandatory SHA-256, not from the server certificate
+  if (https) tls.setInsecure();
+
+  HTTPClient http;
+  http.setTimeout(OTA_STALL_MS);
+  http.setFollowRedirects(HTTPC_STRICT_FOLLOW_REDIRECTS);
+  const char* err = nullptr;
+  if (!http.begin(https ? (WiFiClient&)tls : plain, otaPull.url)) {
+    err = "bad_url";
+  } else {
+    const int code = http.GET();
+    if (code != HTTP_CODE_OK) {
+      LOGW("[OTA] GET %s -> %d (%s)", otaPull.url, code, code < 0 ? HTTPClient::errorToString(code).c_str() : "http");
+      err = "download_failed";
+    } else {
+      const int size = http.getSize();  // -1 when chunked
+      err = otaBegin(otaPull.target, size > 0 ? size : 0, otaPull.want, &otaPull);
+      if (!err) {
+        OtaSink sink;
+        const int n = http.writeToStream(&sink);
+        if (n < 0 || (size > 0 && n != size)) otaAbort(&otaPull, "download_failed");
+        else if (otaFinish(&otaPull)) {
+          Preferences p;  // own handle: the net task may be in the shared one
+          p.begin("ota", false);
+          p.putBytes("pulled", otaPull.want, sizeof(otaPull.want));
+          p.end();
+        }
+      }
+    }
+  }
+  http.end();
+  if (err) {
+    LOGW("[OTA] pull failed: %s", err);
+    if (strcmp(err, "busy") != 0) {
+      otaLock.lock();
+      if (otaPhase != OTA_WRITING) { otaErr = err; otaPhase = OTA_FAILED; }
+      otaLock.unlock();
+      outboxMark(OB_OTA);
+    }
+  }
+  otaPullBusy = false;
+  vTaskDelete(nullptr);
+}
+
+static bool handleOtaTopic(const char* topic, size_t tlen, const byte* payload, size_t plen) {
+  if (tlen != strlen(topics.ota) || memcmp(topic, topics.ota, tlen) != 0) return false;
+
+  StaticJsonDocument<192 + OTA_URL_MAX> doc;
+  if (deserializeJson(doc, (const char*)payload, plen)) {
+    LOGW("[OTA] %s: invalid JSON", topics.ota);
+    return true;
+  }
+  const char* url = doc["url"] | "";
+  uint8_t target, want[32];
+  if ((strncmp(url, "http://", 7) != 0 && strncmp(url, "https://", 8) != 0) || strlen(url) >= OTA_URL_MAX) {
+    LOGW("[OTA] pull: url must be http(s)://, max %u chars", (unsigned)OTA_URL_MAX - 1);
+    return true;
+  }
+  if (!parseHex(doc["sha256"] | "", want, sizeof(want)) || !parseOtaTarget(doc["target"] | "app", target)) {
+    LOGW("[OTA] pull: sha256 (64 hex) required, target app|fs");
+    return true;
+  }
+
+  uint8_t last[32];
+  Preferences p;
+  p.begin("ota", true);
+  const bool seen = p.getBytes("pulled", last, sizeof(last)) == sizeof(last) && ctEqual(last, want, sizeof(last));
+  p.end();
+  if (seen) {
+    LOGI("[OTA] pull: image already applied, ignored");
+    return true;
+  }
+
+  if (otaPhase == OTA_WRITING || otaPullBusy.exchange(true)) {
+    LOGW("[OTA] pull: update already running");
+    return true;
+  }
+  memcpy(otaPull.url, url, strlen(url) + 1);
+  otaPull.target = target;
+  memcpy(otaPull.want, want, sizeof(want));
+  if (xTaskCreatePinnedToCore(otaPullTask, "ota", OTA_TASK_STACK, nullptr,
+                              OTA_TASK_PRIO, nullptr, OTA_TASK_CORE) != pdPASS) {
+    otaPullBusy = false;
+    LOGE("[OTA] pull: task start failed");
+  }
+  return true;
+}
+
+// Net task: stalled transfers, the reboot after a good image, boot confirmation
+static void otaService(uint32_t now) {
+  otaLock.lock();
+  if (otaPhase == OTA_WRITING && now - otaJob.lastDataMs > OTA_STALL_MS) otaFailLocked("stalled");
+  otaLock.unlock();
+
+  const uint32_t at = otaRebootAtMs;
+  if (at && (int32_t)(now - at) >= 0) {
+    if (otaPhase == OTA_DONE) LOGI("[OTA] Rebooting into the new image...");
+    if (mqtt.connected()) {
+      mqtt.publish(topics.avail, "offline", true);
+      mqtt.disconnect();
+    }
+    relayJournalFlush();
+    cfgFlush(true);
+    espnowFlushSeen();
+    counterPersistMs = now - PCNT_PERSIST_MS;  // force the totals out
+    counterService(now);
+    logFlush();
+    ESP.restart();
+  }
+
+  if (!otaPendingVerify) return;
+  const bool healthy = WiFi.status() == WL_CONNECTED && (!mqttCfg.enabled || mqttConn == MQ_CONNECTED);
+  if (healthy && now >= OTA_CONFIRM_MS) {
+    otaPendingVerify = false;
+    esp_ota_mark_app_valid_cancel_rollback();
+    LOGI("[OTA] New image confirmed");
+    outboxMark(OB_OTA);
+  } else if (now >= OTA_CONFIRM_TIMEOUT_MS) {
+    LOGE("[OTA] New image never came up, rolling back");
+    logFlush();
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+  }
+}
+
+static void startOta() {
+  otaLock.begin();
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  esp_ota_img_states_t st;
+  if (running && esp_ota_get_state_partition(running, &st) == ESP_OK && st == ESP_OTA_IMG_PENDING_VERIFY) {
+    otaPendingVerify = true;
+    Serial.printf("[OTA] Running unconfirmed image from %s, confirming within %u s\n",
+                  running->label, (unsigned)(OTA_CONFIRM_TIMEOUT_MS / 1000));
+  }
+#ifndef CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE
+  Serial.println("[OTA] Bootloader built without rollback: a bad image stays active");
+#endif
+}
+
+// -------------------- mDNS --------------------
+static void startMDNS() {
+  if (MDNS.begin(mdnsHost.c_str())) {
+    MDNS.addService("http", "tcp", 80);
+    Serial.println("[mDNS] http://" + mdnsFqdn + "/");
+  } else {
+    Serial.println("[mDNS] start failed");
+  }
+}
+
+// -------------------- MQTT --------------------
+static bool mqttReady() {
+  if (!mqttCfg.enabled) return false;
+  if (!mqttCfg.host.length()) return false;
+  if (!topics.valid) return false;
+  return true;
+}
+
+static inline bool parseOnOffToggle(const String& s, bool &outOn, bool &isToggle, uint32_t &pulseMs) {
+  return parseOnOffToggle(s.c_str(), s.length(), outOn, isToggle, pulseMs);
+}
+
+// handle <base>/relay/<n>/set
+static bool handleRelaySetTopic(const char* topic, size_t tlen, const byte* payload, size_t plen) {
+  const int n = matchRelaySetTopic(topics, topic, tlen);
+  if (!n) return false;
+
+  bool on = false, isToggle = false;
+  uint32_t pulseMs;
+  if (!parseOnOffToggle((const char*)payload, plen, on, isToggle, pulseMs)) {
+    LOGW("[MQTT] invalid payload for relay: %.*s", (int)plen, (const char*)payload);
+    return true; // topic matched, but payload invalid
+  }
+
+  if (!postRelaySet(mqttCmdRing, n - 1, on, isToggle, pulseMs)) {
+    LOGW("[MQTT] command queue full, relay %d dropped", n);
+  }
+
+  return true;
+}
+
+using RelayBatch = RelayBatchOf<RELAY_COUNT>;  // parseRelayBatch(): include/relay_parse.h
+
+// One CMD_BATCH (pulsed channels switch ON with the rest), then one
+// CMD_PULSE_ARM per pulse. All or nothing, so a full ring never splits it.
+static bool postRelayBatch(SpscRing<RelayCmd, CMD_RING_LEN>& ring, const RelayBatch& b) {
+  if (ring.space() < 1 + (size_t)__builtin_popcount(b.pulse)) return false;
+
+  RelayCmd c = {};
+  c.op = CMD_BATCH;
+  c.set = b.set | b.pulse;
+  c.clr = b.clr;
+  c.tgl = b.tgl;
+  ring.push(c);
+
+  for (size_t i = 0; i < RELAY_COUNT; i++) {
+    if (!(b.pulse & (1u << i))) continue;
+    c = {};
+    c.op = CMD_PULSE_ARM;
+    c.relay = i;
+    c.ms = b.pulseMs[i];
+    ring.push(c);
+  }
+  xTaskNotifyGive(controlTaskHandle);
+  return true;
+}
+
+// optional: <base>/relay/set  with JSON {"1":"ON","2":"OFF"...}
+static bool handleRelaySetAllTopic(const char* topic, size_t tlen, const byte* payload, size_t plen) {
+  if (tlen != topics.relaySetAllLen || memcmp(topic, topics.relaySetAll, tlen) != 0) return false;
+
+  RelayBatch b;
+  if (!parseRelayBatch((const char*)payload, plen, b)) {
+    LOGW("[MQTT] relay/set invalid JSON or mask, ignored");
+    return true;
+  }
+  if (!postRelayBatch(mqttCmdRing, b)) LOGW("[MQTT] command queue full, batch dropped");
+  return true;
+}
+
+static void mqttCallback(char* topic, byte* payload, unsigned int len) {
+  MetricScope m(MT_MQTT_CB);
+  const size_t tlen = strlen(topic);
+  LOGD("[MQTT] RX topic=%s payload=%.*s", topic, (int)len, (const char*)payload);
+
+  // Priority: specific handlers
+  if (handleRelaySetTopic(topic, tlen, payload, len)) return;
+  if (handleRelaySetAllTopic(topic, tlen, payload, len)) return;
+  if (handleOtaTopic(topic, tlen, payload, len)) return;
+
+  LOGW("[MQTT] Unhandled topic");
+}
+
+static const char* mqttStateStr(uint8_t st) {
+  switch (st) {
+    case MQ_IDLE:      return "idle";
+    case MQ_BACKOFF:   return "backoff";
+    case MQ_FAILED:    return "failed";
+    case MQ_RESOLVE:   return "resolve";
+    case MQ_TCP:       return "tcp";
+    case MQ_HANDSHAKE: return "handshake";
+    case MQ_SUBSCRIBE: return "subscribe";
+    case MQ_SNAPSHOT:  return "snapshot";
+    case MQ_CONNECTED: return "connected";
+    default: return "unknown";
+  }
+}
+
+// Connection parameters copied for the worker, so /api/mqtt can change
+// mqttCfg while an attempt is in flight
+struct MqttConnectJob {
+  String host;
+  uint16_t port;
+  bool tls;
+  String user;
+  String pass;
+  String clientId;
+  char willTopic[TOPIC_MAX];
+};
+static MqttConnectJob mqttJob;
+static bool mqttResumed = false;  // last CONNACK resumed this boot's session
+static String mqttCaPem;          // setCACert() keeps the pointer, not a copy
+
+static bool loadMqttCa() {
+  File f = LittleFS.open(MQTT_CA_PATH, "r");
+  if (!f || f.size() > MQTT_CA_MAX) return false;
+  mqttCaPem = f.readString();
+  return mqttCaPem.indexOf("-----BEGIN CERTIFICATE-----") >= 0;
+}
+
+static void mqttConnectFail(uint8_t stage) {
+  mqttFailStage = stage;
+  mqttConn = MQ_FAILED;
+  vTaskDelete(nullptr);
+}
+
+// Blocking part of a connect attempt: resolve -> TCP -> CONNECT/CONNACK
+static void mqttConnectTask(void*) {
+  IPAddress ip;
+  if (!ip.fromString(mqttJob.host) && !WiFi.hostByName(mqttJob.host.c_str(), ip)) {
+    mqttConnectFail(MQ_RESOLVE);
+  }
+
+  // TLS connects by name: SNI and certificate verification need the host
+  mqttConn = MQ_TCP;
+  const bool connected = mqttJob.tls
+      ? wifiClientTls.connect(mqttJob.host.c_str(), mqttJob.port, MQTT_TCP_TIMEOUT_MS)
+      : wifiClient.connect(ip, mqttJob.port, MQTT_TCP_TIMEOUT_MS);
+  if (!connected) {
+    if (mqttJob.tls) {
+      char err[96];
+      wifiClientTls.lastError(err, sizeof(err));
+      LOGW("[MQTT] TLS: %s", err);
+    }
+    mqttConnectFail(MQ_TCP);
+  }
+
+  // PubSubClient reuses an already connected Client and only does CONNECT
+  mqttConn = MQ_HANDSHAKE;
+  mqtt.setServer(ip, mqttJob.port);
+
+  // Persistent session: the broker keeps our QoS 1 subscriptions and queues
+  // commands sent while we are away
+  mqttLink.armConnack();
+  const bool hasUser = mqttJob.user.length() > 0;
+  const bool ok = mqtt.connect(mqttJob.clientId.c_str(),
+                               hasUser ? mqttJob.user.c_str() : nullptr,
+                               hasUser ? mqttJob.pass.c_str() : nullptr,
+                               mqttJob.willTopic,  // LWT topic
+                               1,                  // qos
+                               true,               // retained
+                               "offline",          // LWT payload
+                               false);             // cleanSession
+
+  if (!ok) {
+    mqttLink.stop();
+    mqttConnectFail(MQ_HANDSHAKE);
+  }
+
+  mqttConn = MQ_SUBSCRIBE;
+  vTaskDelete(nullptr);
+}
+
+static void mqttStartAttempt() {
+  mqttJob.host      = mqttCfg.host;
+  mqttJob.port      = mqttCfg.port;
+  mqttJob.tls       = mqttCfg.tls;
+  mqttJob.user      = mqttCfg.user;
+  mqttJob.pass      = mqttCfg.pass;
+  mqttJob.clientId  = mdnsHost + "-" + String((uint32_t)ESP.getEfuseMac(), HEX);
+  memcpy(mqttJob.willTopic, topics.avail, TOPIC_MAX);
+
+  mqtt.setCallback(mqttCallback);
+  mqtt.setSocketTimeout(MQTT_SOCKET_TIMEOUT_S);
+  mqtt.setKeepAlive(MQTT_KEEPALIVE_S);
+  mqtt.setBufferSize(MQTT_BUFFER_SIZE);
+
+  if (mqttJob.tls) {
+    if (!loadMqttCa()) {
+      LOGE("[MQTT] TLS enabled but no CA certificate at %s", MQTT_CA_PATH);
+      mqttFailStage = MQ_IDLE;
+      mqttConn = MQ_FAILED;
+      return;
+    }
+    wifiClientTls.setCACert(mqttCaPem.c_str());
+    wifiClientTls.setHandshakeTimeout(MQTT_TLS_HANDSHAKE_S);
+    mqttLink.use(wifiClientTls);
+  } else {
+    mqttLink.use(wifiClient);
+  }
+
+  LOGI("[MQTT] Connecting to %s%s:%u user=%s base=%s (attempt %u)",
+       mqttJob.tls ? "tls://" : "",
+       mqttJob.host.c_str(),
+       mqttJob.port,
+       mqttJob.user.length() ? mqttJob.user.c_str() : "(none)",
+       topics.base,
+       (unsigned)mqttAttempts + 1);
+
+  mqttConn = MQ_RESOLVE;
+  const uint32_t stack = mqttJob.tls ? MQTT_WORKER_STACK_TLS : MQTT_WORKER_STACK;
+  if (xTaskCreatePinnedToCore(mqttConnectTask, "mqttConn", stack, nullptr,
+                              1, nullptr, 0) != pdPASS) {
+    mqttFailStage = MQ_IDLE;
+    mqttConn = MQ_FAILED;
+  }
+}
+
+// Full jitter: wait a random time in [0, min(cap, base * 2^attempts)], so a
+// fleet that lost the broker together does not come back in lockstep
+static void mqttScheduleRetry(uint32_t now) {
+  const uint32_t shift = min(mqttAttempts, (uint32_t)16);
+  const uint32_t window = min(MQTT_BACKOFF_CAP_MS, MQTT_BACKOFF_BASE_MS << shift);
+  const uint32_t waitMs = esp_random() % (window + 1);
+
+  mqttNextAttemptMs = now + waitMs;
+  mqttConn = MQ_BACKOFF;
+  LOGI("[MQTT] Retry in %u ms", (unsigned)waitMs);
+}
+
+static void mqttService() {
+  const uint32_t now = millis();
+  const uint8_t st = mqttConn;
+
+  if (haResend.exchange(false)) haMarkAll();
+
+  // Worker owns the client until it reports back
+  if (st >= MQ_RESOLVE && st <= MQ_HANDSHAKE) return;
+
+  if (st == MQ_FAILED) {
+    LOGW("[MQTT] Connect failed at %s, rc=%d", mqttStateStr(mqttFailStage), mqtt.state());
+    mqttScheduleRetry(now);
+    mqttAttempts++;
+    return;
+  }
+
+  if (mqttReconfigure.exchange(false)) {
+    if (mqtt.connected()) {
+      // Topics may change: drop the old subscriptions from the stored session
+      mqtt.unsubscribe(topics.relaySetWild);
+      mqtt.unsubscribe(topics.relaySetAll);
+      mqtt.unsubscribe(topics.ota);
+      mqtt.disconnect();
+    }
+    obSynced = false;
+    applyTopics();
+    mqttAttempts = 0;
+    mqttConn = MQ_IDLE;
+    return;
+  }
+
+  if (WiFi.status() != WL_CONNECTED || !mqttReady()) {
+    if (st != MQ_IDLE) {
+      if (mqtt.connected()) {
+        LOGI("%s", mqttCfg.enabled ? "[MQTT] Offline -> disconnect" : "[MQTT] Disabled -> disconnect");
+        mqtt.disconnect();
+      }
+      if (st == MQ_CONNECTED) mqttLostMs = now;
+      mqttConn = MQ_IDLE;
+    }
+    return;
+  }
+
+  switch (st) {
+    case MQ_IDLE:
+      mqttStartAttempt();
+      break;
+
+    case MQ_BACKOFF:
+      if ((int32_t)(now - mqttNextAttemptMs) >= 0) mqttStartAttempt();
+      break;
+
+    case MQ_SUBSCRIBE:
+      // Our own session from earlier in this boot: subscriptions are still there
+      mqttResumed = mqttLink.sessionPresent() && obSynced;
+      LOGI("[MQTT] Connected (%s).", mqttResumed ? "session resumed" : "new session");
+      if (mqttResumed) {
+        mqttConn = MQ_SNAPSHOT;
+        break;
+      }
+
+      // Subscribe to per-relay set topics (wildcard) and optional batch JSON.
+      // QoS 1 so the broker queues commands while the link is down.
+      mqtt.subscribe(topics.relaySetWild, 1);
+      mqtt.subscribe(topics.relaySetAll, 1);
+      mqtt.subscribe(topics.ota, 1);
+
+      LOGI("[MQTT] Subscribed: %s", topics.relaySetWild);
+      LOGI("[MQTT] Subscribed: %s", topics.relaySetAll);
+      LOGI("[MQTT] Subscribed: %s", topics.ota);
+      mqttConn = MQ_SNAPSHOT;
+      break;
+
+    case MQ_SNAPSHOT:
+      // Online + current states (retained), paced by outboxDrain(); after a
+      // resumed session only what changed (or may have been lost) goes out
+      outboxReset(mqttResumed);
+      obSynced = true;
+
+      mqttAttempts = 0;
+      mqttConn = MQ_CONNECTED;
+      break;
+
+    case MQ_CONNECTED:
+      if (!mqtt.connected()) {
+        // Jitter even the first reconnect: a broker restart drops everyone at once
+        LOGW("[MQTT] Connection lost, rc=%d", mqtt.state());
+        mqttLostMs = now;
+        mqttAttempts = 0;
+        mqttScheduleRetry(now);
+        break;
+      }
+      mqtt.loop();
+      break;
+
+    default:
+      break;
+  }
+}
+
+// -------------------- Web routes (AP mode) --------------------
+static const uint32_t AP_REBOOT_DELAY_MS = 500;  // the save reply goes out first
+
+static void setupRoutes_AP() {
+  // Captive portal probe endpoints
   server.on("/connecttest.txt", HTTP_ANY, [](AsyncWebServerRequest *r){ r->redirect("/"); });
   server.on("/ncc.txt",         HTTP_ANY, [](AsyncWebServerRequest *r){ r->redirect("/"); });
   server.on("/generate_204",    HTTP_ANY, [](AsyncWebServerRequest *r){ r->redirect("/"); });
@@ -560,44 +4544,42 @@ static void setupRoutes_AP() {
 
   // AP main page
   server.on("/", HTTP_GET, [](AsyncWebServerRequest *r){
-    r->send(LittleFS, "/www/ap.html", "text/html");
+    serveAsset(r, "/www/ap.html", "text/html");
   });
 
   // Minimal static assets for AP (IMPORTANT: do NOT expose full /www in AP mode)
   server.on("/style.css", HTTP_GET, [](AsyncWebServerRequest *r){
-    if (LittleFS.exists("/www/style.css")) r->send(LittleFS, "/www/style.css", "text/css");
-    else r->send(404, "text/plain", "missing");
+    serveAsset(r, "/www/style.css", "text/css");
   });
   server.on("/app.js", HTTP_GET, [](AsyncWebServerRequest *r){
-    if (LittleFS.exists("/www/app.js")) r->send(LittleFS, "/www/app.js", "application/javascript");
-    else r->send(404, "text/plain", "missing");
+    serveAsset(r, "/www/app.js", "application/javascript");
   });
 
   // Status endpoint for AP mode
   server.on("/api/status", HTTP_GET, [](AsyncWebServerRequest *r){
-    String json = "{\"ok\":true,\"mode\":\"ap\",\"mdns\":\"" + mdnsFqdn + "\"}";
-    r->send(200, "application/json", json);
+    StaticJsonDocument<128> d;
+    d["ok"] = true;
+    d["mode"] = "ap";
+    d["mdns"] = mdnsFqdn.c_str();
+    sendJson(r, d);
   });
 
-  // WiFi scan endpoint
+  // WiFi scan endpoint: cached results right away, refreshed in the background.
+  // ?refresh=1 forces a new scan.
   server.on("/api/scan", HTTP_GET, [](AsyncWebServerRequest *r){
-    Serial.println("[AP] Scanning WiFi networks...");
-    int n = WiFi.scanNetworks();
-    String json = "{\"networks\":[";
-    for (int i = 0; i < n; i++) {
-      if (i > 0) json += ",";
-      json += "{\"ssid\":\"" + WiFi.SSID(i) + "\",";
-      json += "\"rssi\":" + String(WiFi.RSSI(i)) + ",";
-      json += "\"encryption\":\"" + String(WiFi.encryptionType(i) == WIFI_AUTH_OPEN ? "OPEN" : "SECURE") + "\"}";
+    const bool stale = !scanHave || millis() - scanDoneMs > SCAN_MAX_AGE_MS;
+    if (stale || r->hasParam("refresh")) startWifiScan();
+
+    if (!scanHave) {
+      r->send(202, "application/json", "{\"ok\":true,\"scanning\":true,\"networks\":[]}");
+      return;
     }
-    json += "]}";
-    r->send(200, "application/json", json);
-    WiFi.scanDelete();
+    sendScanResults(r);
   });
 
   // WiFi save endpoint
   server.on("/api/wifi", HTTP_POST, [](AsyncWebServerRequest *r){
-    Serial.println("[AP] /api/wifi POST received");
+    LOGI("[AP] /api/wifi POST received");
 
     auto v = [&](const char* k)->String{
       if (r->hasParam(k, true)) return r->getParam(k, true)->value();
@@ -611,15 +4593,39 @@ static void setupRoutes_AP() {
       r->send(400, "application/json", "{\"ok\":false,\"err\":\"ssid_required\"}");
       return;
     }
+    WifiCfg next = wifiCfg;
+    next.ssid = ssid;
+    next.pass = pass;
+    CfgBody check;
+    if (!cfgFromRam(next, mqttCfg, check)) {
+      r->send(400, "application/json", "{\"ok\":false,\"err\":\"too_long\"}");
+      return;
+    }
+
+    // Optional static IP: all of ip/gw/mask must parse, dns defaults to gw
+    IPAddress ip, gw, mask, dnsIp;
+    const bool wantStatic = v("ip").length() > 0;
+    if (wantStatic) {
+      if (!ip.fromString(v("ip")) || !gw.fromString(v("gw")) || !mask.fromString(v("mask"))) {
+        r->send(400, "application/json", "{\"ok\":false,\"err\":\"invalid_ip\"}");
+        return;
+      }
+      if (!dnsIp.fromString(v("dns"))) dnsIp = gw;
+    }
 
     wifiCfg.ssid = ssid;
     wifiCfg.pass = pass;
+    wifiCfg.ip      = wantStatic ? (uint32_t)ip : 0;
+    wifiCfg.gateway = wantStatic ? (uint32_t)gw : 0;
+    wifiCfg.subnet  = wantStatic ? (uint32_t)mask : 0;
+    wifiCfg.dns     = wantStatic ? (uint32_t)dnsIp : 0;
     saveWifiCfg();
 
     r->send(200, "application/json", "{\"ok\":true,\"reboot\":true}");
-    delay(500);
-    Serial.println("[AP] Rebooting now...");
-    ESP.restart();
+    LOGI("[AP] Rebooting in %u ms...", (unsigned)AP_REBOOT_DELAY_MS);
+    // The net task journals the relays, flushes the settings and restarts
+    relayJournalDue = true;
+    otaRebootAtMs = (millis() + AP_REBOOT_DELAY_MS) | 1;
   });
 
   server.onNotFound([](AsyncWebServerRequest *r){
@@ -634,53 +4640,82 @@ static void setupRoutes_AP() {
 static void setupRoutes_STA() {
   server.on("/", HTTP_GET, [](AsyncWebServerRequest *r){
     if (!requireAuthOr401(r)) return;
-    r->send(LittleFS, "/www/index.html", "text/html");
+    serveAsset(r, "/www/index.html", "text/html");
   });
 
   server.on("/settings", HTTP_GET, [](AsyncWebServerRequest *r){
     if (!requireAuthOr401(r)) return;
-    r->send(LittleFS, "/www/settings.html", "text/html");
+    serveAsset(r, "/www/settings.html", "text/html");
   });
 
-  // Static under auth
+  // Static under auth (also picks up .gz variants)
   {
     auto &h = server.serveStatic("/", LittleFS, FS_ROOT);
+    h.setCacheControl(ASSET_CACHE_CTRL);
     h.setFilter([](AsyncWebServerRequest *r){
       return authOK(r);
     });
   }
 
-  // Status endpoint
+  // Live state push; a new client gets a full snapshot, then deltas
+  // Same check as every other route; the browser reuses the page's login
+  events.setFilter([](AsyncWebServerRequest *r){
+    return authOK(r);
+  });
+  events.onConnect([](AsyncEventSourceClient *c){
+    char buf[STATE_EVENT_MAX];
+    buildStateEvent(buf, sizeof(buf), ALL_RELAYS, ALL_INPUTS & ~counterMask);
+    c->send(buf, "state", eventSeq, 3000);
+  });
+  server.addHandler(&events);
+
+  // Status endpoint (dashboards poll this only as an SSE fallback)
   server.on("/api/status", HTTP_GET, [](AsyncWebServerRequest *r){
     if (!requireAuthOr401(r)) return;
+    MetricScope m(MT_HTTP);
 
-    StaticJsonDocument<768> d;
+    StaticJsonDocument<512 + JSON_ARRAY_SIZE(RELAY_COUNT) + JSON_ARRAY_SIZE(INPUT_COUNT) +
+                       JSON_OBJECT_SIZE(INPUT_COUNT) + INPUT_COUNT * (JSON_OBJECT_SIZE(2) + 4)> d;
     d["ok"] = true;
     d["mode"] = "sta";
     d["ip"] = WiFi.localIP().toString();
-    d["mdns"] = mdnsFqdn;
+    d["mdns"] = mdnsFqdn.c_str();
     d["rssi"] = WiFi.RSSI();
 
     JsonArray relaysArray = d.createNestedArray("relays");
-    for (int i = 0; i < 4; i++) relaysArray.add(relayState[i]);
+    for (size_t i = 0; i < RELAY_COUNT; i++) relaysArray.add(relays.get(i));
 
     // Report closed/open explicitly
     JsonArray inputsClosed = d.createNestedArray("inputs_closed");
-    for (int i = 0; i < 4; i++) inputsClosed.add(inputs[i].stable == LOW);
+    for (size_t i = 0; i < INPUT_COUNT; i++) inputsClosed.add(inputs.closed(i));
+
+    // Counter-mode inputs: {"3":{"total":1234,"rate":0.5}}
+    if (counterMask) {
+      JsonObject cnt = d.createNestedObject("counters");
+      for (size_t i = 0; i < INPUT_COUNT; i++) {
+        if (!(counterMask & (1u << i))) continue;
+        uint64_t total;
+        float rate;
+        counterRead(i, total, rate);
+        JsonObject c = cnt.createNestedObject(String(i + 1));
+        c["total"] = total;
+        c["rate"] = rate;
+      }
+    }
 
     d["mqtt_enabled"] = mqttCfg.enabled;
-    d["mqtt_connected"] = mqtt.connected();
-    d["mqtt_base"] = baseTopic;
-    d["mqtt_availability"] = tAvail;
+    d["mqtt_connected"] = (mqttConn == MQ_CONNECTED);
+    d["mqtt_state"] = mqttStateStr(mqttConn);
+    d["mqtt_base"] = topics.base;
+    d["mqtt_availability"] = topics.avail;
 
-    String out;
-    serializeJson(d, out);
-    r->send(200, "application/json", out);
+    sendJson(r, d);
   });
 
   // Relay control endpoint (form)
   server.on("/api/relay", HTTP_POST, [](AsyncWebServerRequest *r){
     if (!requireAuthOr401(r)) return;
+    MetricScope m(MT_HTTP);
 
     if (!r->hasParam("relay", true) || !r->hasParam("state", true)) {
       r->send(400, "application/json", "{\"ok\":false,\"err\":\"missing_params\"}");
@@ -688,51 +4723,100 @@ static void setupRoutes_STA() {
     }
 
     int relayNum = r->getParam("relay", true)->value().toInt() - 1;
-    if (relayNum < 0 || relayNum >= 4) {
+    if (relayNum < 0 || relayNum >= (int)RELAY_COUNT) {
       r->send(400, "application/json", "{\"ok\":false,\"err\":\"invalid_relay\"}");
       return;
     }
 
+    // Same vocabulary as MQTT: ON/OFF/1/0/TRUE/FALSE/TOGGLE/PULSE:<ms>
     const String s = r->getParam("state", true)->value();
-    bool on = (s == "1" || s.equalsIgnoreCase("on") || s.equalsIgnoreCase("true"));
-    setRelay(relayNum, on);
+    bool on = false, isToggle = false;
+    uint32_t pulseMs;
+    if (!parseOnOffToggle(s, on, isToggle, pulseMs)) {
+      r->send(400, "application/json", "{\"ok\":false,\"err\":\"invalid_state\"}");
+      return;
+    }
+    if (!postRelaySet(httpCmdRing, relayNum, on, isToggle, pulseMs)) {
+      r->send(503, "application/json", "{\"ok\":false,\"err\":\"busy\"}");
+      return;
+    }
     r->send(200, "application/json", "{\"ok\":true}");
   });
 
   // Batch relay control (JSON form field "states": {"1":"ON","2":"OFF"...}
   server.on("/api/relays", HTTP_POST, [](AsyncWebServerRequest *r){
     if (!requireAuthOr401(r)) return;
+    MetricScope m(MT_HTTP);
 
     if (!r->hasParam("states", true)) {
       r->send(400, "application/json", "{\"ok\":false,\"err\":\"missing_states\"}");
       return;
     }
 
-    String statesJson = r->getParam("states", true)->value();
-    StaticJsonDocument<256> doc;
-    DeserializationError error = deserializeJson(doc, statesJson);
-
-    if (error) {
+    const String &statesJson = r->getParam("states", true)->value();
+    RelayBatch b;
+    if (!parseRelayBatch(statesJson.c_str(), statesJson.length(), b)) {
       r->send(400, "application/json", "{\"ok\":false,\"err\":\"invalid_json\"}");
       return;
     }
 
-    for (int i = 0; i < 4; i++) {
-      char key[2]; sprintf(key, "%d", i + 1);
-      if (!doc.containsKey(key)) continue;
-      String val = doc[key].as<String>();
-      bool on = false, isToggle = false;
-      if (!parseOnOffToggle(val, on, isToggle)) continue;
-      if (isToggle) toggleRelay(i);
-      else setRelay(i, on);
+    if (!postRelayBatch(httpCmdRing, b)) {
+      r->send(503, "application/json", "{\"ok\":false,\"err\":\"busy\"}");
+      return;
+    }
+
+    r->send(200, "application/json", "{\"ok\":true}");
+  });
+
+  // Web login: {"ok":true,"user":"admin","factory":true}
+  server.on("/api/auth", HTTP_GET, [](AsyncWebServerRequest *r){
+    if (!requireAuthOr401(r)) return;
+    MetricScope m(MT_HTTP);
+
+    StaticJsonDocument<128> d;
+    d["ok"] = true;
+    d["user"] = authCfg.user;
+    d["factory"] = authCfg.factory;
+    sendJson(r, d);
+  });
+
+  // Form fields current, pass, user (absent = keep). The current password is
+  // required even though the request is authenticated, so a cross-site form
+  // riding on cached Basic credentials cannot change it.
+  server.on("/api/auth", HTTP_POST, [](AsyncWebServerRequest *r){
+    if (!requireAuthOr401(r)) return;
+    MetricScope m(MT_HTTP);
+
+    const String current = r->hasParam("current", true) ? r->getParam("current", true)->value() : String();
+    const String pass = r->hasParam("pass", true) ? r->getParam("pass", true)->value() : String();
+    const String user = r->hasParam("user", true) ? r->getParam("user", true)->value() : authCfg.user;
+
+    if (!authCheckPassword(current.c_str(), current.length())) {
+      r->send(403, "application/json", "{\"ok\":false,\"err\":\"wrong_password\"}");
+      return;
+    }
+    if (!user.length() || user.length() > AUTH_USER_MAX || user.indexOf(':') >= 0) {
+      r->send(400, "application/json", "{\"ok\":false,\"err\":\"invalid_user\"}");
+      return;
+    }
+    if (pass.length() < AUTH_PASS_MIN || pass.length() > AUTH_HEADER_MAX / 2) {
+      r->send(400, "application/json", "{\"ok\":false,\"err\":\"weak_password\"}");
+      return;
     }
 
+    if (!saveAuthCfg(user, pass)) {
+      LOGE("[AUTH] Credentials not saved, NVS write failed");
+      r->send(500, "application/json", "{\"ok\":false,\"err\":\"nvs_write\"}");
+      return;
+    }
+    LOGI("[AUTH] Credentials changed, user=%s", user.c_str());
     r->send(200, "application/json", "{\"ok\":true}");
   });
 
   // MQTT GET
   server.on("/api/mqtt", HTTP_GET, [](AsyncWebServerRequest *r){
     if (!requireAuthOr401(r)) return;
+    MetricScope m(MT_HTTP);
 
     StaticJsonDocument<640> d;
     d["ok"] = true;
@@ -741,61 +4825,685 @@ static void setupRoutes_STA() {
     d["port"] = mqttCfg.port;
     d["user"] = mqttCfg.user;
     d["pass_set"] = mqttCfg.pass.length() > 0;
+    d["rate"] = mqttCfg.rate;
+    d["stateFormat"] = mqttCfg.stateFormat == SF_JSON ? "json" : mqttCfg.stateFormat == SF_BINARY ? "binary" : "topics";
+    d["tls"] = mqttCfg.tls;
+    d["ca_set"] = LittleFS.exists(MQTT_CA_PATH);
+    d["ha"] = mqttCfg.haDiscovery;
+    d["ha_pending"] = haUnsent;
 
     // In per-relay mode, cmdTopic is the base topic:
     d["baseTopic"] = mqttCfg.cmdTopic;
 
     // helpful derived topic examples
-    d["availTopic"] = tAvail;
+    d["availTopic"] = topics.avail;
     d["relay1_set"] = relaySetTopic(0);
     d["relay1_state"] = relayStateTopic(0);
     d["input1_state"] = inputStateTopic(0);
 
-    String out;
-    serializeJson(d, out);
-    r->send(200, "application/json", out);
+    sendJson(r, d);
   });
 
   // MQTT POST
   server.on("/api/mqtt", HTTP_POST, [](AsyncWebServerRequest *r){
     if (!requireAuthOr401(r)) return;
+    MetricScope m(MT_HTTP);
 
     auto v = [&](const char* k)->String{
       if (r->hasParam(k, true)) return r->getParam(k, true)->value();
       return "";
     };
 
+    MqttCfg next = mqttCfg;
     const String enS = v("enabled");
-    mqttCfg.enabled = (enS == "1" || enS.equalsIgnoreCase("true") || enS.equalsIgnoreCase("on"));
+    next.enabled = (enS == "1" || enS.equalsIgnoreCase("true") || enS.equalsIgnoreCase("on"));
 
-    mqttCfg.host = v("host");
+    next.host = v("host");
 
     long p = v("port").toInt();
     if (p <= 0 || p > 65535) p = 1883;
-    mqttCfg.port = (uint16_t)p;
+    next.port = (uint16_t)p;
+
+    // Absent = keep; older settings pages do not send these
+    if (r->hasParam("rate", true)) {
+      long rate = v("rate").toInt();
+      next.rate = (uint16_t)constrain(rate, 0L, 1000L);
+    }
+    if (r->hasParam("stateFormat", true)) {
+      const String f = v("stateFormat");
+      next.stateFormat = f == "json" ? SF_JSON : f == "binary" ? SF_BINARY : SF_TOPICS;
+    }
+    if (r->hasParam("tls", true)) {
+      const String t = v("tls");
+      next.tls = (t == "1" || t.equalsIgnoreCase("true") || t.equalsIgnoreCase("on"));
+    }
+    if (r->hasParam("ha", true)) {
+      const String h = v("ha");
+      next.haDiscovery = (h == "1" || h.equalsIgnoreCase("true") || h.equalsIgnoreCase("on"));
+    }
 
-    mqttCfg.user = v("user");
+    next.user = v("user");
     const String pass = v("pass");
-    if (pass.length()) mqttCfg.pass = pass;
+    if (pass.length()) next.pass = pass;
 
     // IMPORTANT: cmdTopic is BASE TOPIC in per-relay mode
-    mqttCfg.cmdTopic = v("cmdTopic");
-    mqttCfg.stateTopic = v("stateTopic"); // unused, kept
+    next.cmdTopic = v("cmdTopic");
+    next.stateTopic = v("stateTopic"); // unused, kept
 
+    CfgBody check;
+    if (!cfgFromRam(wifiCfg, next, check)) {
+      r->send(400, "application/json", "{\"ok\":false,\"err\":\"too_long\"}");
+      return;
+    }
+
+    // Broker CA (PEM): absent = keep, empty = remove. Checked before anything
+    // is stored, so a rejected upload leaves the rest of the config untouched
+    if (r->hasParam("ca", true)) {
+      const String ca = v("ca");
+      if (!ca.length()) {
+        LittleFS.remove(MQTT_CA_PATH);
+      } else if (ca.length() > MQTT_CA_MAX || ca.indexOf("-----BEGIN CERTIFICATE-----") < 0) {
+        r->send(400, "application/json", "{\"ok\":false,\"err\":\"invalid_ca\"}");
+        return;
+      } else {
+        File f = LittleFS.open(MQTT_CA_PATH, "w");
+        if (!f || f.print(ca) != ca.length()) {
+          r->send(500, "application/json", "{\"ok\":false,\"err\":\"fs_write\"}");
+          return;
+        }
+      }
+    }
+    // Republish discovery even though nothing changed (broker lost its retained store)
+    if (v("ha_resend") == "1") haResend = true;
+
+    mqttCfg = next;
     saveMqttCfg();
-    applyTopics();
 
-    // force reconnect with new config
-    if (mqtt.connected()) mqtt.disconnect();
+    // re-derive topics and reconnect with new config (handled by mqttService() in loop)
+    mqttReconfigure = true;
+
+    r->send(200, "application/json", "{\"ok\":true}");
+  });
+
+  // Combined settings, as stored: {"ok":true,"version":2,"bytes":N,"writes":N,"pending":false,
+  //   "wifi":{"ssid":..,"pass_set":true,"ip":"","gw":"","mask":"","dns":"","channel":6},
+  //   "mqtt":{"enabled":..,"host":..,"port":1883,"user":..,"pass_set":..,"base":..,
+  //           "rate":20,"stateFormat":"topics","tls":false,"ha":true}}
+  server.on("/api/config", HTTP_GET, [](AsyncWebServerRequest *r){
+    if (!requireAuthOr401(r)) return;
+    MetricScope m(MT_HTTP);
+
+    auto ip = [](uint32_t a) { return a ? IPAddress(a).toString() : String(); };
+    StaticJsonDocument<1024> d;
+    d["ok"] = true;
+    d["version"] = CFG_VERSION;
+    d["bytes"] = CFG_BLOB_MAX;
+    d["writes"] = cfgWrites.load();
+    d["pending"] = cfgDirty.load();
+    JsonObject w = d.createNestedObject("wifi");
+    w["ssid"] = wifiCfg.ssid;
+    w["pass_set"] = wifiCfg.pass.length() > 0;
+    w["ip"] = ip(wifiCfg.ip);
+    w["gw"] = ip(wifiCfg.gateway);
+    w["mask"] = ip(wifiCfg.subnet);
+    w["dns"] = ip(wifiCfg.dns);
+    w["channel"] = wifiCfg.channel;
+    JsonObject q = d.createNestedObject("mqtt");
+    q["enabled"] = mqttCfg.enabled;
+    q["host"] = mqttCfg.host;
+    q["port"] = mqttCfg.port;
+    q["user"] = mqttCfg.user;
+    q["pass_set"] = mqttCfg.pass.length() > 0;
+    q["base"] = mqttCfg.cmdTopic;
+    q["rate"] = mqttCfg.rate;
+    q["stateFormat"] = mqttCfg.stateFormat == SF_JSON ? "json" : mqttCfg.stateFormat == SF_BINARY ? "binary" : "topics";
+    q["tls"] = mqttCfg.tls;
+    q["ha"] = mqttCfg.haDiscovery;
+    sendJson(r, d);
+  });
+
+  // config=<json> in the GET shape ("pass" instead of "pass_set"); absent
+  // keys keep their value, an empty "pass" keeps the stored one. Checked as a
+  // whole, then stored as one blob. WiFi changes apply at the next boot.
+  server.on("/api/config", HTTP_POST, [](AsyncWebServerRequest *r){
+    if (!requireAuthOr401(r)) return;
+    MetricScope m(MT_HTTP);
+
+    if (!r->hasParam("config", true)) {
+      r->send(400, "application/json", "{\"ok\":false,\"err\":\"missing_config\"}");
+      return;
+    }
+    DynamicJsonDocument doc(1536);
+    if (deserializeJson(doc, r->getParam("config", true)->value()) || !doc.is<JsonObject>()) {
+      r->send(400, "application/json", "{\"ok\":false,\"err\":\"invalid_json\"}");
+      return;
+    }
+
+    auto str = [](JsonVariantConst x, String& out, bool keepEmpty) {
+      if (x.isNull()) return true;
+      if (!x.is<const char*>()) return false;
+      const char* s = x.as<const char*>();
+      if (*s || !keepEmpty) out = s;
+      return true;
+    };
+    auto flag = [](JsonVariantConst x, bool& out) {
+      if (x.isNull()) return true;
+      if (!x.is<bool>()) return false;
+      out = x.as<bool>();
+      return true;
+    };
+    auto num = [](JsonVariantConst x, long lo, long hi, long& out) {
+      if (x.isNull()) return true;
+      if (!x.is<long>() || x.as<long>() < lo || x.as<long>() > hi) return false;
+      out = x.as<long>();
+      return true;
+    };
+    auto ipv4 = [](JsonVariantConst x, uint32_t& out) {
+      if (x.isNull()) return true;
+      if (!x.is<const char*>()) return false;
+      const char* s = x.as<const char*>();
+      IPAddress a;
+      if (!*s) a = IPAddress((uint32_t)0);
+      else if (!a.fromString(s)) return false;
+      out = (uint32_t)a;
+      return true;
+    };
+
+    WifiCfg w = wifiCfg;
+    MqttCfg q = mqttCfg;
+    JsonVariantConst jw = doc["wifi"];
+    JsonVariantConst jq = doc["mqtt"];
+    long port = q.port, rate = q.rate;
+    String fmt;
+    bool ok = str(jw["ssid"], w.ssid, false) && str(jw["pass"], w.pass, true) &&
+              ipv4(jw["ip"], w.ip) && ipv4(jw["gw"], w.gateway) &&
+              ipv4(jw["mask"], w.subnet) && ipv4(jw["dns"], w.dns) &&
+              flag(jq["enabled"], q.enabled) && str(jq["host"], q.host, false) &&
+              num(jq["port"], 1, 65535, port) && str(jq["user"], q.user, false) &&
+              str(jq["pass"], q.pass, true) && str(jq["base"], q.cmdTopic, false) &&
+              num(jq["rate"], 0, 1000, rate) && str(jq["stateFormat"], fmt, false) &&
+              flag(jq["tls"], q.tls) && flag(jq["ha"], q.haDiscovery);
+    if (fmt.length()) {
+      ok &= fmt == "topics" || fmt == "json" || fmt == "binary";
+      q.stateFormat = fmt == "json" ? SF_JSON : fmt == "binary" ? SF_BINARY : SF_TOPICS;
+    }
+    if (!ok) {
+      r->send(400, "application/json", "{\"ok\":false,\"err\":\"invalid_value\"}");
+      return;
+    }
+    q.port = (uint16_t)port;
+    q.rate = (uint16_t)rate;
+    if (!w.ssid.length()) {
+      r->send(400, "application/json", "{\"ok\":false,\"err\":\"ssid_required\"}");
+      return;
+    }
+    if (w.ip && (!w.gateway || !w.subnet)) {
+      r->send(400, "application/json", "{\"ok\":false,\"err\":\"invalid_ip\"}");
+      return;
+    }
+    if (w.ip && !w.dns) w.dns = w.gateway;
+    if (!w.ip) w.gateway = w.subnet = w.dns = 0;
+
+    CfgBody next, cur;
+    if (!cfgFromRam(w, q, next)) {
+      r->send(400, "application/json", "{\"ok\":false,\"err\":\"too_long\"}");
+      return;
+    }
+    cfgFromRam(wifiCfg, mqttCfg, cur);
+    // WiFi fields come first in the blob, then MQTT from mqttEnabled to powerProfile
+    const size_t split = offsetof(CfgBody, mqttEnabled);
+    const bool wifiChanged = memcmp(&next, &cur, split) != 0;
+    const bool mqttChanged = memcmp((const uint8_t*)&next + split, (const uint8_t*)&cur + split,
+                                    offsetof(CfgBody, powerProfile) - split) != 0;
+
+    if (wifiChanged) {
+      wifiCfg = w;
+      saveWifiCfg();  // also drops the cached AP
+    }
+    if (mqttChanged) {
+      mqttCfg = q;
+      saveMqttCfg();
+      mqttReconfigure = true;
+    }
+    r->send(200, "application/json", wifiChanged ? "{\"ok\":true,\"reboot_required\":true}" : "{\"ok\":true}");
+  });
+
+  // Rule table as stored (or the built-in default)
+  server.on("/api/rules", HTTP_GET, [](AsyncWebServerRequest *r){
+    if (!requireAuthOr401(r)) return;
+    MetricScope m(MT_HTTP);
+
+    if (LittleFS.exists(RULES_PATH)) {
+      r->send(LittleFS, RULES_PATH, "application/json");
+      return;
+    }
+    String out;
+    defaultRulesJson(out);
+    r->send(200, "application/json", out);
+  });
+
+  // Form field "rules": {"rules":[...]}. Compiled, then saved (temp file +
+  // rename), then swapped in: a bad table or a failed write leaves the
+  // running and the stored rules as they were. "reset=1" restores the default.
+  server.on("/api/rules", HTTP_POST, [](AsyncWebServerRequest *r){
+    if (!requireAuthOr401(r)) return;
+    MetricScope m(MT_HTTP);
+
+    String json;
+    const bool reset = r->hasParam("reset", true) && r->getParam("reset", true)->value() == "1";
+    if (reset) {
+      defaultRulesJson(json);
+    } else if (r->hasParam("rules", true)) {
+      json = r->getParam("rules", true)->value();
+    } else {
+      r->send(400, "application/json", "{\"ok\":false,\"err\":\"missing_rules\"}");
+      return;
+    }
+    if (json.length() > RULES_JSON_MAX) {
+      r->send(400, "application/json", "{\"ok\":false,\"err\":\"too_large\"}");
+      return;
+    }
+
+    static RuleTable next;  // async_tcp only
+    const char* err = nullptr;
+    if (!parseRules(json.c_str(), json.length(), next, err)) {
+      r->send(400, "application/json", String("{\"ok\":false,\"err\":\"") + err + "\"}");
+      return;
+    }
+
+    bool saved;
+    if (reset) {
+      saved = !LittleFS.exists(RULES_PATH) || LittleFS.remove(RULES_PATH);
+    } else {
+      File f = LittleFS.open(RULES_TMP_PATH, "w");
+      saved = f && f.print(json) == json.length();
+      if (f) f.close();
+      saved = saved && LittleFS.rename(RULES_TMP_PATH, RULES_PATH);
+      if (!saved) LittleFS.remove(RULES_TMP_PATH);
+    }
+    if (!saved) {
+      r->send(500, "application/json", "{\"ok\":false,\"err\":\"fs_write\"}");
+      return;
+    }
+    installRules(next);
+    r->send(200, "application/json", "{\"ok\":true}");
+  });
+
+  // ESP-NOW: {"ok":true,"enabled":true,"key_set":true,"channel":6,
+  //            "groups":[{"group":5,"relays":3}],"rx":0,"tx":0,"rejected":0}
+  server.on("/api/espnow", HTTP_GET, [](AsyncWebServerRequest *r){
+    if (!requireAuthOr401(r)) return;
+    MetricScope m(MT_HTTP);
+
+    const EspNowCfg c = espnowCfgSnapshot();
+    StaticJsonDocument<256 + ESPNOW_GROUPS_MAX * JSON_OBJECT_SIZE(2)> d;
+    d["ok"] = true;
+    d["enabled"] = c.enabled;
+    d["active"] = espnowActive.load();
+    d["key_set"] = c.key.length() > 0;
+    d["channel"] = WiFi.channel();
+    JsonArray groups = d.createNestedArray("groups");
+    for (uint8_t i = 0; i < c.nGroups; i++) {
+      JsonObject g = groups.createNestedObject();
+      g["group"] = c.groups[i].group;
+      g["relays"] = c.groups[i].relays;
+    }
+    d["rx"] = espnowRx.load();
+    d["tx"] = espnowTx.load();
+    d["rejected"] = espnowRejected.load();
+    sendJson(r, d);
+  });
+
+  // Form fields (absent = keep): enabled, key (8..64 chars, shared by the
+  // whole installation), groups=[{"group":5,"relays":3},...] (relay bitmask)
+  server.on("/api/espnow", HTTP_POST, [](AsyncWebServerRequest *r){
+    if (!requireAuthOr401(r)) return;
+    MetricScope m(MT_HTTP);
+
+    EspNowCfg next = espnowCfgSnapshot();
+    if (r->hasParam("enabled", true)) {
+      const String en = r->getParam("enabled", true)->value();
+      next.enabled = (en == "1" || en.equalsIgnoreCase("true") || en.equalsIgnoreCase("on"));
+    }
+    if (r->hasParam("key", true)) {
+      next.key = r->getParam("key", true)->value();
+      if (next.key.length() < ESPNOW_KEY_MIN || next.key.length() > ESPNOW_KEY_MAX) {
+        r->send(400, "application/json", "{\"ok\":false,\"err\":\"invalid_key\"}");
+        return;
+      }
+    }
+    if (r->hasParam("groups", true)) {
+      StaticJsonDocument<128 + ESPNOW_GROUPS_MAX * JSON_OBJECT_SIZE(2)> doc;
+      const String& json = r->getParam("groups", true)->value();
+      if (deserializeJson(doc, json) || !doc.is<JsonArray>() || doc.as<JsonArrayConst>().size() > ESPNOW_GROUPS_MAX) {
+        r->send(400, "application/json", "{\"ok\":false,\"err\":\"invalid_groups\"}");
+        return;
+      }
+      next.nGroups = 0;
+      for (JsonObjectConst o : doc.as<JsonArrayConst>()) {
+        const uint32_t g = o["group"] | 0u;
+        if (g < 1 || g > 255) {
+          r->send(400, "application/json", "{\"ok\":false,\"err\":\"invalid_groups\"}");
+          return;
+        }
+        next.groups[next.nGroups].group = g;
+        next.groups[next.nGroups].relays = (o["relays"] | 0u) & ALL_RELAYS;
+        next.nGroups++;
+      }
+    }
+    if (next.enabled && next.key.length() < ESPNOW_KEY_MIN) {
+      r->send(400, "application/json", "{\"ok\":false,\"err\":\"key_required\"}");
+      return;
+    }
+
+    // The receive callback reads espnowCfg, so the net task reloads it from
+    // NVS after stopping ESP-NOW
+    saveEspNowCfg(next);
+    espnowReconfigure = true;
+    r->send(200, "application/json", "{\"ok\":true}");
+  });
+
+  // UDP control: {"ok":true,"enabled":true,"active":true,"port":5005,"key_set":true,
+  //               "rx":0,"rejected":0,"stale":0,"busy":0}
+  server.on("/api/udp", HTTP_GET, [](AsyncWebServerRequest *r){
+    if (!requireAuthOr401(r)) return;
+    MetricScope m(MT_HTTP);
+
+    UdpCfg c;
+    loadUdpCfg(c);
+    StaticJsonDocument<256> d;
+    d["ok"] = true;
+    d["enabled"] = c.enabled;
+    d["active"] = udpActive.load();
+    d["port"] = c.port;
+    d["key_set"] = c.key.length() > 0;
+    d["rx"] = udpRx.load();
+    d["rejected"] = udpRejected.load();
+    d["stale"] = udpStale.load();
+    d["busy"] = udpBusy.load();
+    sendJson(r, d);
+  });
+
+  // Form fields (absent = keep): enabled, port (1..65535), key (16..64 chars)
+  server.on("/api/udp", HTTP_POST, [](AsyncWebServerRequest *r){
+    if (!requireAuthOr401(r)) return;
+    MetricScope m(MT_HTTP);
+
+    UdpCfg next;
+    loadUdpCfg(next);
+    if (r->hasParam("enabled", true)) {
+      const String en = r->getParam("enabled", true)->value();
+      next.enabled = (en == "1" || en.equalsIgnoreCase("true") || en.equalsIgnoreCase("on"));
+    }
+    if (r->hasParam("port", true)) {
+      const long port = r->getParam("port", true)->value().toInt();
+      if (port < 1 || port > 65535) {
+        r->send(400, "application/json", "{\"ok\":false,\"err\":\"invalid_port\"}");
+        return;
+      }
+      next.port = (uint16_t)port;
+    }
+    if (r->hasParam("key", true)) {
+      next.key = r->getParam("key", true)->value();
+      if (next.key.length() < UDP_KEY_MIN || next.key.length() > UDP_KEY_MAX) {
+        r->send(400, "application/json", "{\"ok\":false,\"err\":\"invalid_key\"}");
+        return;
+      }
+    }
+    if (next.enabled && next.key.length() < UDP_KEY_MIN) {
+      r->send(400, "application/json", "{\"ok\":false,\"err\":\"key_required\"}");
+      return;
+    }
+
+    // The udp task reloads from NVS after closing its socket
+    saveUdpCfg(next);
+    udpReconfigure = true;
+    r->send(200, "application/json", "{\"ok\":true}");
+  });
+
+  // {"ok":true,"profile":"balanced","profiles":[...],"dfs":false,"light_sleep":false,
+  //  "wifi_ps":"min_modem","cpu_mhz":240,"net_tick_ms":10,"input_latency_ms":52}
+  server.on("/api/power", HTTP_GET, [](AsyncWebServerRequest *r){
+    if (!requireAuthOr401(r)) return;
+    MetricScope m(MT_HTTP);
+
+    static const char* const PS_NAME[] = {"none", "min_modem", "max_modem"};
+    StaticJsonDocument<384> d;
+    d["ok"] = true;
+    d["profile"] = POWER_PROFILES[powerProfile].name;
+    JsonArray names = d.createNestedArray("profiles");
+    for (const PowerProfileDef& p : POWER_PROFILES) names.add(p.name);
+    d["dfs"] = powerDfs.load();
+    d["light_sleep"] = powerLightSleep.load();
+    d["wifi_ps"] = PS_NAME[powerWifiPs()];
+    d["cpu_mhz"] = getCpuFrequencyMhz();
+    d["net_tick_ms"] = netTickMs.load();
+    d["input_latency_ms"] = INPUT_DEBOUNCE_MS + POWER_WAKE_MS;  // local input -> relay bound
+    sendJson(r, d);
+  });
+
+  // profile=performance|balanced|low; stored, applied by the net task right away
+  server.on("/api/power", HTTP_POST, [](AsyncWebServerRequest *r){
+    if (!requireAuthOr401(r)) return;
+    MetricScope m(MT_HTTP);
+
+    const int p = r->hasParam("profile", true) ? powerParse(r->getParam("profile", true)->value()) : -1;
+    if (p < 0) {
+      r->send(400, "application/json", "{\"ok\":false,\"err\":\"invalid_profile\"}");
+      return;
+    }
+    powerProfile = (uint8_t)p;
+    cfgSave();
+    powerReconfigure = true;
+    r->send(200, "application/json", "{\"ok\":true}");
+  });
+
+  // Input modes: {"ok":true,"filter":1023,"inputs":["switch","counter",...]}
+  server.on("/api/counters", HTTP_GET, [](AsyncWebServerRequest *r){
+    if (!requireAuthOr401(r)) return;
+    MetricScope m(MT_HTTP);
+
+    StaticJsonDocument<96 + JSON_ARRAY_SIZE(INPUT_COUNT)> d;
+    d["ok"] = true;
+    d["filter"] = counterFilter;
+    JsonArray modes = d.createNestedArray("inputs");
+    for (size_t i = 0; i < INPUT_COUNT; i++) modes.add((counterMask & (1u << i)) ? "counter" : "switch");
+    sendJson(r, d);
+  });
+
+  // input=<1..N>, then any of: mode=switch|counter and filter=<0..1023 APB
+  // cycles> (both stored, applied at the next boot), reset=1 (zero the total now)
+  server.on("/api/counters", HTTP_POST, [](AsyncWebServerRequest *r){
+    if (!requireAuthOr401(r)) return;
+    MetricScope m(MT_HTTP);
+
+    Preferences p;
+    p.begin("pcnt", true);
+    uint32_t mask = p.getUInt("mask", counterMask);
+    uint16_t filter = p.getUShort("filt", counterFilter);
+    p.end();
+
+    bool reboot = false;
+    if (r->hasParam("filter", true)) {
+      const long f = r->getParam("filter", true)->value().toInt();
+      if (f < 0 || f > PCNT_FILTER_MAX) {
+        r->send(400, "application/json", "{\"ok\":false,\"err\":\"invalid_filter\"}");
+        return;
+      }
+      filter = (uint16_t)f;
+      reboot = true;
+    }
+
+    if (r->hasParam("input", true)) {
+      const long n = r->getParam("input", true)->value().toInt();
+      if (n < 1 || n > (long)INPUT_COUNT) {
+        r->send(400, "application/json", "{\"ok\":false,\"err\":\"invalid_input\"}");
+        return;
+      }
+      const uint32_t bit = 1u << (n - 1);
+      if (r->hasParam("mode", true)) {
+        const String mode = r->getParam("mode", true)->value();
+        if (mode == "counter")     mask |= bit;
+        else if (mode == "switch") mask &= ~bit;
+        else {
+          r->send(400, "application/json", "{\"ok\":false,\"err\":\"invalid_mode\"}");
+          return;
+        }
+        reboot = true;
+      }
+      if (r->hasParam("reset", true) && r->getParam("reset", true)->value() == "1") counterReset(n - 1);
+    }
+
+    if (reboot) saveCounterCfg(mask, filter);
+    r->send(200, "application/json", reboot ? "{\"ok\":true,\"reboot_required\":true}" : "{\"ok\":true}");
+  });
+
+  // Power-on mode per relay: {"ok":true,"modes":["last","off",...]}
+  server.on("/api/poweron", HTTP_GET, [](AsyncWebServerRequest *r){
+    if (!requireAuthOr401(r)) return;
+    MetricScope m(MT_HTTP);
+
+    StaticJsonDocument<64 + JSON_ARRAY_SIZE(RELAY_COUNT)> d;
+    d["ok"] = true;
+    JsonArray modes = d.createNestedArray("modes");
+    for (size_t i = 0; i < RELAY_COUNT; i++) modes.add(powerOnModeStr(powerOnMode[i]));
+
+    sendJson(r, d);
+  });
+
+  // Form: relay=<1..N|all>&mode=<off|on|last>
+  server.on("/api/poweron", HTTP_POST, [](AsyncWebServerRequest *r){
+    if (!requireAuthOr401(r)) return;
+    MetricScope m(MT_HTTP);
+
+    if (!r->hasParam("relay", true) || !r->hasParam("mode", true)) {
+      r->send(400, "application/json", "{\"ok\":false,\"err\":\"missing_params\"}");
+      return;
+    }
+
+    uint8_t mode;
+    if (!parsePowerOnMode(r->getParam("mode", true)->value(), mode)) {
+      r->send(400, "application/json", "{\"ok\":false,\"err\":\"invalid_mode\"}");
+      return;
+    }
+
+    const String relayS = r->getParam("relay", true)->value();
+    if (relayS.equalsIgnoreCase("all")) {
+      memset(powerOnMode, mode, sizeof(powerOnMode));
+    } else {
+      const int relayNum = relayS.toInt() - 1;
+      if (relayNum < 0 || relayNum >= (int)RELAY_COUNT) {
+        r->send(400, "application/json", "{\"ok\":false,\"err\":\"invalid_relay\"}");
+        return;
+      }
+      powerOnMode[relayNum] = mode;
+    }
 
+    // A newly "last" channel is journaled by relayJournalService() on its next pass
+    saveRelayPowerOn();
     r->send(200, "application/json", "{\"ok\":true}");
   });
 
+  // Prometheus text exposition of the latency histograms and heap gauges
+  server.on("/api/metrics", HTTP_GET, [](AsyncWebServerRequest *r){
+    if (!requireAuthOr401(r)) return;
+
+    AsyncResponseStream *res = r->beginResponseStream("text/plain; version=0.0.4");
+    writeMetricsProm(*res);
+    r->send(res);
+  });
+
+#if S4N_LOG_TAIL
+  // Recent log lines as text, "<seq> <ms> <E|W|I|D> <line>"; ?since=<seq>
+  // returns only newer ones (X-Log-Next is the value to pass next time)
+  server.on("/api/log", HTTP_GET, [](AsyncWebServerRequest *r){
+    if (!requireAuthOr401(r)) return;
+    MetricScope m(MT_HTTP);
+
+    const uint32_t since = r->hasParam("since") ? (uint32_t)r->getParam("since")->value().toInt() : 0;
+    static const char LEVEL_CHAR[] = "?EWID";
+
+    AsyncResponseStream* res = r->beginResponseStream("text/plain");
+    logTailMux.lock();
+    const uint32_t end = logTailSeq;
+    uint32_t seq = end > LOG_TAIL_LINES ? end - LOG_TAIL_LINES : 0;
+    if (since > seq) seq = min(since, end);
+    for (; seq < end; seq++) {
+      const LogRecord &t = logTail[seq % LOG_TAIL_LINES];
+      res->printf("%u %u %c %.*s\n", (unsigned)t.seq, (unsigned)t.ms,
+                  LEVEL_CHAR[min<uint8_t>(t.level, 4)], (int)t.len, t.text);
+    }
+    logTailMux.unlock();
+    res->addHeader("X-Log-Next", String(end));
+    res->addHeader("Cache-Control", "no-store");
+    r->send(res);
+  });
+#endif
+
+  // Image upload, streamed to flash as it arrives:
+  //   curl -u admin:<pass> -F image=@firmware.bin
+  //        "http://<node>/api/ota?target=app&sha256=$(sha256sum firmware.bin | cut -c1-64)"
+  // target=fs takes the LittleFS image (pio run -t buildfs). GET reports progress.
+  server.on("/api/ota", HTTP_GET, [](AsyncWebServerRequest *r){
+    if (!requireAuthOr401(r)) return;
+    char buf[192];
+    otaStatusJson(buf, sizeof(buf));
+    r->send(200, "application/json", buf);
+  });
+
+  server.on("/api/ota", HTTP_POST, [](AsyncWebServerRequest *r){
+    if (!requireAuthOr401(r)) return;
+
+    otaLock.lock();
+    const bool mine = otaJob.owner == r;
+    if (mine && otaPhase == OTA_WRITING) otaFailLocked("truncated");  // body ended without the final chunk
+    const uint8_t phase = otaPhase;
+    const size_t bytes = otaJob.written;
+    const char* err = otaErr;
+    if (mine) otaJob.owner = nullptr;
+    otaLock.unlock();
+
+    uint8_t want[32], target;
+    if (!r->hasParam("sha256") || !parseHex(r->getParam("sha256")->value().c_str(), want, sizeof(want))) {
+      r->send(400, "application/json", "{\"ok\":false,\"err\":\"bad_sha256\"}");
+    } else if (!parseOtaTarget(r->hasParam("target") ? r->getParam("target")->value().c_str() : "", target)) {
+      r->send(400, "application/json", "{\"ok\":false,\"err\":\"bad_target\"}");
+    } else if (!mine) {
+      r->send(phase == OTA_WRITING ? 409 : 400, "application/json",
+              phase == OTA_WRITING ? "{\"ok\":false,\"err\":\"busy\"}" : "{\"ok\":false,\"err\":\"missing_image\"}");
+    } else if (phase != OTA_DONE) {
+      char buf[64];
+      snprintf(buf, sizeof(buf), "{\"ok\":false,\"err\":\"%s\"}", err);
+      r->send(400, "application/json", buf);
+    } else {
+      char buf[96];
+      snprintf(buf, sizeof(buf), "{\"ok\":true,\"target\":\"%s\",\"bytes\":%u,\"reboot\":true}",
+               otaTargetName(target), (unsigned)bytes);
+      r->send(200, "application/json", buf);
+    }
+  }, [](AsyncWebServerRequest *r, const String&, size_t index, uint8_t *data, size_t len, bool final){
+    if (index == 0) {
+      uint8_t want[32], target;
+      if (!authOK(r)) return;
+      if (!r->hasParam("sha256") || !parseHex(r->getParam("sha256")->value().c_str(), want, sizeof(want))) return;
+      if (!parseOtaTarget(r->hasParam("target") ? r->getParam("target")->value().c_str() : "", target)) return;
+      const char* err = otaBegin(target, 0, want, r);
+      if (err) {
+        LOGW("[OTA] upload refused: %s", err);
+        return;
+      }
+      r->onDisconnect([r]{ otaAbort(r, "disconnected"); });
+    }
+    if (len && !otaWrite(r, data, len)) return;
+    if (final) otaFinish(r);
+  });
+
   server.begin();
   Serial.println("[STA] Web server started (Basic Auth ON).");
 }
 
 // -------------------- FS listing (debug) --------------------
+#if S4N_FS_DEBUG
 static void listFiles(const char* dirname) {
   File root = LittleFS.open(dirname);
   if (!root || !root.isDirectory()) {
@@ -809,103 +5517,127 @@ static void listFiles(const char* dirname) {
     file = root.openNextFile();
   }
 }
+#endif
 
 // -------------------- setup/loop --------------------
 enum Mode { MODE_AP, MODE_STA };
 Mode modeNow = MODE_AP;
 
+// Network task
+// Everything that talks to a socket. Wakes every netTickMs (the power
+// profile's tick) for the MQTT keepalive and incoming commands, or right away
+// when the control side marked something dirty.
+static void netTask(void*) {
+  for (;;) {
+    if (modeNow == MODE_AP) {
+      dns.processNextRequest();
+      scanService();
+      relayJournalService(millis());  // inputs still switch relays while provisioning
+      otaService(millis());
+      cfgFlush(false);
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(NET_TICK_MS));
+      continue;
+    }
+
+    {
+      MetricScope m(MT_LOOP);
+      const uint32_t now = millis();
+
+      mqttService();
+      espnowService();
+      counterService(now);
+      otaService(now);
+
+      if (now - lastMetricsPublishMs >= METRICS_PUBLISH_MS) {
+        lastMetricsPublishMs = now;
+        outboxMark(OB_METRICS);
+      }
+
+      // Inputs are handled by the control task; only their MQTT/SSE publishes land here
+      outboxDrain(now);
+      pushPendingEvents();
+      relayJournalService(now);
+      cfgFlush(false);
+      powerService();
+    }
+
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(netTickMs.load()));
+  }
+}
+
+static void startNetTask() {
+  xTaskCreatePinnedToCore(netTask, "net", NET_TASK_STACK, nullptr,
+                          NET_TASK_PRIO, &netTaskHandle, NET_TASK_CORE);
+}
+
 void setup() {
+  // Outputs first: drive the relays to their power-on state before anything
+  // slow, so recovery after a reset never waits on WiFi or the broker
+  const uint32_t bootRelays = loadRelayPowerOn();
+  relays.begin(bootRelays);
+
   Serial.begin(115200);
-  delay(200);
   Serial.println();
   Serial.println("=== Switch4Node boot ===");
+  startLogTask();
 
   WiFi.onEvent(onWiFiEvent);
 
-  // Initialize relay pins (avoid calling setRelay() before MQTT is connected)
-  for (int i = 0; i < 4; i++) {
-    pinMode(relayPins[i], OUTPUT);
-    relayState[i] = false;
-    const int level = RELAY_ACTIVE_LOW ? HIGH : LOW;
-    digitalWrite(relayPins[i], level);
-  }
-
   // Initialize input pins
-  for (int i = 0; i < 4; i++) {
-    pinMode(inputPins[i], INPUT_PULLUP);
-    inputs[i].last_read = digitalRead(inputPins[i]);
-    inputs[i].stable = inputs[i].last_read;
-    inputs[i].last_change_ms = millis();
-  }
+  inputs.begin();
+  startPulseTimers();
+  startControlTask();
+  startCounters();
+  startInputCapture();
+  startOta();
+
+  Serial.printf("[IO] %u relays, %u inputs, power-on state=0x%X\n",
+                (unsigned)RELAY_COUNT, (unsigned)INPUT_COUNT, (unsigned)bootRelays);
 
   if (!LittleFS.begin(true)) {
     Serial.println("[FS] LittleFS mount failed (formatted if needed).");
   } else {
     Serial.println("[FS] LittleFS mounted.");
+#if S4N_FS_DEBUG
     listFiles("/");
     listFiles("/www");
+#endif
+    loadAssetEtags();
   }
 
+  startRules();
+
   deviceId = macToDeviceId();
   shortId  = macSuffix6();
   mdnsHost = "switch4node-" + shortId;
   mdnsFqdn = mdnsHost + ".local";
 
-  loadWifiCfg();
-  loadMqttCfg();
+  loadConfig();
+  loadAuthCfg();
+  startEspNow();
 
   Serial.println("[ID] Device ID: " + deviceId);
   Serial.println("[ID] mDNS host:  " + mdnsHost);
-  Serial.println(String("[AUTH] ") + (BASIC_AUTH_ON ? "ENABLED" : "disabled") + " user=" + BASIC_USER);
+  Serial.println(String("[AUTH] ") + (BASIC_AUTH_ON ? "ENABLED" : "disabled") + " user=" + authCfg.user +
+                 (authCfg.factory ? " (factory password, change it on /settings)" : ""));
 
   if (connectSTA(20000)) {
     modeNow = MODE_STA;
     Serial.println("[WiFi] STA connected, IP: " + WiFi.localIP().toString());
     startMDNS();
     setupRoutes_STA();
+    startUdp();
   } else {
     modeNow = MODE_AP;
     startAPPortal();
     setupRoutes_AP();
+    startWifiScan();  // results are usually ready before the first phone asks
   }
+
+  startNetTask();
 }
 
+// All work lives in the control and network tasks
 void loop() {
-  if (modeNow == MODE_AP) {
-    dns.processNextRequest();
-    delay(10);
-    return;
-  }
-
-  mqttEnsureConnected();
-  mqtt.loop();
-
-  // Check all 4 inputs with debouncing
-  uint32_t now = millis();
-
-  for (int i = 0; i < 4; i++) {
-    int level = digitalRead(inputPins[i]);
-
-    if (level != inputs[i].last_read) {
-      inputs[i].last_read = level;
-      inputs[i].last_change_ms = now;
-    }
-
-    if ((now - inputs[i].last_change_ms) > INPUT_DEBOUNCE_MS && inputs[i].stable != inputs[i].last_read) {
-      inputs[i].stable = inputs[i].last_read;
-
-      const bool closed = (inputs[i].stable == LOW); // LOW = contact closed
-      Serial.printf("[DIN %d] stable -> %s\n", i + 1, closed ? "CLOSED(LOW)" : "OPEN(HIGH)");
-
-      // Publish input state (per-input topic, retained)
-      publishInputStateOne(i);
-
-      // Toggle corresponding relay on press/close (LOW)
-      if (closed) {
-        toggleRelay(i);
-      }
-    }
-  }
-
-  delay(10);
-}
\ No newline at end of file
+  vTaskDelete(nullptr);
+}
@@ -0,0 +1,171 @@
+// Micro-benchmarks for the hot paths: MQTT topic match, payload and batch
+// parsing, topic rebuild and the debounce pass. Prints one line per case:
+//   BENCH <name> <ns>/op <allocs>/op
+// With S4N_COUNT_ALLOCS (see [alloc_count] in platformio.ini) every
+// allocation is counted and each case must stay at zero.
+#include <unity.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include "debounce.h"
+#include "relay_parse.h"
+#include "topic_table.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#include "esp_timer.h"
+static const uint32_t ITERS = 5000;
+static uint64_t nowNs() { return (uint64_t)esp_timer_get_time() * 1000; }
+#else
+#include <chrono>
+static const uint32_t ITERS = 200000;
+static uint64_t nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+// -------------------- Allocation counter --------------------
+static std::atomic<uint32_t> allocCount{0};
+
+#ifdef S4N_COUNT_ALLOCS
+extern "C" {
+void* __real_malloc(size_t n);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* p, size_t n);
+
+void* __wrap_malloc(size_t n) { allocCount++; return __real_malloc(n); }
+void* __wrap_calloc(size_t n, size_t size) { allocCount++; return __real_calloc(n, size); }
+void* __wrap_realloc(void* p, size_t n) { allocCount++; return __real_realloc(p, n); }
+}
+
+// libstdc++ may reach malloc from outside the wrapped objects
+void* operator new(size_t n) {
+  void* p = malloc(n ? n : 1);
+  if (!p) abort();
+  return p;
+}
+void* operator new[](size_t n) { return operator new(n); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+#endif
+
+// Defeats dead-code elimination of the measured results
+static volatile uint32_t sink;
+
+template <class F>
+static void bench(const char* name, F fn) {
+  fn();  // warm caches (and any lazy init) outside the measurement
+
+  const uint32_t a0 = allocCount.load();
+  const uint64_t t0 = nowNs();
+  for (uint32_t i = 0; i < ITERS; i++) fn();
+  const uint64_t dt = nowNs() - t0;
+  const uint32_t allocs = allocCount.load() - a0;
+
+  char line[96];
+  snprintf(line, sizeof(line), "BENCH %-24s %9.1f ns/op %6.2f allocs/op",
+           name, (double)dt / ITERS, (double)allocs / ITERS);
+  TEST_MESSAGE(line);
+#ifdef S4N_COUNT_ALLOCS
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, allocs, name);
+#endif
+}
+
+// -------------------- Cases --------------------
+// Sized like the largest shipped variant (16 relays / 8 inputs)
+using Table = TopicTableOf<16, 8>;
+using Batch = RelayBatchOf<16>;
+static Table topics;
+
+void setUp() { buildTopics(topics, "home/relays", strlen("home/relays")); }
+void tearDown() {}
+
+static void bench_match_relay_set_topic() {
+  static const char hit[]  = "home/relays/relay/12/set";
+  static const char miss[] = "home/relays/relay/12/state";
+  bench("matchRelaySetTopic", [] {
+    sink = matchRelaySetTopic(topics, hit, sizeof(hit) - 1) +
+           matchRelaySetTopic(topics, miss, sizeof(miss) - 1);
+  });
+}
+
+static void bench_parse_on_off_toggle() {
+  static const char* const payloads[] = {"ON", "off", "TOGGLE", "PULSE:1500"};
+  static size_t lens[4];
+  for (size_t i = 0; i < 4; i++) lens[i] = strlen(payloads[i]);
+  bench("parseOnOffToggle", [] {
+    bool on = false, tgl = false;
+    uint32_t ms = 0, acc = 0;
+    for (size_t i = 0; i < 4; i++) {
+      acc += parseOnOffToggle(payloads[i], lens[i], on, tgl, ms) + on + tgl + ms;
+    }
+    sink = acc;
+  });
+}
+
+static void bench_parse_batch_keys() {
+  static const char json[] =
+    "{\"1\":\"ON\",\"2\":\"OFF\",\"3\":\"TOGGLE\",\"4\":\"PULSE:500\","
+    "\"5\":1,\"6\":0,\"7\":true,\"8\":false}";
+  bench("parseRelayBatch/keys", [] {
+    Batch b;
+    parseRelayBatch(json, sizeof(json) - 1, b);
+    sink = b.set ^ b.clr ^ b.tgl ^ b.pulse;
+  });
+}
+
+static void bench_parse_batch_compact() {
+  static const char json[] = "{\"set\":4660,\"clr\":43690,\"tgl\":1}";
+  bench("parseRelayBatch/compact", [] {
+    Batch b;
+    parseRelayBatch(json, sizeof(json) - 1, b);
+    sink = b.set ^ b.clr ^ b.tgl;
+  });
+}
+
+static void bench_build_topics() {
+  bench("buildTopics", [] {
+    buildTopics(topics, "home/relays", 11);
+    sink = topics.relaySetAllLen;
+  });
+}
+
+// One control-task pass over 8 inputs, half of them mid-debounce
+static void bench_debounce_pass() {
+  static DebouncedInput in[8];
+  static uint32_t now;
+  bench("debounceStep x8", [] {
+    now += 7;
+    uint32_t waitMs = UINT32_MAX, settled = 0;
+    for (size_t i = 0; i < 8; i++) {
+      if (i & 1) debounceEdge(in[i], (now / 64) & 1, now);
+      settled += debounceStep(in[i], now, 50, [] { return (int)((now / 64) & 1); }, waitMs);
+    }
+    sink = settled + waitMs;
+  });
+}
+
+static int runUnityTests() {
+  UNITY_BEGIN();
+  RUN_TEST(bench_match_relay_set_topic);
+  RUN_TEST(bench_parse_on_off_toggle);
+  RUN_TEST(bench_parse_batch_keys);
+  RUN_TEST(bench_parse_batch_compact);
+  RUN_TEST(bench_build_topics);
+  RUN_TEST(bench_debounce_pass);
+  return UNITY_END();
+}
+
+#ifdef ARDUINO
+void setup() {
+  delay(2000);  // let the monitor attach
+  runUnityTests();
+}
+void loop() {}
+#else
+int main() { return runUnityTests(); }
+#endif
@@ -0,0 +1,148 @@
+// Settings blob: encode/decode round trip, integrity checks, layout growth
+#include <unity.h>
+#include <string.h>
+#include "config_blob.h"
+
+void setUp() {}
+void tearDown() {}
+
+static uint8_t blob[CFG_BLOB_MAX + 16];
+
+static CfgBody sample() {
+  CfgBody b = cfgDefaults();
+  cfgSetStr(b.wifiSsid, "lab", 3);
+  cfgSetStr(b.mqttHost, "broker.lan", 10);
+  cfgSetStr(b.mqttBase, "home/relays", 11);
+  b.wifiIp = 0x3201A8C0;
+  b.wifiChannel = 6;
+  b.mqttEnabled = 1;
+  b.mqttPort = 8883;
+  return b;
+}
+
+static void test_crc32_check_value() {
+  TEST_ASSERT_EQUAL_HEX32(0xCBF43926, cfgCrc32((const uint8_t*)"123456789", 9));
+}
+
+static void test_round_trip() {
+  const CfgBody in = sample();
+  const size_t n = cfgEncode(in, blob);
+  TEST_ASSERT_EQUAL_UINT32(CFG_BLOB_MAX, n);
+
+  CfgBody out = cfgDefaults();
+  TEST_ASSERT_EQUAL_UINT8(CFG_OK, cfgDecode(blob, n, out));
+  TEST_ASSERT_EQUAL_MEMORY(&in, &out, sizeof(in));
+  TEST_ASSERT_EQUAL_STRING("broker.lan", out.mqttHost);
+}
+
+// Same settings, same bytes: the writer skips NVS when nothing changed
+static void test_equal_settings_encode_equal() {
+  CfgBody a = sample(), b = sample();
+  TEST_ASSERT_TRUE(cfgSetStr(a.mqttUser, "a-much-longer-user", 18));
+  TEST_ASSERT_TRUE(cfgSetStr(a.mqttUser, "bob", 3));
+  TEST_ASSERT_TRUE(cfgSetStr(b.mqttUser, "bob", 3));
+  uint8_t other[CFG_BLOB_MAX];
+  cfgEncode(a, blob);
+  cfgEncode(b, other);
+  TEST_ASSERT_EQUAL_MEMORY(other, blob, CFG_BLOB_MAX);
+}
+
+static void test_set_str_rejects_long() {
+  CfgBody b = cfgDefaults();
+  char ssid[34];
+  memset(ssid, 'x', sizeof(ssid));
+  TEST_ASSERT_FALSE(cfgSetStr(b.wifiSsid, ssid, 33));
+  TEST_ASSERT_EQUAL_STRING("", b.wifiSsid);
+  TEST_ASSERT_TRUE(cfgSetStr(b.wifiSsid, ssid, 32));
+  TEST_ASSERT_EQUAL_UINT32(32, strlen(b.wifiSsid));
+}
+
+static void test_rejects_damage() {
+  const size_t n = cfgEncode(sample(), blob);
+  CfgBody out = cfgDefaults();
+  TEST_ASSERT_EQUAL_UINT8(CFG_EMPTY, cfgDecode(blob, 0, out));
+  TEST_ASSERT_EQUAL_UINT8(CFG_BAD_SIZE, cfgDecode(blob, 5, out));
+  TEST_ASSERT_EQUAL_UINT8(CFG_BAD_SIZE, cfgDecode(blob, n - 1, out));
+
+  blob[sizeof(CfgHeader) + 40] ^= 0x01;
+  TEST_ASSERT_EQUAL_UINT8(CFG_BAD_CRC, cfgDecode(blob, n, out));
+  blob[sizeof(CfgHeader) + 40] ^= 0x01;
+
+  blob[0] ^= 0xFF;
+  TEST_ASSERT_EQUAL_UINT8(CFG_BAD_MAGIC, cfgDecode(blob, n, out));
+  blob[0] ^= 0xFF;
+
+  // Nothing was taken from the rejected blobs
+  TEST_ASSERT_EQUAL_UINT16(1883, out.mqttPort);
+  TEST_ASSERT_EQUAL_UINT8(CFG_OK, cfgDecode(blob, n, out));
+}
+
+// Re-seal the first `size` body bytes as if an older/newer layout wrote them
+static size_t reseal(size_t size) {
+  CfgHeader h;
+  memcpy(&h, blob, sizeof(h));
+  h.size = size;
+  h.crc = cfgCrc32(blob + sizeof(h), size);
+  memcpy(blob, &h, sizeof(h));
+  return sizeof(h) + size;
+}
+
+static void test_older_layout_keeps_new_defaults() {
+  CfgBody in = sample();
+  in.mqttHa = 0;
+  cfgEncode(in, blob);
+  // A layout that ended before mqttHa
+  const size_t n = reseal(offsetof(CfgBody, mqttHa));
+
+  CfgBody out = cfgDefaults();
+  TEST_ASSERT_EQUAL_UINT8(CFG_OK, cfgDecode(blob, n, out));
+  TEST_ASSERT_EQUAL_UINT16(8883, out.mqttPort);
+  TEST_ASSERT_EQUAL_UINT8(1, out.mqttHa);
+}
+
+// A v1 blob (ends at mqttHa) upgrades to the balanced power profile
+static void test_v1_blob_defaults_power_profile() {
+  CfgBody in = sample();
+  in.powerProfile = 2;
+  cfgEncode(in, blob);
+  const size_t n = reseal(offsetof(CfgBody, powerProfile));
+
+  CfgBody out = cfgDefaults();
+  TEST_ASSERT_EQUAL_UINT8(CFG_OK, cfgDecode(blob, n, out));
+  TEST_ASSERT_EQUAL_UINT8(in.mqttHa, out.mqttHa);
+  TEST_ASSERT_EQUAL_UINT8(1, out.powerProfile);
+}
+
+static void test_newer_layout_is_cut() {
+  cfgEncode(sample(), blob);
+  memset(blob + CFG_BLOB_MAX, 0xAB, 16);  // fields appended by a later build
+  const size_t n = reseal(sizeof(CfgBody) + 16);
+
+  CfgBody out = cfgDefaults();
+  TEST_ASSERT_EQUAL_UINT8(CFG_OK, cfgDecode(blob, n, out));
+  TEST_ASSERT_EQUAL_STRING("home/relays", out.mqttBase);
+}
+
+static int runUnityTests() {
+  UNITY_BEGIN();
+  RUN_TEST(test_crc32_check_value);
+  RUN_TEST(test_round_trip);
+  RUN_TEST(test_equal_settings_encode_equal);
+  RUN_TEST(test_set_str_rejects_long);
+  RUN_TEST(test_rejects_damage);
+  RUN_TEST(test_older_layout_keeps_new_defaults);
+  RUN_TEST(test_v1_blob_defaults_power_profile);
+  RUN_TEST(test_newer_layout_is_cut);
+  return UNITY_END();
+}
+
+#ifdef ARDUINO
+#include <Arduino.h>
+void setup() {
+  delay(2000);  // let the monitor attach
+  runUnityTests();
+}
+void loop() {}
+#else
+int main() { return runUnityTests(); }
+#endif
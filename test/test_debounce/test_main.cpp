@@ -0,0 +1,134 @@
+// Debounce state machine with a scripted pin level
+#include <unity.h>
+#include <stdint.h>
+#include "debounce.h"
+
+void setUp() {}
+void tearDown() {}
+
+static const uint32_t DEBOUNCE_MS = 50;
+static const int OPEN = 1, CLOSED = 0;
+
+static int pinLevel;
+static int pinReads;
+static int readPin() { pinReads++; return pinLevel; }
+
+static DebouncedInput idleInput(int level, uint32_t t) {
+  pinLevel = level;
+  pinReads = 0;
+  return DebouncedInput{level, level, t};
+}
+
+static bool step(DebouncedInput& in, uint32_t now, uint32_t& waitMs) {
+  return debounceStep(in, now, DEBOUNCE_MS, readPin, waitMs);
+}
+
+static void test_idle_does_nothing() {
+  DebouncedInput in = idleInput(OPEN, 0);
+  uint32_t waitMs = UINT32_MAX;
+  TEST_ASSERT_FALSE(step(in, 1000, waitMs));
+  TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, waitMs);
+  TEST_ASSERT_EQUAL_INT(0, pinReads);
+}
+
+static void test_commit_after_quiet_period() {
+  DebouncedInput in = idleInput(OPEN, 0);
+  debounceEdge(in, CLOSED, 100);
+  pinLevel = CLOSED;
+
+  uint32_t waitMs = UINT32_MAX;
+  TEST_ASSERT_FALSE(step(in, 120, waitMs));
+  TEST_ASSERT_EQUAL_UINT32(DEBOUNCE_MS + 1 - 20, waitMs);
+  TEST_ASSERT_EQUAL_INT(0, pinReads);
+
+  // Exactly DEBOUNCE_MS is not enough, one more ms is
+  waitMs = UINT32_MAX;
+  TEST_ASSERT_FALSE(step(in, 150, waitMs));
+  TEST_ASSERT_EQUAL_UINT32(1, waitMs);
+  TEST_ASSERT_TRUE(step(in, 151, waitMs));
+  TEST_ASSERT_EQUAL_INT(CLOSED, in.stable);
+  TEST_ASSERT_EQUAL_INT(1, pinReads);
+
+  // Settled: nothing more to do
+  waitMs = UINT32_MAX;
+  TEST_ASSERT_FALSE(step(in, 500, waitMs));
+  TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, waitMs);
+}
+
+static void test_bounce_restarts_period() {
+  DebouncedInput in = idleInput(OPEN, 0);
+  debounceEdge(in, CLOSED, 100);
+  debounceEdge(in, OPEN, 110);
+  debounceEdge(in, CLOSED, 130);
+  debounceEdge(in, CLOSED, 140);  // same level: no restart
+  pinLevel = CLOSED;
+
+  uint32_t waitMs = UINT32_MAX;
+  TEST_ASSERT_FALSE(step(in, 170, waitMs));
+  TEST_ASSERT_EQUAL_UINT32(DEBOUNCE_MS + 1 - 40, waitMs);
+  TEST_ASSERT_TRUE(step(in, 181, waitMs));
+  TEST_ASSERT_EQUAL_INT(CLOSED, in.stable);
+}
+
+// Short glitch whose release edge was dropped: the pin read wins
+static void test_dropped_edge_reverts() {
+  DebouncedInput in = idleInput(OPEN, 0);
+  debounceEdge(in, CLOSED, 100);
+  pinLevel = OPEN;
+
+  uint32_t waitMs = UINT32_MAX;
+  TEST_ASSERT_FALSE(step(in, 200, waitMs));
+  TEST_ASSERT_EQUAL_INT(OPEN, in.stable);
+  TEST_ASSERT_EQUAL_INT(OPEN, in.last_read);
+  TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, waitMs);
+
+  waitMs = UINT32_MAX;
+  TEST_ASSERT_FALSE(step(in, 300, waitMs));
+  TEST_ASSERT_EQUAL_INT(1, pinReads);
+}
+
+static void test_millis_wraparound() {
+  DebouncedInput in = idleInput(OPEN, UINT32_MAX - 10);
+  debounceEdge(in, CLOSED, UINT32_MAX - 10);
+  pinLevel = CLOSED;
+
+  uint32_t waitMs = UINT32_MAX;
+  TEST_ASSERT_FALSE(step(in, 20, waitMs));
+  TEST_ASSERT_EQUAL_UINT32(DEBOUNCE_MS + 1 - 31, waitMs);
+  TEST_ASSERT_TRUE(step(in, 41, waitMs));
+}
+
+// waitMs is the minimum over every input of one pass
+static void test_wait_is_minimum() {
+  DebouncedInput a = idleInput(OPEN, 0);
+  DebouncedInput b = idleInput(OPEN, 0);
+  debounceEdge(a, CLOSED, 100);
+  debounceEdge(b, CLOSED, 130);
+
+  uint32_t waitMs = UINT32_MAX;
+  step(b, 140, waitMs);
+  step(a, 140, waitMs);
+  TEST_ASSERT_EQUAL_UINT32(DEBOUNCE_MS + 1 - 40, waitMs);
+}
+
+static int runUnityTests() {
+  UNITY_BEGIN();
+  RUN_TEST(test_idle_does_nothing);
+  RUN_TEST(test_commit_after_quiet_period);
+  RUN_TEST(test_bounce_restarts_period);
+  RUN_TEST(test_dropped_edge_reverts);
+  RUN_TEST(test_millis_wraparound);
+  RUN_TEST(test_wait_is_minimum);
+  return UNITY_END();
+}
+
+#ifdef ARDUINO
+#include <Arduino.h>
+void setup() {
+  delay(2000);  // let the monitor attach
+  runUnityTests();
+}
+void loop() {}
+#else
+int main() { return runUnityTests(); }
+#endif
@@ -0,0 +1,184 @@
+// Relay command parsing: single values and the batch JSON forms
+#include <unity.h>
+#include <string.h>
+#include "relay_parse.h"
+
+void setUp() {}
+void tearDown() {}
+
+static bool parse(const char* s, bool& on, bool& tgl, uint32_t& ms) {
+  on = false;
+  return parseOnOffToggle(s, strlen(s), on, tgl, ms);
+}
+
+static void test_on_off_words() {
+  bool on, tgl;
+  uint32_t ms;
+  const char* onWords[]  = {"ON", "on", "1", "TRUE", "true", "  On\r\n"};
+  const char* offWords[] = {"OFF", "off", "0", "FALSE", "\tfalse "};
+  for (const char* w : onWords) {
+    TEST_ASSERT_TRUE_MESSAGE(parse(w, on, tgl, ms), w);
+    TEST_ASSERT_TRUE(on);
+    TEST_ASSERT_FALSE(tgl);
+    TEST_ASSERT_EQUAL_UINT32(0, ms);
+  }
+  for (const char* w : offWords) {
+    TEST_ASSERT_TRUE_MESSAGE(parse(w, on, tgl, ms), w);
+    TEST_ASSERT_FALSE(on);
+    TEST_ASSERT_FALSE(tgl);
+  }
+}
+
+static void test_toggle() {
+  bool on, tgl;
+  uint32_t ms;
+  TEST_ASSERT_TRUE(parse("toggle", on, tgl, ms));
+  TEST_ASSERT_TRUE(tgl);
+  TEST_ASSERT_EQUAL_UINT32(0, ms);
+}
+
+static void test_pulse() {
+  bool on, tgl;
+  uint32_t ms;
+  TEST_ASSERT_TRUE(parse("PULSE:500", on, tgl, ms));
+  TEST_ASSERT_TRUE(on);
+  TEST_ASSERT_EQUAL_UINT32(500, ms);
+  TEST_ASSERT_TRUE(parse("pulse:3600000", on, tgl, ms));
+  TEST_ASSERT_EQUAL_UINT32(PULSE_MAX_MS, ms);
+
+  TEST_ASSERT_FALSE(parse("PULSE:", on, tgl, ms));
+  TEST_ASSERT_FALSE(parse("PULSE:0", on, tgl, ms));
+  TEST_ASSERT_FALSE(parse("PULSE:3600001", on, tgl, ms));
+  TEST_ASSERT_FALSE(parse("PULSE:99999999999", on, tgl, ms));
+  TEST_ASSERT_FALSE(parse("PULSE:12a", on, tgl, ms));
+  TEST_ASSERT_FALSE(parse("PULSE:-5", on, tgl, ms));
+}
+
+static void test_rejects_garbage() {
+  bool on, tgl;
+  uint32_t ms;
+  TEST_ASSERT_FALSE(parse("", on, tgl, ms));
+  TEST_ASSERT_FALSE(parse("   ", on, tgl, ms));
+  TEST_ASSERT_FALSE(parse("ONN", on, tgl, ms));
+  TEST_ASSERT_FALSE(parse("2", on, tgl, ms));
+  TEST_ASSERT_FALSE(parse("maybe", on, tgl, ms));
+}
+
+// MQTT payloads are not NUL terminated: only len bytes may be looked at
+static void test_span_not_terminated() {
+  bool on = false, tgl;
+  uint32_t ms;
+  const char buf[] = {'O', 'N', 'X', 'X'};
+  TEST_ASSERT_TRUE(parseOnOffToggle(buf, 2, on, tgl, ms));
+  TEST_ASSERT_TRUE(on);
+  const char pulse[] = {'P', 'U', 'L', 'S', 'E', ':', '2', '5', '9'};
+  TEST_ASSERT_TRUE(parseOnOffToggle(pulse, 8, on, tgl, ms));
+  TEST_ASSERT_EQUAL_UINT32(25, ms);
+}
+
+static bool batch4(const char* json, RelayBatchOf<4>& b) {
+  return parseRelayBatch(json, strlen(json), b);
+}
+
+static void test_batch_keys() {
+  RelayBatchOf<4> b;
+  TEST_ASSERT_TRUE(batch4("{\"1\":\"ON\",\"2\":\"OFF\",\"3\":\"TOGGLE\",\"4\":\"PULSE:250\"}", b));
+  TEST_ASSERT_EQUAL_HEX32(0x1, b.set);
+  TEST_ASSERT_EQUAL_HEX32(0x2, b.clr);
+  TEST_ASSERT_EQUAL_HEX32(0x4, b.tgl);
+  TEST_ASSERT_EQUAL_HEX32(0x8, b.pulse);
+  TEST_ASSERT_EQUAL_UINT32(250, b.pulseMs[3]);
+}
+
+static void test_batch_value_types() {
+  RelayBatchOf<4> b;
+  TEST_ASSERT_TRUE(batch4("{\"1\":1,\"2\":0,\"3\":true,\"4\":false}", b));
+  TEST_ASSERT_EQUAL_HEX32(0x5, b.set);
+  TEST_ASSERT_EQUAL_HEX32(0xA, b.clr);
+}
+
+static void test_batch_skips_invalid() {
+  RelayBatchOf<4> b;
+  TEST_ASSERT_TRUE(batch4("{\"1\":\"bogus\",\"2\":7,\"5\":\"ON\",\"x\":\"ON\",\"4\":\"on\"}", b));
+  TEST_ASSERT_EQUAL_HEX32(0x8, b.set);
+  TEST_ASSERT_EQUAL_HEX32(0, b.clr | b.tgl | b.pulse);
+}
+
+static void test_batch_compact() {
+  RelayBatchOf<4> b;
+  TEST_ASSERT_TRUE(batch4("{\"r\":5}", b));
+  TEST_ASSERT_EQUAL_HEX32(0x5, b.set);
+  TEST_ASSERT_EQUAL_HEX32(0xA, b.clr);
+  TEST_ASSERT_EQUAL_HEX32(0, b.tgl);
+
+  TEST_ASSERT_TRUE(batch4("{\"set\":1,\"tgl\":6}", b));
+  TEST_ASSERT_EQUAL_HEX32(0x1, b.set);
+  TEST_ASSERT_EQUAL_HEX32(0, b.clr);
+  TEST_ASSERT_EQUAL_HEX32(0x6, b.tgl);
+
+  // Bits past the channel count are dropped
+  TEST_ASSERT_TRUE(batch4("{\"r\":255,\"clr\":240}", b));
+  TEST_ASSERT_EQUAL_HEX32(0xF, b.set);
+  TEST_ASSERT_EQUAL_HEX32(0, b.clr);
+}
+
+// A mistyped mask rejects the command instead of reading as 0 (all off)
+static void test_batch_compact_rejects_non_integer() {
+  RelayBatchOf<4> b;
+  TEST_ASSERT_FALSE(batch4("{\"r\":\"on\"}", b));
+  TEST_ASSERT_FALSE(batch4("{\"r\":1.5}", b));
+  TEST_ASSERT_FALSE(batch4("{\"r\":null}", b));
+  TEST_ASSERT_FALSE(batch4("{\"r\":-1}", b));
+  TEST_ASSERT_FALSE(batch4("{\"set\":\"1\"}", b));
+  TEST_ASSERT_FALSE(batch4("{\"set\":1,\"clr\":true}", b));
+  TEST_ASSERT_FALSE(batch4("{\"tgl\":[1]}", b));
+  TEST_ASSERT_FALSE(batch4("{\"r\":5,\"tgl\":-2}", b));
+}
+
+static void test_batch_32_channels() {
+  RelayBatchOf<32> b;
+  const char json[] = "{\"32\":\"ON\",\"1\":\"OFF\"}";
+  TEST_ASSERT_TRUE(parseRelayBatch(json, strlen(json), b));
+  TEST_ASSERT_EQUAL_HEX32(0x80000000u, b.set);
+  TEST_ASSERT_EQUAL_HEX32(0x1, b.clr);
+
+  const char all[] = "{\"r\":4294967295}";
+  TEST_ASSERT_TRUE(parseRelayBatch(all, strlen(all), b));
+  TEST_ASSERT_EQUAL_HEX32(0xFFFFFFFFu, b.set);
+  TEST_ASSERT_EQUAL_HEX32(0, b.clr);
+}
+
+static void test_batch_invalid_json() {
+  RelayBatchOf<4> b;
+  TEST_ASSERT_FALSE(batch4("", b));
+  TEST_ASSERT_FALSE(batch4("{\"1\":", b));
+  TEST_ASSERT_FALSE(batch4("ON", b));
+}
+
+static int runUnityTests() {
+  UNITY_BEGIN();
+  RUN_TEST(test_on_off_words);
+  RUN_TEST(test_toggle);
+  RUN_TEST(test_pulse);
+  RUN_TEST(test_rejects_garbage);
+  RUN_TEST(test_span_not_terminated);
+  RUN_TEST(test_batch_keys);
+  RUN_TEST(test_batch_value_types);
+  RUN_TEST(test_batch_skips_invalid);
+  RUN_TEST(test_batch_compact);
+  RUN_TEST(test_batch_compact_rejects_non_integer);
+  RUN_TEST(test_batch_32_channels);
+  RUN_TEST(test_batch_invalid_json);
+  return UNITY_END();
+}
+
+#ifdef ARDUINO
+#include <Arduino.h>
+void setup() {
+  delay(2000);  // let the monitor attach
+  runUnityTests();
+}
+void loop() {}
+#else
+int main() { return runUnityTests(); }
+#endif
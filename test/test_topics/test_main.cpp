@@ -0,0 +1,192 @@
+// Topic table construction, <base>/relay/<n>/set matching and the Home
+// Assistant discovery configs derived from the table
+#include <unity.h>
+#include <string.h>
+#include "topic_table.h"
+#include "ha_discovery.h"
+
+void setUp() {}
+void tearDown() {}
+
+using Table = TopicTableOf<4, 2>;
+static Table t;
+
+static bool build(const char* base) { return buildTopics(t, base, strlen(base)); }
+
+static void test_build_topics() {
+  TEST_ASSERT_TRUE(build("home/relays"));
+  TEST_ASSERT_TRUE(t.valid);
+  TEST_ASSERT_EQUAL_STRING("home/relays", t.base);
+  TEST_ASSERT_EQUAL_UINT32(11, t.baseLen);
+  TEST_ASSERT_EQUAL_STRING("home/relays/status", t.avail);
+  TEST_ASSERT_EQUAL_STRING("home/relays/relay/+/set", t.relaySetWild);
+  TEST_ASSERT_EQUAL_STRING("home/relays/relay/set", t.relaySetAll);
+  TEST_ASSERT_EQUAL_UINT32(strlen(t.relaySetAll), t.relaySetAllLen);
+  TEST_ASSERT_EQUAL_STRING("home/relays/relay/state", t.relayStateAll);
+  TEST_ASSERT_EQUAL_STRING("home/relays/metrics", t.metrics);
+  TEST_ASSERT_EQUAL_STRING("home/relays/state", t.state);
+  TEST_ASSERT_EQUAL_STRING("home/relays/ota", t.ota);
+  TEST_ASSERT_EQUAL_STRING("home/relays/ota/status", t.otaStatus);
+  TEST_ASSERT_EQUAL_STRING("home/relays/relay/1/set", t.relaySet[0]);
+  TEST_ASSERT_EQUAL_STRING("home/relays/relay/4/state", t.relayState[3]);
+  TEST_ASSERT_EQUAL_STRING("home/relays/input/2/state", t.inputState[1]);
+  TEST_ASSERT_EQUAL_STRING("home/relays/input/1/count", t.inputCount[0]);
+}
+
+static void test_build_trims_base() {
+  TEST_ASSERT_TRUE(build("  home/relays//  "));
+  TEST_ASSERT_EQUAL_STRING("home/relays", t.base);
+  TEST_ASSERT_EQUAL_STRING("home/relays/relay/2/set", t.relaySet[1]);
+}
+
+static void test_build_empty_base() {
+  TEST_ASSERT_TRUE(build(" / "));
+  TEST_ASSERT_FALSE(t.valid);
+  TEST_ASSERT_EQUAL_UINT32(0, t.baseLen);
+}
+
+static void test_build_rejects_bad_base() {
+  TEST_ASSERT_FALSE(build("home/+/relays"));
+  TEST_ASSERT_FALSE(t.valid);
+  TEST_ASSERT_FALSE(build("home/#"));
+  TEST_ASSERT_FALSE(t.valid);
+
+  const size_t baseMax = topicBaseMax<4, 2>();
+  TEST_ASSERT_EQUAL_UINT32(TOPIC_MAX - sizeof("/relay/4/state"), baseMax);
+  char longBase[TOPIC_MAX];
+  memset(longBase, 'a', sizeof(longBase) - 1);
+  longBase[baseMax + 1] = '\0';
+  TEST_ASSERT_FALSE(build(longBase));
+  longBase[baseMax] = '\0';
+  TEST_ASSERT_TRUE(build(longBase));
+  TEST_ASSERT_TRUE(t.valid);
+  // Longest suffix still fits
+  TEST_ASSERT_EQUAL_UINT32(baseMax + strlen("/relay/4/state"), strlen(t.relayState[3]));
+}
+
+// Two-digit channel numbers lengthen the suffix, so the base limit shrinks
+static void test_build_long_base_many_channels() {
+  static TopicTableOf<16, 16> wide;
+  const size_t baseMax = topicBaseMax<16, 16>();
+  TEST_ASSERT_EQUAL_UINT32(TOPIC_MAX - sizeof("/relay/16/state"), baseMax);
+  char base[TOPIC_MAX];
+  memset(base, 'a', sizeof(base));
+  TEST_ASSERT_FALSE(buildTopics(wide, base, baseMax + 1));
+  TEST_ASSERT_TRUE(buildTopics(wide, base, baseMax));
+  TEST_ASSERT_EQUAL_UINT32(baseMax + strlen("/relay/16/state"), strlen(wide.relayState[15]));
+  TEST_ASSERT_EQUAL_UINT32(baseMax + strlen("/input/16/count"), strlen(wide.inputCount[15]));
+}
+
+static int match(const char* topic) { return matchRelaySetTopic(t, topic, strlen(topic)); }
+
+static void test_match_relay_set() {
+  TEST_ASSERT_TRUE(build("home/relays"));
+  TEST_ASSERT_EQUAL_INT(1, match("home/relays/relay/1/set"));
+  TEST_ASSERT_EQUAL_INT(4, match("home/relays/relay/4/set"));
+  TEST_ASSERT_EQUAL_INT(3, match("home/relays/relay/003/set"));
+}
+
+static void test_match_rejects() {
+  TEST_ASSERT_TRUE(build("home/relays"));
+  TEST_ASSERT_EQUAL_INT(0, match("home/relays/relay/0/set"));
+  TEST_ASSERT_EQUAL_INT(0, match("home/relays/relay/5/set"));
+  TEST_ASSERT_EQUAL_INT(0, match("home/relays/relay/0001/set"));
+  TEST_ASSERT_EQUAL_INT(0, match("home/relays/relay//set"));
+  TEST_ASSERT_EQUAL_INT(0, match("home/relays/relay/1/sets"));
+  TEST_ASSERT_EQUAL_INT(0, match("home/relays/relay/1/state"));
+  TEST_ASSERT_EQUAL_INT(0, match("home/relays/relay/set"));
+  TEST_ASSERT_EQUAL_INT(0, match("home/relayz/relay/1/set"));
+  TEST_ASSERT_EQUAL_INT(0, match("home/relays/input/1/set"));
+  TEST_ASSERT_EQUAL_INT(0, match(""));
+}
+
+// The topic comes from the MQTT buffer: only tlen bytes count
+static void test_match_uses_length() {
+  TEST_ASSERT_TRUE(build("b"));
+  const char topic[] = "b/relay/2/setXYZ";
+  TEST_ASSERT_EQUAL_INT(2, matchRelaySetTopic(t, topic, strlen("b/relay/2/set")));
+  TEST_ASSERT_EQUAL_INT(0, matchRelaySetTopic(t, topic, strlen(topic)));
+}
+
+static const HaDevice DEV = {"esp32-A1B2C3", "switch4node-a1b2c3", "http://switch4node-a1b2c3.local/",
+                              "Switch-4-Node", "1.0"};
+
+static void test_ha_topics() {
+  char topic[TOPIC_MAX];
+  TEST_ASSERT_EQUAL_UINT32(47, haConfigTopic(DEV, HA_RELAY, 0, topic, sizeof(topic)));
+  TEST_ASSERT_EQUAL_STRING("homeassistant/switch/esp32-A1B2C3/relay1/config", topic);
+  TEST_ASSERT_NOT_EQUAL(0, haConfigTopic(DEV, HA_INPUT, 1, topic, sizeof(topic)));
+  TEST_ASSERT_EQUAL_STRING("homeassistant/binary_sensor/esp32-A1B2C3/input2/config", topic);
+  TEST_ASSERT_EQUAL_UINT32(0, haConfigTopic(DEV, HA_RELAY, 0, topic, 20));
+}
+
+static void test_ha_relay_payload() {
+  TEST_ASSERT_TRUE(build("home/relays"));
+  char p[HA_PAYLOAD_MAX];
+  const size_t n = haConfigPayload(t, DEV, HA_RELAY, HA_STATE_TOPICS, 2, p, sizeof(p));
+  TEST_ASSERT_NOT_EQUAL(0, n);
+  TEST_ASSERT_EQUAL_UINT32(strlen(p), n);
+  TEST_ASSERT_NOT_NULL(strstr(p, "\"~\":\"home/relays\""));
+  TEST_ASSERT_NOT_NULL(strstr(p, "\"uniq_id\":\"esp32-A1B2C3_relay3\""));
+  TEST_ASSERT_NOT_NULL(strstr(p, "\"avty_t\":\"~/status\""));
+  TEST_ASSERT_NOT_NULL(strstr(p, "\"stat_t\":\"~/relay/3/state\""));
+  TEST_ASSERT_NOT_NULL(strstr(p, "\"cmd_t\":\"~/relay/3/set\""));
+  TEST_ASSERT_NOT_NULL(strstr(p, "\"ids\":[\"esp32-A1B2C3\"]"));
+  TEST_ASSERT_NULL(strstr(p, "val_tpl"));
+}
+
+static void test_ha_input_payload_json_state() {
+  TEST_ASSERT_TRUE(build("home/relays"));
+  char p[HA_PAYLOAD_MAX];
+  TEST_ASSERT_NOT_EQUAL(0, haConfigPayload(t, DEV, HA_INPUT, HA_STATE_JSON, 1, p, sizeof(p)));
+  TEST_ASSERT_NOT_NULL(strstr(p, "\"stat_t\":\"~/state\""));
+  TEST_ASSERT_NOT_NULL(strstr(p, "value_json.i|int|bitwise_and(2)"));
+  TEST_ASSERT_NULL(strstr(p, "cmd_t"));
+}
+
+static void test_ha_payload_too_small() {
+  TEST_ASSERT_TRUE(build("home/relays"));
+  char p[64];
+  TEST_ASSERT_EQUAL_UINT32(0, haConfigPayload(t, DEV, HA_RELAY, HA_STATE_TOPICS, 0, p, sizeof(p)));
+}
+
+// Longest base, 32 channels: the config still fits the publish buffer
+static void test_ha_payload_worst_case() {
+  static TopicTableOf<32, 32> big;
+  const size_t baseMax = topicBaseMax<32, 32>();
+  char base[TOPIC_MAX];
+  memset(base, 'a', baseMax);
+  base[baseMax] = '\0';
+  TEST_ASSERT_TRUE(buildTopics(big, base, baseMax));
+  char p[HA_PAYLOAD_MAX];
+  TEST_ASSERT_NOT_EQUAL(0, haConfigPayload(big, DEV, HA_RELAY, HA_STATE_JSON, 31, p, sizeof(p)));
+}
+
+static int runUnityTests() {
+  UNITY_BEGIN();
+  RUN_TEST(test_build_topics);
+  RUN_TEST(test_build_long_base_many_channels);
+  RUN_TEST(test_build_trims_base);
+  RUN_TEST(test_build_empty_base);
+  RUN_TEST(test_build_rejects_bad_base);
+  RUN_TEST(test_match_relay_set);
+  RUN_TEST(test_match_rejects);
+  RUN_TEST(test_match_uses_length);
+  RUN_TEST(test_ha_topics);
+  RUN_TEST(test_ha_relay_payload);
+  RUN_TEST(test_ha_input_payload_json_state);
+  RUN_TEST(test_ha_payload_too_small);
+  RUN_TEST(test_ha_payload_worst_case);
+  return UNITY_END();
+}
+
+#ifdef ARDUINO
+#include <Arduino.h>
+void setup() {
+  delay(2000);  // let the monitor attach
+  runUnityTests();
+}
+void loop() {}
+#else
+int main() { return runUnityTests(); }
+#endif
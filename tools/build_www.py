@@ -0,0 +1,115 @@
+"""
+Web UI asset pipeline (PlatformIO pre: extra_script, also runnable standalone)
+
+  data/www/*.html|css|js  ->  minify  ->  gzip -9  ->  <data_dir>/www/<name>.gz
+                                                       <data_dir>/www/etags.txt
+
+The firmware serves the .gz variants with Content-Encoding: gzip and answers
+If-None-Match with 304 using the strong ETags listed in etags.txt
+("<name> <etag>" per line). Other files under data/ are copied unchanged.
+
+Minification is deliberately conservative (comments and indentation only) so
+inline JS keeps its newlines and never depends on ASI tricks.
+
+Standalone:  python tools/build_www.py [out_dir]   (default: .pio/data)
+"""
+
+import gzip
+import hashlib
+import os
+import re
+import shutil
+import sys
+
+PROJECT_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+SRC_DIR = os.path.join(PROJECT_DIR, "data")
+WEB_SUBDIR = "www"
+COMPRESS_EXT = (".html", ".css", ".js")
+
+_BLOCK_RE = re.compile(r"(<style\b[^>]*>)(.*?)(</style>)|(<script\b[^>]*>)(.*?)(</script>)",
+                       re.IGNORECASE | re.DOTALL)
+
+
+def _minify_css(css):
+    css = re.sub(r"/\*.*?\*/", "", css, flags=re.DOTALL)
+    css = re.sub(r"\s+", " ", css)
+    css = re.sub(r"\s*([{};,])\s*", r"\1", css)
+    css = re.sub(r":\s+", ":", css)
+    return css.replace(";}", "}").strip()
+
+
+def _minify_js(js):
+    out = []
+    for line in js.splitlines():
+        line = line.strip()
+        if not line or line.startswith("//"):
+            continue
+        out.append(line)
+    return "\n".join(out)
+
+
+def _minify_markup(html):
+    return "\n".join(line.strip() for line in html.splitlines() if line.strip())
+
+
+def minify_html(html):
+    html = re.sub(r"<!--(?!\[if).*?-->", "", html, flags=re.DOTALL)
+    out, pos = [], 0
+    for m in _BLOCK_RE.finditer(html):
+        out.append(_minify_markup(html[pos:m.start()]))
+        if m.group(1):
+            out.append(m.group(1) + _minify_css(m.group(2)) + m.group(3))
+        else:
+            out.append(m.group(4) + "\n" + _minify_js(m.group(5)) + "\n" + m.group(6))
+        pos = m.end()
+    out.append(_minify_markup(html[pos:]))
+    return "\n".join(part for part in out if part)
+
+
+def minify(name, text):
+    if name.endswith(".html"):
+        return minify_html(text)
+    if name.endswith(".css"):
+        return _minify_css(text)
+    return _minify_js(text)
+
+
+def build(out_dir):
+    if os.path.isdir(out_dir):
+        shutil.rmtree(out_dir)
+
+    etags = []
+    for root, _dirs, files in os.walk(SRC_DIR):
+        rel_root = os.path.relpath(root, SRC_DIR)
+        dst_root = os.path.normpath(os.path.join(out_dir, rel_root))
+        os.makedirs(dst_root, exist_ok=True)
+
+        for name in sorted(files):
+            src = os.path.join(root, name)
+            in_web = rel_root.split(os.sep)[0] == WEB_SUBDIR
+            if not (in_web and name.endswith(COMPRESS_EXT)):
+                shutil.copy2(src, os.path.join(dst_root, name))
+                continue
+
+            with open(src, "r", encoding="utf-8") as f:
+                text = f.read()
+            raw = minify(name, text).encode("utf-8")
+            # mtime=0 keeps the output (and so the ETag) byte-for-byte reproducible
+            packed = gzip.compress(raw, compresslevel=9, mtime=0)
+            with open(os.path.join(dst_root, name + ".gz"), "wb") as f:
+                f.write(packed)
+
+            etags.append((name, '"%s"' % hashlib.sha256(packed).hexdigest()[:16]))
+            print("[www] %-16s %6d -> %6d -> %6d bytes" % (name, len(text.encode("utf-8")), len(raw), len(packed)))
+
+    with open(os.path.join(out_dir, WEB_SUBDIR, "etags.txt"), "w", encoding="utf-8") as f:
+        for name, etag in etags:
+            f.write("%s %s\n" % (name, etag))
+
+
+try:
+    Import("env")  # noqa: F821  (provided by PlatformIO/SCons)
+    build(env.subst("$PROJECT_DATA_DIR"))  # noqa: F821
+except NameError:
+    if __name__ == "__main__":
+        build(sys.argv[1] if len(sys.argv) > 1 else os.path.join(PROJECT_DIR, ".pio", "data"))
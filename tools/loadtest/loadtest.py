@@ -0,0 +1,837 @@
+"""
+Load / soak harness for the MQTT and HTTP control paths
+
+Drives a running node over the network and reports how it copes:
+
+  MQTT  <base>/relay/N/set   single commands at --mqtt-rate per second
+        <base>/relay/set     batch commands at --batch-rate per second
+  HTTP  /api/status, /api/relay, /api/relays from --http-clients concurrent
+        authenticated clients, --http-rate requests per second in total
+
+Every relay command flips one channel and is timed until the node echoes
+the new level on MQTT (<base>/relay/N/state, or <base>/state for the JSON
+and binary state formats). A channel carries at most one command in flight,
+so each echo belongs to exactly one command; a generator that finds no free
+channel counts the tick as "busy" instead of queueing it. The sustainable
+command rate is therefore bounded by channels / round trip; "busy" climbing
+while "lost" stays at zero means the harness, not the node, is the limit.
+
+Every --sample seconds /api/metrics is scraped (heap, node-side latency
+summaries, uptime) and a row is appended to samples.csv, so a 72 h soak
+shows heap and latency drift over time.
+
+Reports in --out (created if missing):
+  samples.csv    one row per sample period (interval rates and percentiles)
+  latency.csv    one row per matched command (only with --raw; grows fast)
+  summary.json   totals, latency percentiles per source, HTTP status counts,
+                 heap trend, reboots and the acceptance gate verdict
+
+Acceptance gate: any --gate-* threshold that fails makes the exit code 1
+(2 for setup errors), so a CI job or a soak script can act on it.
+
+Example (10 minute smoke run, then a 72 h soak):
+  python tools/loadtest/loadtest.py --node 192.168.1.50 --broker 192.168.1.2 \\
+      --base home/relays --mqtt-rate 20 --batch-rate 2 --http-clients 4 \\
+      --http-rate 10 --duration 10m --out .pio/loadtest/smoke
+  python tools/loadtest/loadtest.py ... --duration 72h --sample 60 \\
+      --gate-p99-ms 250 --gate-loss 0.001 --gate-min-heap 40000 --gate-no-reboot
+
+Needs paho-mqtt (pip install -r tools/loadtest/requirements.txt); the HTTP
+side uses the standard library only.
+"""
+
+import argparse
+import base64
+import collections
+import csv
+import http.client
+import json
+import math
+import os
+import random
+import re
+import sys
+import threading
+import time
+import urllib.parse
+
+try:
+    import paho.mqtt.client as mqtt
+except ImportError:  # reported in run(), HTTP-only runs still work
+    mqtt = None
+
+
+def die(msg):
+    print(msg, file=sys.stderr)
+    sys.exit(2)
+
+
+def parse_duration(text):
+    """'90', '90s', '15m', '72h', '2d' -> seconds"""
+    m = re.fullmatch(r"\s*(\d+(?:\.\d+)?)\s*([smhd]?)\s*", text)
+    if not m:
+        raise argparse.ArgumentTypeError("bad duration: %r" % text)
+    scale = {"": 1, "s": 1, "m": 60, "h": 3600, "d": 86400}[m.group(2)]
+    return float(m.group(1)) * scale
+
+
+def parse_mix(text):
+    """'status=2,relay=1,relays=1' -> [(endpoint, weight)]"""
+    mix = []
+    for part in text.split(","):
+        name, _, weight = part.partition("=")
+        name = name.strip()
+        if name not in HTTP_ENDPOINTS:
+            raise argparse.ArgumentTypeError("unknown endpoint %r (use %s)" % (name, ", ".join(HTTP_ENDPOINTS)))
+        mix.append((name, float(weight or 1)))
+    return mix
+
+
+# -------------------- Statistics --------------------
+class Histogram:
+    """Log-bucketed latency histogram (~1% resolution), constant memory for long soaks."""
+
+    GROWTH = 1.02
+    FLOOR_MS = 0.01
+
+    def __init__(self):
+        self.buckets = collections.Counter()
+        self.count = 0
+        self.total = 0.0
+        self.max = 0.0
+
+    def add(self, ms):
+        self.count += 1
+        self.total += ms
+        self.max = max(self.max, ms)
+        self.buckets[int(math.log(max(ms, self.FLOOR_MS) / self.FLOOR_MS, self.GROWTH))] += 1
+
+    def percentile(self, q):
+        if not self.count:
+            return None
+        rank = max(1, math.ceil(q * self.count))
+        seen = 0
+        for b in sorted(self.buckets):
+            seen += self.buckets[b]
+            if seen >= rank:
+                return min(self.FLOOR_MS * self.GROWTH ** (b + 1), self.max)
+        return self.max
+
+    def summary(self):
+        if not self.count:
+            return {"n": 0}
+        out = {"n": self.count, "mean": round(self.total / self.count, 3), "max": round(self.max, 3)}
+        for name, q in (("p50", 0.5), ("p90", 0.9), ("p99", 0.99), ("p999", 0.999)):
+            out[name] = round(self.percentile(q), 3)
+        return out
+
+
+class Stats:
+    """Counters and histograms, kept twice: since start and since the last sample row."""
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.total_counts = collections.Counter()
+        self.total_hists = collections.defaultdict(Histogram)
+        self.interval_counts = collections.Counter()
+        self.interval_hists = collections.defaultdict(Histogram)
+
+    def count(self, key, n=1):
+        with self.lock:
+            self.total_counts[key] += n
+            self.interval_counts[key] += n
+
+    def latency(self, key, ms):
+        with self.lock:
+            self.total_hists[key].add(ms)
+            self.interval_hists[key].add(ms)
+
+    def take_interval(self):
+        with self.lock:
+            counts, hists = self.interval_counts, self.interval_hists
+            self.interval_counts = collections.Counter()
+            self.interval_hists = collections.defaultdict(Histogram)
+        return counts, hists
+
+
+class RawLog:
+    """latency.csv writer (--raw)"""
+
+    def __init__(self, path):
+        self.lock = threading.Lock()
+        self.file = open(path, "w", newline="")
+        self.csv = csv.writer(self.file)
+        self.csv.writerow(["t_s", "source", "relay", "value", "latency_ms"])
+
+    def write(self, t, source, relay, value, ms):
+        with self.lock:
+            self.csv.writerow(["%.3f" % t, source, relay, int(value), "%.3f" % ms])
+
+    def close(self):
+        with self.lock:
+            self.file.close()
+
+
+# -------------------- Echo tracking --------------------
+class EchoTracker:
+    """Matches relay commands to the state echo. One command in flight per channel."""
+
+    def __init__(self, relay_count, stats, raw, t0):
+        self.relay_count = relay_count
+        self.stats = stats
+        self.raw = raw
+        self.t0 = t0
+        self.lock = threading.Lock()
+        self.state = [None] * relay_count        # last level seen from the node
+        self.inflight = [None] * relay_count     # (sent_at, value, source)
+        self.cursor = 0
+        self.synced = threading.Event()
+
+    def claim(self, max_relays=1):
+        """Reserve up to max_relays idle channels; returns [(relay, new value)] (0-based)."""
+        picked = []
+        with self.lock:
+            for k in range(self.relay_count):
+                r = (self.cursor + k) % self.relay_count
+                if self.inflight[r] is None and self.state[r] is not None:
+                    picked.append((r, not self.state[r]))
+                    self.inflight[r] = (None, not self.state[r], None)  # reserved, not sent yet
+                    if len(picked) == max_relays:
+                        break
+            if picked:
+                self.cursor = (picked[-1][0] + 1) % self.relay_count
+        return picked
+
+    def sent(self, picked, source):
+        now = time.monotonic()
+        with self.lock:
+            for r, value in picked:
+                self.inflight[r] = (now, value, source)
+
+    def release(self, picked):
+        """The command never left (publish or request failed)."""
+        with self.lock:
+            for r, _ in picked:
+                self.inflight[r] = None
+
+    def observe(self, relay, value, retained):
+        now = time.monotonic()
+        with self.lock:
+            if relay >= self.relay_count:
+                return
+            self.state[relay] = value
+            if not self.synced.is_set() and all(s is not None for s in self.state):
+                self.synced.set()
+            pending = self.inflight[relay]
+            if retained or pending is None or pending[0] is None or pending[1] != value:
+                if not retained and pending is None:
+                    self.stats.count("echo_unsolicited")
+                return
+            self.inflight[relay] = None
+        ms = (now - pending[0]) * 1000.0
+        self.stats.latency("echo:" + pending[2], ms)
+        self.stats.count("echo:" + pending[2])
+        if self.raw:
+            self.raw.write(now - self.t0, pending[2], relay + 1, value, ms)
+
+    def observe_mask(self, mask, retained):
+        for r in range(self.relay_count):
+            self.observe(r, bool(mask >> r & 1), retained)
+
+    def sweep(self, timeout_s):
+        """Drop commands whose echo is overdue; they count as lost."""
+        now = time.monotonic()
+        lost = collections.Counter()
+        with self.lock:
+            for r, pending in enumerate(self.inflight):
+                if pending and pending[0] is not None and now - pending[0] > timeout_s:
+                    self.inflight[r] = None
+                    lost[pending[2]] += 1
+        for source, n in lost.items():
+            self.stats.count("lost:" + source, n)
+
+
+# -------------------- MQTT side --------------------
+class MqttSide:
+    def __init__(self, args, tracker, stats, input_count):
+        self.args = args
+        self.tracker = tracker
+        self.stats = stats
+        self.input_count = input_count
+        self.base = args.base.strip().rstrip("/")
+        self.connected = threading.Event()
+        client_id = "s4n-loadtest-%06x" % random.getrandbits(24)
+        try:  # paho-mqtt 2.x
+            self.client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION1, client_id=client_id)
+        except AttributeError:
+            self.client = mqtt.Client(client_id=client_id)
+        if args.broker_user:
+            self.client.username_pw_set(args.broker_user, args.broker_password)
+        if args.broker_tls:
+            self.client.tls_set(ca_certs=args.broker_ca)
+        self.client.on_connect = self._on_connect
+        self.client.on_disconnect = self._on_disconnect
+        self.client.on_message = self._on_message
+        self.relay_re = re.compile(re.escape(self.base) + r"/relay/(\d+)/state$")
+
+    def start(self):
+        port = self.args.broker_port or (8883 if self.args.broker_tls else 1883)
+        self.client.connect_async(self.args.broker, port, keepalive=30)
+        self.client.loop_start()
+        return self.connected.wait(10)
+
+    def stop(self):
+        self.client.loop_stop()
+        self.client.disconnect()
+
+    def _on_connect(self, client, userdata, flags, rc):
+        if rc != 0:
+            print("[MQTT] connect refused rc=%s" % rc, file=sys.stderr)
+            return
+        client.subscribe([(self.base + "/relay/+/state", 1), (self.base + "/state", 1)])
+        self.connected.set()
+
+    def _on_disconnect(self, client, userdata, rc):
+        self.connected.clear()
+        self.stats.count("mqtt_disconnects")
+
+    def _on_message(self, client, userdata, msg):
+        retained = bool(msg.retain)
+        if msg.topic == self.base + "/state":
+            mask = self._decode_state(msg.payload)
+            if mask is not None:
+                self.tracker.observe_mask(mask, retained)
+            return
+        m = self.relay_re.match(msg.topic)
+        if m:
+            value = msg.payload.strip().upper()
+            if value in (b"ON", b"OFF"):
+                self.tracker.observe(int(m.group(1)) - 1, value == b"ON", retained)
+
+    def _decode_state(self, payload):
+        # SF_JSON {"r":mask,"i":mask,"seq":n}; SF_BINARY seq u32 LE, then LE masks
+        if payload[:1] == b"{":
+            try:
+                return int(json.loads(payload)["r"])
+            except (ValueError, KeyError, TypeError):
+                self.stats.count("state_decode_errors")
+                return None
+        rbytes = (self.tracker.relay_count + 7) // 8
+        if len(payload) != 4 + rbytes + (self.input_count + 7) // 8:
+            self.stats.count("state_decode_errors")
+            return None
+        return int.from_bytes(payload[4:4 + rbytes], "little")
+
+    def publish(self, topic, payload):
+        if not self.connected.is_set():
+            return False
+        info = self.client.publish(topic, payload, qos=self.args.qos)
+        return info.rc == mqtt.MQTT_ERR_SUCCESS
+
+    def send_single(self):
+        picked = self.tracker.claim(1)
+        if not picked:
+            self.stats.count("busy:mqtt")
+            return
+        r, value = picked[0]
+        self.tracker.sent(picked, "mqtt")
+        if self.publish("%s/relay/%d/set" % (self.base, r + 1), "ON" if value else "OFF"):
+            self.stats.count("sent:mqtt")
+        else:
+            self.tracker.release(picked)
+            self.stats.count("send_errors:mqtt")
+
+    def send_batch(self):
+        picked = self.tracker.claim(self.args.batch_size)
+        if not picked:
+            self.stats.count("busy:mqtt_batch")
+            return
+        self.tracker.sent(picked, "mqtt_batch")
+        if self.publish(self.base + "/relay/set", batch_payload(picked, self.args.batch_form)):
+            self.stats.count("sent:mqtt_batch")
+        else:
+            self.tracker.release(picked)
+            self.stats.count("send_errors:mqtt_batch")
+
+
+def batch_payload(picked, form):
+    if form == "compact":
+        on = sum(1 << r for r, v in picked if v)
+        off = sum(1 << r for r, v in picked if not v)
+        return json.dumps({"set": on, "clr": off}, separators=(",", ":"))
+    return json.dumps({str(r + 1): "ON" if v else "OFF" for r, v in picked}, separators=(",", ":"))
+
+
+# -------------------- HTTP side --------------------
+HTTP_ENDPOINTS = ("status", "relay", "relays", "metrics")
+
+
+class HttpClient:
+    """One keep-alive connection per client thread; reconnects after errors or Connection: close."""
+
+    def __init__(self, args):
+        self.args = args
+        token = base64.b64encode(("%s:%s" % (args.user, args.password)).encode()).decode()
+        self.headers = {"Authorization": "Basic " + token}
+        self.conn = None
+
+    def request(self, method, path, form=None):
+        body = None
+        headers = dict(self.headers)
+        if form is not None:
+            body = urllib.parse.urlencode(form)
+            headers["Content-Type"] = "application/x-www-form-urlencoded"
+        for attempt in (0, 1):
+            if self.conn is None:
+                self.conn = http.client.HTTPConnection(self.args.node, self.args.http_port,
+                                                       timeout=self.args.timeout)
+            try:
+                self.conn.request(method, path, body=body, headers=headers)
+                resp = self.conn.getresponse()
+                data = resp.read()
+                if resp.getheader("Connection", "").lower() == "close":
+                    self.close()
+                return resp.status, data
+            except (http.client.HTTPException, OSError):
+                self.close()
+                if attempt:
+                    raise
+        return None, b""
+
+    def close(self):
+        if self.conn is not None:
+            self.conn.close()
+            self.conn = None
+
+
+def http_worker(args, tracker, stats, relay_count, period, stop):
+    """Without a broker there is no echo to wait for: relay commands become TOGGLEs."""
+    client = HttpClient(args)
+    endpoints = [name for name, _ in args.http_mix]
+    weights = [w for _, w in args.http_mix]
+    deadline = time.monotonic() + random.uniform(0, period)
+    while not stop.is_set():
+        delay = deadline - time.monotonic()
+        if delay > 0 and stop.wait(delay):
+            break
+        deadline = max(deadline + period, time.monotonic() - period)
+
+        name = random.choices(endpoints, weights)[0]
+        size = 1 if name == "relay" else min(args.batch_size, relay_count)
+        picked = []
+        if name in ("relay", "relays") and tracker:
+            picked = tracker.claim(size)
+            if not picked:
+                stats.count("busy:http_" + name)
+                continue
+
+        if name == "status":
+            method, path, form = "GET", "/api/status", None
+        elif name == "metrics":
+            method, path, form = "GET", "/api/metrics", None
+        elif name == "relay":
+            r, value = picked[0] if picked else (random.randrange(relay_count), None)
+            state = "TOGGLE" if value is None else ("ON" if value else "OFF")
+            method, path, form = "POST", "/api/relay", {"relay": r + 1, "state": state}
+        else:
+            if picked:
+                states = batch_payload(picked, args.batch_form)
+            else:
+                chosen = random.sample(range(relay_count), size)
+                states = json.dumps({str(r + 1): "TOGGLE" for r in chosen}, separators=(",", ":"))
+            method, path, form = "POST", "/api/relays", {"states": states}
+
+        if picked:
+            tracker.sent(picked, "http_" + name)
+        t = time.monotonic()
+        try:
+            status, _ = client.request(method, path, form)
+        except (http.client.HTTPException, OSError) as e:
+            status = type(e).__name__
+        ms = (time.monotonic() - t) * 1000.0
+
+        stats.count("http:%s:%s" % (name, status))
+        if status == 200:
+            stats.latency("http:" + name, ms)
+        elif picked:
+            tracker.release(picked)
+    client.close()
+
+
+# -------------------- Generators --------------------
+def paced(rate, action, stop):
+    """Call action() rate times per second until stop; late ticks are not made up beyond one period."""
+    period = 1.0 / rate
+    deadline = time.monotonic()
+    while not stop.is_set():
+        delay = deadline - time.monotonic()
+        if delay > 0 and stop.wait(delay):
+            break
+        deadline = max(deadline + period, time.monotonic() - period)
+        action()
+
+
+def scrape_metrics(args):
+    """/api/metrics (Prometheus text) -> {name: value}, None on failure."""
+    client = HttpClient(args)
+    try:
+        status, body = client.request("GET", "/api/metrics")
+    except (http.client.HTTPException, OSError):
+        return None
+    finally:
+        client.close()
+    if status != 200:
+        return None
+    out = {}
+    for line in body.decode(errors="replace").splitlines():
+        if not line or line.startswith("#"):
+            continue
+        m = re.fullmatch(r'([a-z0-9_]+)(?:\{quantile="([0-9.]+)"\})?\s+(\S+)', line)
+        if not m:
+            continue
+        name = m.group(1) + ("_p" + m.group(2).replace("0.", "").ljust(2, "0") if m.group(2) else "")
+        try:
+            out[name] = float(m.group(3))
+        except ValueError:
+            pass
+    return out
+
+
+def fetch_status(args):
+    client = HttpClient(args)
+    try:
+        status, body = client.request("GET", "/api/status")
+        if status == 401:
+            die("[HTTP] 401 from /api/status, check --user/--password")
+        if status != 200:
+            die("[HTTP] /api/status returned %s" % status)
+        return json.loads(body)
+    except (http.client.HTTPException, OSError, ValueError) as e:
+        die("[HTTP] cannot read /api/status from %s: %s" % (args.node, e))
+    finally:
+        client.close()
+
+
+def slope_per_hour(points):
+    """Least-squares slope of [(t_s, value)], in value units per hour."""
+    if len(points) < 2:
+        return None
+    n = len(points)
+    mt = sum(t for t, _ in points) / n
+    mv = sum(v for _, v in points) / n
+    den = sum((t - mt) ** 2 for t, _ in points)
+    if not den:
+        return None
+    return sum((t - mt) * (v - mv) for t, v in points) / den * 3600.0
+
+
+def sum_prefix(counts, prefix):
+    return sum(n for k, n in counts.items() if k.startswith(prefix))
+
+
+def merged_hist(hists, prefix):
+    h = Histogram()
+    for key, src in hists.items():
+        if key.startswith(prefix):
+            h.count += src.count
+            h.total += src.total
+            h.max = max(h.max, src.max)
+            h.buckets.update(src.buckets)
+    return h
+
+
+def fmt(v, digits=1):
+    return "" if v is None else ("%.*f" % (digits, v))
+
+
+SAMPLE_FIELDS = [
+    "t_s", "sent", "echoed", "lost", "busy", "echo_p50_ms", "echo_p99_ms", "echo_max_ms",
+    "http_ok", "http_err", "http_p50_ms", "http_p99_ms", "mqtt_disconnects",
+    "heap_free", "heap_min_free", "heap_largest", "uptime_s", "reboots",
+]
+
+
+def run(args):
+    os.makedirs(args.out, exist_ok=True)
+    stats = Stats()
+    t0 = time.monotonic()
+    raw = RawLog(os.path.join(args.out, "latency.csv")) if args.raw else None
+
+    relay_count, input_count = args.relays, args.inputs
+    if args.node:
+        st = fetch_status(args)
+        relay_count = relay_count or len(st.get("relays", []))
+        input_count = input_count or len(st.get("inputs_closed", []))
+        if not args.base:
+            args.base = st.get("mqtt_base", "")
+    if not relay_count:
+        die("[LOAD] relay count unknown: pass --relays or --node")
+
+    tracker = None
+    mqtt_side = None
+    if args.broker:
+        if mqtt is None:
+            die("[MQTT] paho-mqtt missing: pip install -r tools/loadtest/requirements.txt")
+        if not args.base:
+            die("[MQTT] base topic unknown: pass --base")
+        tracker = EchoTracker(relay_count, stats, raw, t0)
+        mqtt_side = MqttSide(args, tracker, stats, input_count)
+        if not mqtt_side.start():
+            die("[MQTT] no connection to %s" % args.broker)
+        if not tracker.synced.wait(10):
+            die("[MQTT] no retained state under %s/ within 10 s (node online?)" % args.base)
+
+    print("[LOAD] %d relays, %d inputs, base '%s', running %.0f s -> %s"
+          % (relay_count, input_count, args.base, args.duration, args.out))
+
+    stop = threading.Event()
+    threads = []
+    if args.mqtt_rate:
+        threads.append(threading.Thread(target=paced, args=(args.mqtt_rate, mqtt_side.send_single, stop)))
+    if args.batch_rate:
+        threads.append(threading.Thread(target=paced, args=(args.batch_rate, mqtt_side.send_batch, stop)))
+    if args.node and args.http_clients and args.http_rate:
+        period = args.http_clients / args.http_rate
+        for _ in range(args.http_clients):
+            threads.append(threading.Thread(target=http_worker, args=(args, tracker, stats, relay_count, period, stop)))
+    for t in threads:
+        t.daemon = True
+        t.start()
+
+    samples = open(os.path.join(args.out, "samples.csv"), "w", newline="")
+    writer = None
+    heap_points, min_heap, reboots, last_uptime = [], None, 0, None
+    first_metrics = last_metrics = None
+    end = t0 + args.duration
+    try:
+        while True:
+            now = time.monotonic()
+            if now >= end or stop.wait(min(args.sample, end - now)):
+                break
+            if tracker:
+                tracker.sweep(args.timeout)
+            counts, hists = stats.take_interval()
+            node = scrape_metrics(args) if args.node else None
+            t_s = time.monotonic() - t0
+
+            row = {
+                "t_s": "%.0f" % t_s,
+                "sent": sum_prefix(counts, "sent:") + sum(n for k, n in counts.items()
+                                                          if k.startswith("http:relay") and k.endswith(":200")),
+                "echoed": sum_prefix(counts, "echo:"),
+                "lost": sum_prefix(counts, "lost:"),
+                "busy": sum_prefix(counts, "busy:"),
+                "http_ok": sum(n for k, n in counts.items() if k.startswith("http:") and k.endswith(":200")),
+                "http_err": sum(n for k, n in counts.items() if k.startswith("http:") and not k.endswith(":200")),
+                "mqtt_disconnects": counts.get("mqtt_disconnects", 0),
+            }
+            echo = merged_hist(hists, "echo:")
+            row["echo_p50_ms"] = fmt(echo.percentile(0.5))
+            row["echo_p99_ms"] = fmt(echo.percentile(0.99))
+            row["echo_max_ms"] = fmt(echo.max if echo.count else None)
+            web = merged_hist(hists, "http:")
+            row["http_p50_ms"] = fmt(web.percentile(0.5))
+            row["http_p99_ms"] = fmt(web.percentile(0.99))
+
+            if node:
+                first_metrics = first_metrics or node
+                last_metrics = node
+                uptime = node.get("s4n_uptime_seconds")
+                if uptime is not None and last_uptime is not None and uptime < last_uptime:
+                    reboots += 1
+                    print("[LOAD] node rebooted (uptime %.0f -> %.0f)" % (last_uptime, uptime))
+                last_uptime = uptime
+                heap = node.get("s4n_heap_free_bytes")
+                if heap is not None:
+                    heap_points.append((t_s, heap))
+                mf = node.get("s4n_heap_min_free_bytes")
+                if mf is not None:
+                    min_heap = mf if min_heap is None else min(min_heap, mf)
+                row.update({"heap_free": fmt(heap, 0), "heap_min_free": fmt(mf, 0),
+                            "heap_largest": fmt(node.get("s4n_heap_largest_block_bytes"), 0),
+                            "uptime_s": fmt(uptime, 0)})
+            row["reboots"] = reboots
+
+            if writer is None:
+                # Node-side p99 columns follow whatever the firmware exports
+                node_cols = sorted(k for k in (node or {}) if k.endswith("_us_p99"))
+                writer = csv.DictWriter(samples, SAMPLE_FIELDS + node_cols, extrasaction="ignore")
+                writer.writeheader()
+            if node:
+                row.update({k: fmt(v) for k, v in node.items() if k.endswith("_us_p99")})
+            writer.writerow(row)
+            samples.flush()
+
+            print("[LOAD] t=%5ss sent=%-5s echo p50/p99=%s/%s ms lost=%s busy=%s http ok/err=%s/%s heap=%s"
+                  % (row["t_s"], row["sent"], row["echo_p50_ms"] or "-", row["echo_p99_ms"] or "-",
+                     row["lost"], row["busy"], row["http_ok"], row["http_err"], row.get("heap_free", "-")))
+    except KeyboardInterrupt:
+        print("[LOAD] interrupted, writing reports")
+    finally:
+        stop.set()
+        for t in threads:
+            t.join(args.timeout + 1)
+        if tracker:
+            time.sleep(min(args.timeout, 2.0))  # let the last echoes land
+            tracker.sweep(0)
+        if mqtt_side:
+            mqtt_side.stop()
+        samples.close()
+        if raw:
+            raw.close()
+
+    return summarize(args, stats, time.monotonic() - t0, relay_count, input_count,
+                     heap_points, min_heap, reboots, first_metrics, last_metrics)
+
+
+def summarize(args, stats, elapsed, relay_count, input_count,
+              heap_points, min_heap, reboots, first_metrics, last_metrics):
+    counts, hists = stats.total_counts, stats.total_hists
+    sources = sorted({k.split(":", 1)[1] for k in counts if k.split(":", 1)[0] in ("sent", "echo", "lost", "busy")})
+    per_source = {}
+    for s in sources:
+        sent = counts.get("sent:" + s, 0) or sum(n for k, n in counts.items()
+                                                  if k.startswith("http:%s:" % s[5:]) and k.endswith(":200"))
+        per_source[s] = {
+            "sent": sent,
+            "echoed": counts.get("echo:" + s, 0),
+            "lost": counts.get("lost:" + s, 0),
+            "busy": counts.get("busy:" + s, 0),
+            "send_errors": counts.get("send_errors:" + s, 0),
+            "rate_per_s": round(counts.get("echo:" + s, 0) / elapsed, 2) if elapsed else 0,
+            "echo_ms": hists["echo:" + s].summary() if ("echo:" + s) in hists else {"n": 0},
+        }
+    http_status = {k[5:]: n for k, n in counts.items() if k.startswith("http:")}
+    http_latency = {k[5:]: h.summary() for k, h in hists.items() if k.startswith("http:")}
+
+    echo = merged_hist(hists, "echo:")
+    sent_total = sum(v["sent"] for v in per_source.values())
+    lost_total = sum(v["lost"] for v in per_source.values())
+    http_ok = sum(n for k, n in http_status.items() if k.endswith(":200"))
+    http_err = sum(n for k, n in http_status.items() if not k.endswith(":200"))
+
+    heap_drift = slope_per_hour(heap_points)
+    summary = {
+        "config": {k: v for k, v in vars(args).items() if k not in ("password", "broker_password")},
+        "elapsed_s": round(elapsed, 1),
+        "relays": relay_count,
+        "inputs": input_count,
+        "commands": {
+            "sent": sent_total,
+            "echoed": echo.count,
+            "lost": lost_total,
+            "loss_ratio": round(lost_total / sent_total, 6) if sent_total else 0,
+            "rate_per_s": round(echo.count / elapsed, 2) if elapsed else 0,
+            "echo_ms": echo.summary(),
+            "by_source": per_source,
+            "unsolicited_echoes": counts.get("echo_unsolicited", 0),
+        },
+        "http": {"status": http_status, "latency_ms": http_latency,
+                 "error_ratio": round(http_err / (http_ok + http_err), 6) if http_ok + http_err else 0},
+        "mqtt_disconnects": counts.get("mqtt_disconnects", 0),
+        "node": {
+            "reboots": reboots,
+            "heap_free_first": first_metrics and first_metrics.get("s4n_heap_free_bytes"),
+            "heap_free_last": last_metrics and last_metrics.get("s4n_heap_free_bytes"),
+            "heap_min_free": min_heap,
+            "heap_drift_bytes_per_h": None if heap_drift is None else round(heap_drift, 1),
+            "metrics_last": last_metrics,
+        },
+    }
+
+    gates = []
+
+    def gate(name, ok, value, limit):
+        gates.append({"gate": name, "pass": bool(ok), "value": value, "limit": limit})
+
+    if args.gate_p99_ms is not None:
+        p99 = echo.percentile(0.99)
+        gate("echo_p99_ms", p99 is not None and p99 <= args.gate_p99_ms, p99, args.gate_p99_ms)
+    if args.gate_loss is not None:
+        ratio = summary["commands"]["loss_ratio"]
+        gate("loss_ratio", sent_total and ratio <= args.gate_loss, ratio, args.gate_loss)
+    if args.gate_http_errors is not None:
+        ratio = summary["http"]["error_ratio"]
+        gate("http_error_ratio", ratio <= args.gate_http_errors, ratio, args.gate_http_errors)
+    if args.gate_min_heap is not None:
+        gate("heap_min_free", min_heap is not None and min_heap >= args.gate_min_heap, min_heap, args.gate_min_heap)
+    if args.gate_heap_drift is not None:
+        gate("heap_drift_bytes_per_h", heap_drift is not None and heap_drift >= -args.gate_heap_drift,
+             heap_drift, -args.gate_heap_drift)
+    if args.gate_no_reboot:
+        gate("reboots", reboots == 0, reboots, 0)
+    summary["gates"] = gates
+    summary["pass"] = all(g["pass"] for g in gates)
+
+    with open(os.path.join(args.out, "summary.json"), "w") as f:
+        json.dump(summary, f, indent=2)
+
+    print("[LOAD] %d commands in %.0f s (%.1f/s), echo p50/p99/max %s/%s/%s ms, lost %d, http ok/err %d/%d"
+          % (echo.count, elapsed, summary["commands"]["rate_per_s"], fmt(echo.percentile(0.5)),
+             fmt(echo.percentile(0.99)), fmt(echo.max if echo.count else None), lost_total, http_ok, http_err))
+    for g in gates:
+        print("[GATE] %-24s %s (value %s, limit %s)" % (g["gate"], "PASS" if g["pass"] else "FAIL", g["value"], g["limit"]))
+    return 0 if summary["pass"] else 1
+
+
+def main(argv=None):
+    p = argparse.ArgumentParser(description="MQTT/HTTP load and soak test for a Switch-4-Node",
+                                formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+    g = p.add_argument_group("node")
+    g.add_argument("--node", help="node address for HTTP load and /api/metrics")
+    g.add_argument("--http-port", type=int, default=80)
+    g.add_argument("--user", default="admin")
+    g.add_argument("--password", default="switch4node")
+    g.add_argument("--relays", type=int, default=0, help="relay count (default: from /api/status)")
+    g.add_argument("--inputs", type=int, default=0, help="input count (default: from /api/status)")
+
+    g = p.add_argument_group("mqtt")
+    g.add_argument("--broker", help="broker the node is connected to")
+    g.add_argument("--broker-port", type=int, default=0, help="default 1883, or 8883 with --broker-tls")
+    g.add_argument("--broker-user")
+    g.add_argument("--broker-password")
+    g.add_argument("--broker-tls", action="store_true")
+    g.add_argument("--broker-ca", help="CA bundle for --broker-tls (default: system store)")
+    g.add_argument("--base", default="", help="node base topic (default: mqtt_base from /api/status)")
+    g.add_argument("--qos", type=int, choices=(0, 1), default=0)
+
+    g = p.add_argument_group("load")
+    g.add_argument("--mqtt-rate", type=float, default=10, help="<base>/relay/N/set per second (0 = off)")
+    g.add_argument("--batch-rate", type=float, default=1, help="<base>/relay/set per second (0 = off)")
+    g.add_argument("--batch-size", type=int, default=4, help="channels per batch command")
+    g.add_argument("--batch-form", choices=("keys", "compact"), default="keys",
+                   help='{"1":"ON",...} or {"set":m,"clr":m}')
+    g.add_argument("--http-clients", type=int, default=2)
+    g.add_argument("--http-rate", type=float, default=4, help="HTTP requests per second, all clients")
+    g.add_argument("--http-mix", type=parse_mix, default=parse_mix("status=2,relay=1,relays=1"),
+                   help="weighted endpoints: " + ",".join(HTTP_ENDPOINTS))
+    g.add_argument("--duration", type=parse_duration, default=parse_duration("60s"), help="e.g. 90s, 15m, 72h")
+    g.add_argument("--timeout", type=float, default=5.0, help="seconds before a command echo counts as lost")
+
+    g = p.add_argument_group("reports")
+    g.add_argument("--out", default=os.path.join(".pio", "loadtest"))
+    g.add_argument("--sample", type=float, default=10.0, help="seconds per samples.csv row / metrics scrape")
+    g.add_argument("--raw", action="store_true", help="also write latency.csv (one row per command)")
+
+    g = p.add_argument_group("acceptance gate (exit 1 when any fails)")
+    g.add_argument("--gate-p99-ms", type=float)
+    g.add_argument("--gate-loss", type=float, help="max lost/sent ratio")
+    g.add_argument("--gate-http-errors", type=float, help="max non-200/total ratio")
+    g.add_argument("--gate-min-heap", type=float, help="min s4n_heap_min_free_bytes")
+    g.add_argument("--gate-heap-drift", type=float, help="max heap loss in bytes/hour (regression slope)")
+    g.add_argument("--gate-no-reboot", action="store_true")
+
+    args = p.parse_args(argv)
+    if not args.node and not args.broker:
+        p.error("need --node and/or --broker")
+    if args.broker_tls and args.broker_ca and not os.path.exists(args.broker_ca):
+        p.error("--broker-ca not found: %s" % args.broker_ca)
+    if not args.node:
+        args.http_clients = 0
+    if not args.broker:
+        args.mqtt_rate = args.batch_rate = 0
+    return run(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,182 @@
+"""
+UDP control client for a Switch-4-Node (/api/udp)
+
+Sends set/clear/toggle masks in one datagram and prints the relay and input
+masks from the reply, with the round trip time. Doubles as the reference for
+the wire format a PLC/SCADA driver has to produce:
+
+  offset size
+       0    1  magic 0x55
+       1    1  version 2
+       2    1  type (1 = request, 2 = reply)
+       3    1  flags (reply: 1 applied, 2 busy, 4 session, 8 stale, 16 timeout)
+       4    4  session (0 asks for the current one)
+       8    4  sender id, chosen by the client and kept across restarts
+      12    4  seq, strictly increasing per sender id within a session
+      16   12  set, clr, tgl relay masks (bit 0 = relay 1; all zero = read state)
+      28    8  relays, inputs (reply)
+      36   16  HMAC-SHA256(key, bytes 0..35), first 16 bytes
+  All fields little-endian. Replies are tagged the same way.
+
+The session is learned from the first reply (flag "session"), so a fresh
+client costs one extra round trip; a long-lived driver keeps it until the node
+answers "session" again (reboot, reconfigure, or more live sender ids than the
+node tracks). The replay window is keyed on the tagged sender id, not the
+source address, so every client sharing a key needs its own id; the default
+is derived from the host name. seq defaults to the wall clock in ms, which
+keeps increasing across client restarts.
+
+Examples:
+  python tools/udpctl.py 192.168.1.50 --key <key> --tgl 1
+  python tools/udpctl.py 192.168.1.50 --key <key> --set 1,2 --clr 3 --count 1000 --interval 0.01
+
+Standard library only. The key can also come from S4N_UDP_KEY.
+"""
+
+import argparse
+import hashlib
+import hmac
+import os
+import socket
+import struct
+import sys
+import time
+import zlib
+
+MAGIC = 0x55
+VERSION = 2
+REQUEST, REPLY = 1, 2
+F_APPLIED, F_BUSY, F_SESSION, F_STALE, F_TIMEOUT = 0x01, 0x02, 0x04, 0x08, 0x10
+FLAG_NAMES = ((F_APPLIED, "applied"), (F_BUSY, "busy"), (F_SESSION, "session"),
+              (F_STALE, "stale"), (F_TIMEOUT, "timeout"))
+
+HEAD = struct.Struct("<BBBBIIIIIIII")
+TAG_LEN = 16
+FRAME_LEN = HEAD.size + TAG_LEN
+assert FRAME_LEN == 52
+
+
+def parse_mask(text):
+    """'1,3' / 'all' / '0x5' -> relay bitmask"""
+    if not text:
+        return 0
+    if text == "all":
+        return 0xFFFFFFFF
+    if text.lower().startswith("0x"):
+        return int(text, 16)
+    mask = 0
+    for part in text.split(","):
+        n = int(part)
+        if not 1 <= n <= 32:
+            raise argparse.ArgumentTypeError("relay out of range: %d" % n)
+        mask |= 1 << (n - 1)
+    return mask
+
+
+def fmt_flags(flags):
+    names = [name for bit, name in FLAG_NAMES if flags & bit]
+    return ",".join(names) or "-"
+
+
+def default_sender():
+    return zlib.crc32(socket.gethostname().encode()) or 1
+
+
+class Client:
+    def __init__(self, host, port, key, timeout, sender):
+        self.addr = (host, port)
+        self.key = key
+        self.sender = sender
+        self.session = 0
+        self.seq = 0
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.settimeout(timeout)
+
+    def next_seq(self):
+        now = int(time.time() * 1000) & 0xFFFFFFFF
+        ahead = (now - self.seq) & 0xFFFFFFFF  # serial-number compare, as on the node
+        self.seq = now if 0 < ahead < 0x80000000 else (self.seq + 1) & 0xFFFFFFFF
+        return self.seq
+
+    def tag(self, head):
+        return hmac.new(self.key, head, hashlib.sha256).digest()[:TAG_LEN]
+
+    def exchange(self, seq, set_, clr, tgl):
+        head = HEAD.pack(MAGIC, VERSION, REQUEST, 0, self.session, self.sender, seq, set_, clr, tgl, 0, 0)
+        t0 = time.perf_counter()
+        self.sock.sendto(head + self.tag(head), self.addr)
+        while True:
+            data, _ = self.sock.recvfrom(64)
+            rtt = time.perf_counter() - t0
+            if len(data) != FRAME_LEN or not hmac.compare_digest(self.tag(data[:HEAD.size]), data[HEAD.size:]):
+                continue
+            f = HEAD.unpack(data[:HEAD.size])
+            if f[0] != MAGIC or f[1] != VERSION or f[2] != REPLY:
+                continue
+            flags, session, sender, rseq = f[3], f[4], f[5], f[6]
+            if sender != self.sender or (not flags & F_STALE and rseq != seq):
+                continue  # late reply to an earlier timed-out request
+            return flags, session, rseq, f[10], f[11], rtt
+
+    def command(self, set_, clr, tgl):
+        """Resolves session and stale-seq answers; returns the final reply and its RTT."""
+        for _ in range(3):
+            flags, session, rseq, relays, inputs, rtt = self.exchange(self.next_seq(), set_, clr, tgl)
+            if flags & F_SESSION:
+                self.session = session
+                continue
+            if flags & F_STALE:
+                self.seq = rseq  # next_seq() moves past it
+                continue
+            return flags, relays, inputs, rtt
+        raise RuntimeError("node keeps rejecting the session/seq")
+
+
+def main(argv=None):
+    p = argparse.ArgumentParser(description="UDP control client for a Switch-4-Node",
+                                formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+    p.add_argument("node", help="node address")
+    p.add_argument("--port", type=int, default=5005)
+    p.add_argument("--key", default=os.environ.get("S4N_UDP_KEY"), help="pre-shared key (or S4N_UDP_KEY)")
+    p.add_argument("--sender", type=lambda v: int(v, 0), default=default_sender(),
+                   help="sender id (u32), unique per client sharing the key")
+    p.add_argument("--set", type=parse_mask, default=0, help="relays to switch on: 1,3 | all | 0x5")
+    p.add_argument("--clr", type=parse_mask, default=0, help="relays to switch off")
+    p.add_argument("--tgl", type=parse_mask, default=0, help="relays to toggle")
+    p.add_argument("--count", type=int, default=1, help="repeat the command")
+    p.add_argument("--interval", type=float, default=0.0, help="seconds between repeats")
+    p.add_argument("--timeout", type=float, default=0.5, help="reply timeout in seconds")
+    p.add_argument("--quiet", action="store_true", help="only print the RTT summary")
+    args = p.parse_args(argv)
+    if not args.key:
+        p.error("need --key or S4N_UDP_KEY")
+
+    c = Client(args.node, args.port, args.key.encode(), args.timeout, args.sender & 0xFFFFFFFF)
+    rtts, lost = [], 0
+    for i in range(args.count):
+        try:
+            flags, relays, inputs, rtt = c.command(args.set, args.clr, args.tgl)
+        except socket.timeout:
+            lost += 1
+            if not args.quiet:
+                print("timeout")
+        except RuntimeError as e:
+            print(e, file=sys.stderr)
+            return 2
+        else:
+            rtts.append(rtt)
+            if not args.quiet:
+                print("relays=0x%08X inputs=0x%08X flags=%s rtt=%.2f ms" % (relays, inputs, fmt_flags(flags), rtt * 1000))
+        if args.interval and i + 1 < args.count:
+            time.sleep(args.interval)
+
+    if args.count > 1 and rtts:
+        rtts.sort()
+        pick = lambda q: rtts[min(len(rtts) - 1, int(q * len(rtts)))] * 1000
+        print("%d sent, %d lost, rtt p50 %.2f ms, p99 %.2f ms, max %.2f ms"
+              % (args.count, lost, pick(0.5), pick(0.99), rtts[-1] * 1000))
+    return 1 if lost == args.count else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())